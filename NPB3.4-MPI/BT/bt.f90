@@ -218,8 +218,8 @@
        call mpi_checkpoint_restore(comm_setup, checkpoint, error)
        if (error .eq. 0) then
            call mpi_checkpoint_read(checkpoint, step_min, 1, MPI_INTEGER, error)
-           call mpi_checkpoint_read(checkpoint, u, size(u), MPI_DOUBLE_PRECISION, error)
-           call mpi_checkpoint_read(checkpoint, rhs, size(rhs), MPI_DOUBLE_PRECISION, error)
+           call mpi_checkpoint_read_c(checkpoint, u, size(u, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, error)
+           call mpi_checkpoint_read_c(checkpoint, rhs, size(rhs, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, error)
            call mpi_checkpoint_close(checkpoint, error)
        endif
 
@@ -229,8 +229,8 @@
               call mpi_checkpoint_create(comm_setup, checkpoint, error)
               if (error .eq. 0) then
                   call mpi_checkpoint_write(checkpoint, step, 1, MPI_INTEGER, error)
-                  call mpi_checkpoint_write(checkpoint, u, size(u), MPI_DOUBLE_PRECISION, error)
-                  call mpi_checkpoint_write(checkpoint, rhs, size(rhs), MPI_DOUBLE_PRECISION, error)
+                  call mpi_checkpoint_write_c(checkpoint, u, size(u, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, error)
+                  call mpi_checkpoint_write_c(checkpoint, rhs, size(rhs, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, error)
                   call mpi_checkpoint_close(checkpoint, error)
               endif
           endif
@@ -243,7 +243,9 @@
              endif
           endif
 
+          call mpi_checkpoint_trace_begin('adi', error)
           call adi
+          call mpi_checkpoint_trace_end('adi', error)
 
           if (iotype .ne. 0) then
               if (mod(step, wr_interval).eq.0 .or. step .eq. niter) then
@@ -313,7 +313,9 @@
       call mpi_checkpoint_restore(comm_solve, checkpoint, ierr)
       if (ierr .eq. 0) then
           call mpi_checkpoint_read(checkpoint, it_min, 1, MPI_INTEGER, ierr)
-          call mpi_checkpoint_read(checkpoint, x, size(x), MPI_DOUBLE_PRECISION, ierr)
+          call mpi_checkpoint_read_subarray(checkpoint, x, 1, na,  &
+     &         lastcol-firstcol+1, firstcol-1, MPI_ORDER_FORTRAN,  &
+     &         MPI_DOUBLE_PRECISION, ierr)
           call mpi_checkpoint_close(checkpoint, ierr)
       endif
 
@@ -328,14 +330,18 @@
              call mpi_checkpoint_create(comm_solve, checkpoint, ierr)
              if (ierr .eq. 0) then
                  call mpi_checkpoint_write(checkpoint, it, 1, MPI_INTEGER, ierr)
-                 call mpi_checkpoint_write(checkpoint, x, size(x), MPI_DOUBLE_PRECISION, ierr)
+                 call mpi_checkpoint_write_subarray(checkpoint, x, 1, na,  &
+     &                lastcol-firstcol+1, firstcol-1, MPI_ORDER_FORTRAN,  &
+     &                MPI_DOUBLE_PRECISION, ierr)
                  call mpi_checkpoint_close(checkpoint, ierr)
              endif
          endif
 !---------------------------------------------------------------------
 !  The call to the conjugate gradient routine:
 !---------------------------------------------------------------------
+         call mpi_checkpoint_trace_begin('conj_grad', ierr)
          call conj_grad ( rnorm )
+         call mpi_checkpoint_trace_end('conj_grad', ierr)
 
 
 !---------------------------------------------------------------------
@@ -393,6 +399,7 @@
             x(j) = norm_temp1(2)*z(j)    
          enddo                           
 
+         call mpi_checkpoint_iteration()
 
       enddo                              ! end of main iter inv pow meth
 
@@ -58,7 +58,8 @@
       include 'mpi_checkpointf.h'
 
       double precision Mops, t1, t2, t3, t4, x1,  &
-     &                 x2, sx, sy, tm, an, tt, gc, dum(3)
+     &                 x2, tm, an, tt, dum(3)
+      double precision, target :: sx, sy, gc
 
       integer          i, ik, kk, l, k, nit, no_large_nodes,  &
      &                 np, np_add, k_offset, j
@@ -78,15 +79,12 @@
      &                 tming(t_last+2), tmaxg(t_last+2)
       character        t_recs(t_last+2)*8
 
-      integer          checkpoint
-
       data             dum /1.d0, 1.d0, 1.d0/
 
       data t_recs/'total', 'gpairs', 'randn', 'rcomm',  &
      &            ' totcomp', ' totcomm'/
 
 
-      checkpoint = MPI_CHECKPOINT_NULL
       call mpi_init(ierr)
       comm_solve = MPI_COMM_WORLD
       call mpi_comm_rank(comm_solve,node,ierr)
@@ -149,14 +147,11 @@
          stop
       endif
 
-      call mpi_checkpoint_restore(comm_solve, checkpoint, ierr)
-      if (ierr .eq. 0) then
-          call mpi_checkpoint_read(checkpoint, sx, 1, dp_type, ierr)
-          call mpi_checkpoint_read(checkpoint, sy, 1, dp_type, ierr)
-          call mpi_checkpoint_read(checkpoint, gc, 1, dp_type, ierr)
-          call mpi_checkpoint_close(checkpoint, ierr)
-          goto 1234
-      endif
+      call mpi_checkpoint_register(sx, 1, dp_type, 'sx', ierr)
+      call mpi_checkpoint_register(sy, 1, dp_type, 'sy', ierr)
+      call mpi_checkpoint_register(gc, 1, dp_type, 'gc', ierr)
+      call mpi_checkpoint_recover(comm_solve, ierr)
+      if (ierr .eq. 0) goto 1234
 
 !   Call the random number generator functions and initialize
 !   the x-array to reduce the effects of paging on the timings.
@@ -283,13 +278,7 @@
      &                   MPI_MAX, comm_solve, ierr)
       tm = x(1)
 
-      call mpi_checkpoint_create(comm_solve, checkpoint, ierr)
-      if (ierr .eq. 0) then
-          call mpi_checkpoint_write(checkpoint, sx, 1, dp_type, ierr)
-          call mpi_checkpoint_write(checkpoint, sy, 1, dp_type, ierr)
-          call mpi_checkpoint_write(checkpoint, gc, 1, dp_type, ierr)
-          call mpi_checkpoint_close(checkpoint, ierr)
-      endif
+      call mpi_checkpoint_commit(comm_solve, ierr)
 
 1234  if (node.eq.root) then
          call verify(m, sx, sy, gc, verified, classv)
@@ -89,6 +89,7 @@
 
       integer i, ierr
       integer checkpoint, iter_min
+      integer sizes(3), subsizes(3), starts(3), checkpoint_layout
 
       integer iter
       double precision total_time, mflops
@@ -149,10 +150,16 @@
       if (ierr .eq. 0) then
           call mpi_checkpoint_read(checkpoint, iter_min, 1, MPI_INTEGER, ierr)
           call mpi_checkpoint_read(checkpoint, sums, size(sums), MPI_DOUBLE_COMPLEX, ierr)
-          call mpi_checkpoint_read(checkpoint, u, size(u), MPI_DOUBLE_COMPLEX, ierr)
-          call mpi_checkpoint_read(checkpoint, u0, size(u0), MPI_DOUBLE_COMPLEX, ierr)
-          call mpi_checkpoint_read(checkpoint, u1, size(u1), MPI_DOUBLE_COMPLEX, ierr)
-          call mpi_checkpoint_read(checkpoint, u2, size(u2), MPI_DOUBLE_COMPLEX, ierr)
+          call mpi_checkpoint_read(checkpoint, checkpoint_layout, 1, MPI_INTEGER, ierr)
+          call checkpoint_block(sizes, subsizes, starts)
+          call mpi_checkpoint_read_subarray(checkpoint, u0, 3, sizes,  &
+     &         subsizes, starts, MPI_ORDER_FORTRAN, MPI_DOUBLE_COMPLEX, ierr)
+          if ((checkpoint_layout .eq. layout_0d) .neqv.  &
+     &        (layout_type .eq. layout_0d)) ierr = 1
+          if (ierr .ne. 0) then
+             if (me .eq. 0) write(*,*) 'Unable to restore u0 from the checkpoint'
+             call MPI_Abort(MPI_COMM_WORLD, 1, ierr)
+          endif
           call mpi_checkpoint_close(checkpoint, ierr)
       endif
 
@@ -163,10 +170,10 @@
              if (ierr .eq. 0) then
                  call mpi_checkpoint_write(checkpoint, iter, 1, MPI_INTEGER, ierr)
                  call mpi_checkpoint_write(checkpoint, sums, size(sums), MPI_DOUBLE_COMPLEX, ierr)
-                 call mpi_checkpoint_write(checkpoint, u, size(u), MPI_DOUBLE_COMPLEX, ierr)
-                 call mpi_checkpoint_write(checkpoint, u0, size(u0), MPI_DOUBLE_COMPLEX, ierr)
-                 call mpi_checkpoint_write(checkpoint, u1, size(u1), MPI_DOUBLE_COMPLEX, ierr)
-                 call mpi_checkpoint_write(checkpoint, u2, size(u2), MPI_DOUBLE_COMPLEX, ierr)
+                 call mpi_checkpoint_write(checkpoint, layout_type, 1, MPI_INTEGER, ierr)
+                 call checkpoint_block(sizes, subsizes, starts)
+                 call mpi_checkpoint_write_subarray(checkpoint, u0, 3, sizes,  &
+     &                subsizes, starts, MPI_ORDER_FORTRAN, MPI_DOUBLE_COMPLEX, ierr)
                  call mpi_checkpoint_close(checkpoint, ierr)
              endif
          endif
@@ -182,6 +189,7 @@
          if (timers_enabled) call timer_start(T_checksum)
          call checksum(iter, u2, dims(1,1), dims(2,1), dims(3,1))
          if (timers_enabled) call timer_stop(T_checksum)
+         call mpi_checkpoint_iteration()
       end do
 
       call verify(niter, verified, class)
@@ -209,6 +217,54 @@
       call MPI_Checkpoint_finalize(ierr)
       end
 
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine checkpoint_block(sizes, subsizes, starts)
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+!---------------------------------------------------------------------
+! u0 is the only distributed array that is saved in the checkpoint:
+! u1 and u2 are computed from u0 in each iteration. The position of
+! the block of u0 in the global array is saved as well, so that the
+! program can be restarted with different number of processes.
+! u0 is in fourier space, i.e. it has the layout of the third phase:
+! xyz for 0d layout and zxy for 1d and 2d layouts. Hence the checkpoint
+! can not be redistributed between 0d and the other layouts.
+!---------------------------------------------------------------------
+
+      use ft_data
+      implicit none
+
+      integer sizes(3), subsizes(3), starts(3)
+
+      if (layout_type .eq. layout_0d) then
+         sizes(1) = nx
+         sizes(2) = ny
+         sizes(3) = nz
+         subsizes(1) = xend(3) - xstart(3) + 1
+         subsizes(2) = yend(3) - ystart(3) + 1
+         subsizes(3) = zend(3) - zstart(3) + 1
+         starts(1) = xstart(3) - 1
+         starts(2) = ystart(3) - 1
+         starts(3) = zstart(3) - 1
+      else
+         sizes(1) = nz
+         sizes(2) = nx
+         sizes(3) = ny
+         subsizes(1) = zend(3) - zstart(3) + 1
+         subsizes(2) = xend(3) - xstart(3) + 1
+         subsizes(3) = yend(3) - ystart(3) + 1
+         starts(1) = zstart(3) - 1
+         starts(2) = xstart(3) - 1
+         starts(3) = ystart(3) - 1
+      endif
+
+      return
+      end
+
 !---------------------------------------------------------------------
 !---------------------------------------------------------------------
 
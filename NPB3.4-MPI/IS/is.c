@@ -351,9 +351,10 @@ void alloc_space(void)
       size_of_buffers = 13*num_keys/2;
 
    /* allocate space */
-   key_array = (INT_TYPE *)malloc(sizeof(INT_TYPE)*size_of_buffers);
-   key_buff1 = (INT_TYPE *)malloc(sizeof(INT_TYPE)*size_of_buffers);
-   key_buff2 = (INT_TYPE *)malloc(sizeof(INT_TYPE)*size_of_buffers);
+   /* the keys are checkpointed as one region of the arena */
+   key_array = (INT_TYPE *)MPI_Checkpoint_arena_alloc(sizeof(INT_TYPE)*size_of_buffers);
+   key_buff1 = (INT_TYPE *)MPI_Checkpoint_arena_alloc(sizeof(INT_TYPE)*size_of_buffers);
+   key_buff2 = (INT_TYPE *)MPI_Checkpoint_arena_alloc(sizeof(INT_TYPE)*size_of_buffers);
 
    send_count = (int *)malloc(sizeof(int)*comm_size);
    recv_count = (int *)malloc(sizeof(int)*comm_size);
@@ -1101,30 +1102,17 @@ int main( int argc, char **argv )
     timer_start( 0 );
 
 
-    MPI_Checkpoint checkpoint = MPI_CHECKPOINT_NULL;
-    int ret = MPI_Checkpoint_restore(MPI_COMM_WORLD, &checkpoint);
-    if (ret == MPI_SUCCESS) {
-        MPI_Checkpoint_read(checkpoint, &iteration_min, 1, MPI_INT);
-        MPI_Checkpoint_read(checkpoint, key_array, size_of_buffers, MP_KEY_TYPE);
-        MPI_Checkpoint_read(checkpoint, key_buff1, size_of_buffers, MP_KEY_TYPE);
-        MPI_Checkpoint_read(checkpoint, key_buff2, size_of_buffers, MP_KEY_TYPE);
-        MPI_Checkpoint_read(checkpoint, &passed_verification, 1, MPI_INT);
-        MPI_Checkpoint_close(&checkpoint);
+    MPI_Checkpoint_register(&iteration, 1, MPI_INT, "iteration");
+    MPI_Checkpoint_register(&passed_verification, 1, MPI_INT, "passed_verification");
+    if (MPI_Checkpoint_recover(MPI_COMM_WORLD) == MPI_SUCCESS) {
+        iteration_min = iteration;
     }
 /*  This is the main iteration */
     for( iteration=iteration_min; iteration<=MAX_ITERATIONS; iteration++ )
     {
         if( my_rank == 0 && CLASS != 'S' ) printf( "        %d\n", iteration );
         if (iteration == MAX_ITERATIONS/2 && iteration_min == 1) {
-            int ret = MPI_Checkpoint_create(MPI_COMM_WORLD, &checkpoint);
-            if (ret == MPI_SUCCESS) {
-                MPI_Checkpoint_write(checkpoint, &iteration, 1, MPI_INT);
-                MPI_Checkpoint_write(checkpoint, key_array, size_of_buffers, MP_KEY_TYPE);
-                MPI_Checkpoint_write(checkpoint, key_buff1, size_of_buffers, MP_KEY_TYPE);
-                MPI_Checkpoint_write(checkpoint, key_buff2, size_of_buffers, MP_KEY_TYPE);
-                MPI_Checkpoint_write(checkpoint, &passed_verification, 1, MPI_INT);
-                MPI_Checkpoint_close(&checkpoint);
-            }
+            MPI_Checkpoint_commit(MPI_COMM_WORLD);
         }
         rank( iteration );
     }
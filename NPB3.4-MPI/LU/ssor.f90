@@ -85,10 +85,10 @@
           call mpi_checkpoint_read(checkpoint, rsdnm, size(rsdnm), MPI_DOUBLE_PRECISION, IERROR)
           call mpi_checkpoint_read(checkpoint, errnm, size(errnm), MPI_DOUBLE_PRECISION, IERROR)
           call mpi_checkpoint_read(checkpoint, frc, 1, MPI_DOUBLE_PRECISION, IERROR)
-          call mpi_checkpoint_read(checkpoint, u, size(u), MPI_DOUBLE_PRECISION, IERROR)
-          call mpi_checkpoint_read(checkpoint, rsd, size(rsd), MPI_DOUBLE_PRECISION, IERROR)
-          call mpi_checkpoint_read(checkpoint, frct, size(frct), MPI_DOUBLE_PRECISION, IERROR)
-          call mpi_checkpoint_read(checkpoint, flux, size(flux), MPI_DOUBLE_PRECISION, IERROR)
+          call mpi_checkpoint_read_c(checkpoint, u, size(u, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, IERROR)
+          call mpi_checkpoint_read_c(checkpoint, rsd, size(rsd, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, IERROR)
+          call mpi_checkpoint_read_c(checkpoint, frct, size(frct, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, IERROR)
+          call mpi_checkpoint_read_c(checkpoint, flux, size(flux, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, IERROR)
           call mpi_checkpoint_close(checkpoint, IERROR)
       endif
 
@@ -104,10 +104,10 @@
                  call mpi_checkpoint_write(checkpoint, rsdnm, size(rsdnm), MPI_DOUBLE_PRECISION, IERROR)
                  call mpi_checkpoint_write(checkpoint, errnm, size(errnm), MPI_DOUBLE_PRECISION, IERROR)
                  call mpi_checkpoint_write(checkpoint, frc, 1, MPI_DOUBLE_PRECISION, IERROR)
-                 call mpi_checkpoint_write(checkpoint, u, size(u), MPI_DOUBLE_PRECISION, IERROR)
-                 call mpi_checkpoint_write(checkpoint, rsd, size(rsd), MPI_DOUBLE_PRECISION, IERROR)
-                 call mpi_checkpoint_write(checkpoint, frct, size(frct), MPI_DOUBLE_PRECISION, IERROR)
-                 call mpi_checkpoint_write(checkpoint, flux, size(flux), MPI_DOUBLE_PRECISION, IERROR)
+                 call mpi_checkpoint_write_c(checkpoint, u, size(u, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, IERROR)
+                 call mpi_checkpoint_write_c(checkpoint, rsd, size(rsd, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, IERROR)
+                 call mpi_checkpoint_write_c(checkpoint, frct, size(frct, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, IERROR)
+                 call mpi_checkpoint_write_c(checkpoint, flux, size(flux, kind=MPI_COUNT_KIND), MPI_DOUBLE_PRECISION, IERROR)
                  call mpi_checkpoint_close(checkpoint, IERROR)
              endif
          endif
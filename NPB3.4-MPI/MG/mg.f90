@@ -54,11 +54,10 @@
       use mg_data
       use mg_fields
       use mpinpb
+      use mpi_checkpoint_f08
 
       implicit none
 
-      include 'mpi_checkpointf.h'
-
 !---------------------------------------------------------------------------c
 ! k is the current level. It is passed down through subroutine args
 ! and is NOT global. it is the current iteration
@@ -289,10 +288,13 @@
       call mpi_checkpoint_restore(comm_work, checkpoint, ierr)
       if (ierr .eq. 0) then
           call mpi_checkpoint_read(checkpoint, it_min, 1, MPI_INTEGER, ierr)
-          call mpi_checkpoint_read(checkpoint, u, size(u), MPI_DOUBLE_PRECISION, ierr)
-          call mpi_checkpoint_read(checkpoint, v, size(v), MPI_DOUBLE_PRECISION, ierr)
-          call mpi_checkpoint_read(checkpoint, r, size(r), MPI_DOUBLE_PRECISION, ierr)
+          call read_checkpoint(checkpoint, u, n1, n2, n3, ierr)
           call mpi_checkpoint_close(checkpoint, ierr)
+!---------------------------------------------------------------------
+! v is the same after setup and r is computed from u and v
+!---------------------------------------------------------------------
+          call comm3(u,n1,n2,n3,k)
+          call resid(u,v,r,n1,n2,n3,a,k)
       endif
 
       do  it=it_min,nit
@@ -300,9 +302,7 @@
              call mpi_checkpoint_create(comm_work, checkpoint, ierr)
              if (ierr .eq. 0) then
                  call mpi_checkpoint_write(checkpoint, it, 1, MPI_INTEGER, ierr)
-                 call mpi_checkpoint_write(checkpoint, u, size(u), MPI_DOUBLE_PRECISION, ierr)
-                 call mpi_checkpoint_write(checkpoint, v, size(v), MPI_DOUBLE_PRECISION, ierr)
-                 call mpi_checkpoint_write(checkpoint, r, size(r), MPI_DOUBLE_PRECISION, ierr)
+                 call write_checkpoint(checkpoint, u, n1, n2, n3, ierr)
                  call mpi_checkpoint_close(checkpoint, ierr)
              endif
          endif
@@ -2599,5 +2599,86 @@
       return
       end
 
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine write_checkpoint(checkpoint, u, n1, n2, n3, ierr)
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+!---------------------------------------------------------------------
+! write the interior of the finest grid as a block of the global array,
+! so that the program can be restarted with different number of processes
+!---------------------------------------------------------------------
+
+      use mg_data
+      use mpinpb
+      use mpi_checkpoint_f08
+      implicit none
+
+      integer checkpoint, n1, n2, n3, ierr
+      double precision u(n1,n2,n3)
+      integer sizes(3), subsizes(3), starts(3)
+
+      call checkpoint_block(sizes, subsizes, starts)
+      call mpi_checkpoint_write_subarray(checkpoint, u(2:n1-1,2:n2-1,2:n3-1),  &
+     &     3, sizes, subsizes, starts, MPI_ORDER_FORTRAN,  &
+     &     MPI_DOUBLE_PRECISION, ierr)
+
+      return
+      end
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine read_checkpoint(checkpoint, u, n1, n2, n3, ierr)
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      use mg_data
+      use mpinpb
+      use mpi_checkpoint_f08
+      implicit none
+
+      integer checkpoint, n1, n2, n3, ierr
+      double precision u(n1,n2,n3)
+      integer sizes(3), subsizes(3), starts(3)
+
+      call checkpoint_block(sizes, subsizes, starts)
+      call mpi_checkpoint_read_subarray(checkpoint, u(2:n1-1,2:n2-1,2:n3-1),  &
+     &     3, sizes, subsizes, starts, MPI_ORDER_FORTRAN,  &
+     &     MPI_DOUBLE_PRECISION, ierr)
+
+      return
+      end
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine checkpoint_block(sizes, subsizes, starts)
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      use mg_data
+      implicit none
+
+      integer sizes(3), subsizes(3), starts(3)
+
+      sizes(1) = nx(lt)
+      sizes(2) = ny(lt)
+      sizes(3) = nz(lt)
+      subsizes(1) = ie1 - is1 + 1
+      subsizes(2) = ie2 - is2 + 1
+      subsizes(3) = ie3 - is3 + 1
+      starts(1) = is1 - 2
+      starts(2) = is2 - 2
+      starts(3) = is3 - 2
+
+      return
+      end
+
 
 !----- end of program ------------------------------------------------
@@ -180,7 +180,9 @@
               endif
           endif
 
+          call mpi_checkpoint_trace_begin('adi', error)
           call adi
+          call mpi_checkpoint_trace_end('adi', error)
 
        end do
 
@@ -244,5 +246,6 @@
  999   continue
        call mpi_barrier(MPI_COMM_WORLD, error)
        call mpi_finalize(error)
+       call mpi_checkpoint_finalize(error)
 
        end
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "mpi.h"
+#include "mpi_checkpoint.h"
 
 static double start[64], elapsed[64];
 
@@ -20,6 +21,7 @@ void timer_clear( int n )
 void timer_start( int n )
 {
     start[n] = MPI_Wtime();
+    MPI_Checkpoint_trace_timer_start( n );
 }
 
 
@@ -33,6 +35,7 @@ void timer_stop( int n )
     now = MPI_Wtime();
     t = now - start[n];
     elapsed[n] += t;
+    MPI_Checkpoint_trace_timer_stop( n );
 
 }
 
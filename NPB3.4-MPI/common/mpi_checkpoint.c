@@ -6,19 +6,134 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <linux/userfaultfd.h>
 
 enum checkpoint_flags { CHECKPOINT_READ_ONLY = 1, CHECKPOINT_WRITE_ONLY = 2 };
 
+#define CHECKPOINT_MAX_DIMS 4
+#define CHECKPOINT_RANKS_PER_DIRECTORY 256
+#define CHECKPOINT_MAX_STRIPES 16
+
+enum checkpoint_record_kind { CHECKPOINT_RECORD_PLAIN = 0, CHECKPOINT_RECORD_SUBARRAY = 1 };
+
+/* The codec of the compressed record: the codec id, the filters and the level (bits 16-23). */
+enum checkpoint_codec {
+    CHECKPOINT_CODEC_NONE = 0,
+    CHECKPOINT_CODEC_DEFLATE = 1,
+    CHECKPOINT_CODEC_LZ = 2,
+    /* the bytes of each chunk are shuffled before the compression */
+    CHECKPOINT_FILTER_SHUFFLE = 0x100
+};
+
+/*
+Table of contents entry that describes the data written by one call
+to MPI_Checkpoint_write or MPI_Checkpoint_write_subarray.
+Subarray dimensions are stored in C order (the last dimension changes fastest).
+*/
+struct checkpoint_record {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t kind;
+    uint32_t element_size;
+    uint32_t ndims;
+    /* the codec of the compressed record (see checkpoint_codec) or 0 */
+    uint32_t codec;
+    uint64_t sizes[CHECKPOINT_MAX_DIMS];
+    uint64_t subsizes[CHECKPOINT_MAX_DIMS];
+    uint64_t starts[CHECKPOINT_MAX_DIMS];
+};
+
+/*
+The footer is written at the end of the checkpoint file after the table of contents.
+Files without the footer are read as a plain sequence of bytes.
+*/
+struct checkpoint_footer {
+    char magic[8];
+    uint64_t records_offset;
+    uint64_t num_records;
+    uint32_t version;
+    /* the number of ranks that created the checkpoint */
+    uint32_t nprocs;
+};
+
+static const char checkpoint_magic[8] = "MPICKPT";
+
+/*
+The files of version 2 contain the checksum of the data and the table of contents
+between the table of contents and the footer. The checksum is the sum of
+the 32-bit words and the sum of the partial sums (Fletcher's checksum modulo 2^64).
+*/
+struct checkpoint_checksum {
+    uint64_t sum;
+    uint64_t weighted_sum;
+};
+
+/* Per-phase counters that are collected for each checkpoint. */
+enum checkpoint_counter {
+    CHECKPOINT_MKDIR = 0,
+    CHECKPOINT_OPEN,
+    /* ftruncate and mremap */
+    CHECKPOINT_GROW,
+    /* memcpy to/from the mapping */
+    CHECKPOINT_COPY,
+    CHECKPOINT_COMPRESS,
+    CHECKPOINT_SYNC,
+    CHECKPOINT_CLOSE,
+    CHECKPOINT_TOTAL,
+    /* the number of bytes written/read */
+    CHECKPOINT_BYTES,
+    /* page faults of the calling thread */
+    CHECKPOINT_MINOR_FAULTS,
+    CHECKPOINT_MAJOR_FAULTS,
+    CHECKPOINT_NUM_COUNTERS
+};
+
+static const char* checkpoint_counter_names[CHECKPOINT_NUM_COUNTERS] = {
+    "mkdir", "open", "grow", "copy", "compress", "sync", "close", "total", "bytes",
+    "minor_faults", "major_faults"
+};
+
+/*
+The stream of each rank is split into stripes of "size" bytes that are stored
+in the files in the directories (one file per directory) in round-robin order:
+the stripe "k" is stored in the file "k % count" at offset "(k / count)*size".
+All stripes are mapped to the contiguous range of addresses, so that
+the striped stream is read and written in the same way as one file.
+The description of the stripes is stored in the file "stripes" in the checkpoint directory.
+*/
+struct checkpoint_stripes {
+    size_t size;
+    int count;
+    char directories[CHECKPOINT_MAX_STRIPES][4096];
+};
+
+/* Checkpoint file of another rank that is mapped for reading. */
+struct checkpoint_file {
+    int fd;
+    void* data;
+    size_t size;
+    /* the size of the data without the table of contents */
+    size_t data_size;
+};
+
 struct mpi_checkpoint {
     int fd;
     void* data;
@@ -28,47 +143,3214 @@ struct mpi_checkpoint {
     size_t start;
     enum checkpoint_flags flags;
     MPI_Comm communicator;
+    /* table of contents */
+    struct checkpoint_record* records;
+    size_t num_records;
+    size_t max_records;
+    /* the size of the data without the table of contents */
+    size_t data_size;
+    /* the number of ranks that created the checkpoint */
+    int nprocs;
+    /* N-to-M restore: the table of contents of all ranks that created
+       the checkpoint (nprocs*num_records entries) and their files
+       that are opened on demand */
+    struct checkpoint_record* all_records;
+    struct checkpoint_file* files;
+    char directory[4096];
+    /* the time when the checkpoint was created/restored */
+    time_t timestamp;
+    double counters[CHECKPOINT_NUM_COUNTERS];
+    /* the file is kept open and mapped after close to be reused by the next checkpoints */
+    int reuse_file;
+    /* the next closed handle in the pool */
+    struct mpi_checkpoint* next_free;
+    /* protects the mapping from being moved by the write functions (checkpoint_grow)
+       while other threads copy the data in MPI_Checkpoint_write_at/read_at */
+    pthread_rwlock_t mapping_lock;
+    /* the index in the table of fortran checkpoints or -1 */
+    int f_handle;
+    /* the difference between the written and the stored bytes due to compression */
+    size_t bytes_saved;
+    /* the index of the record after the last record that was read */
+    size_t next_record;
+    /* the stripes of the checkpoint files or 0 if the files are not striped */
+    struct checkpoint_stripes* stripes;
+    /* the files of the stripes that are written and the size of the reserved address range */
+    int stripe_fds[CHECKPOINT_MAX_STRIPES];
+    size_t reserved_size;
+    /* the payloads of the records decompressed by the prefetch thread or 0 */
+    char** staged;
+    size_t num_staged;
+    /* the mapping that is used by the lazy restore or 0 */
+    struct checkpoint_lazy_source* lazy_source;
+    /* the rank of the process in the communicator of the checkpoint */
+    int rank;
+    /* the size of the write-behind window (0 if it is disabled) and the end of
+       the data that was passed to the storage */
+    size_t window;
+    size_t written;
+    /* the number of bytes reserved by MPI_Checkpoint_reserve_range, the number of bytes
+       copied by MPI_Checkpoint_write_at (atomic), and the offset of the first reserved
+       range that may not be filled if fewer bytes were copied than reserved */
+    size_t reserved_bytes;
+    size_t filled_bytes;
+    size_t unfilled;
+    /* the checkpoint file that is written by the drain thread or -1,
+       the data is staged in the memory file "fd" until then */
+    int drain_fd;
+};
+
+#define CHECKPOINT_MAX_SLOTS 16
+
+/*
+The file of the closed checkpoint that is kept open and mapped to be reused
+by one of the next checkpoints of the same communicator. When the file is reused
+it is moved to the new checkpoint directory and keeps its size and its mapping,
+i.e. the checkpoint of the same size is created without allocating memory
+and without growing the file.
+*/
+struct checkpoint_slot {
+    MPI_Comm communicator;
+    int nprocs;
+    char directory[4096];
+    int fd;
+    void* data;
+    size_t size;
+};
+
+/*
+The decision to create a checkpoint is made by rank 0 and is broadcast
+to all ranks of the communicator. The broadcast is non-blocking: it is started
+in the previous call to MPI_Checkpoint_create and is completed in the next call.
+*/
+struct checkpoint_decision {
+    MPI_Comm communicator;
+    MPI_Request request;
+    /* message[0] is non-zero if the checkpoint has to be created,
+       message[1] is the timestamp of the checkpoint */
+    long long message[2];
+};
+
+static char checkpoint_prefix[4096] = "checkpoint";
+/* minimum checkpoint interval in seconds */
+static int checkpoint_min_interval = 0;
+const size_t checkpoint_initial_size = 4096;
+static time_t last_checkpoint_timestamp = 0;
+/* the time of the last call to MPI_Checkpoint_create on rank 0 */
+static time_t last_create_timestamp = 0;
+static struct checkpoint_decision decision = {MPI_COMM_NULL, MPI_REQUEST_NULL, {0, 0}};
+static int finalize_keyval = MPI_KEYVAL_INVALID;
+static int initialized = 0;
+static int verbose = 0;
+static int no_checkpoint = 0;
+static int compression_level = 0;
+/* the codec selected by compression-codec, or -1 to use deflate if compression-level is set */
+static int compression_codec = -1;
+/* 0 --- no prefetch, 1 --- read the file, 2 --- read the file and decompress the records */
+static int restore_prefetch = 1;
+/* the name of the checkpoint from which we plan to restore the program */
+static const char* checkpoint_filename = 0;
+static mz_stream compressor = {0};
+static mz_stream decompressor = {0};
+static char* compression_buffer = 0;
+static double checkpoint_t0 = 0;
+static double checkpoint_t1 = 0;
+/* the file where the statistics of each checkpoint is appended */
+static char statistics_filename[4096] = "";
+static MPI_Op statistics_op = MPI_OP_NULL;
+/*
+Performance variables that are accumulated over all checkpoints
+created/restored by this process.
+*/
+enum checkpoint_pvar_index {
+    CHECKPOINT_PVAR_BYTES_WRITTEN = 0,
+    CHECKPOINT_PVAR_BYTES_READ,
+    CHECKPOINT_PVAR_BYTES_STORED,
+    CHECKPOINT_PVAR_NUM_CREATED,
+    CHECKPOINT_PVAR_NUM_RESTORED,
+    CHECKPOINT_PVAR_CREATE_TIME,
+    CHECKPOINT_PVAR_RESTORE_TIME,
+    CHECKPOINT_PVAR_FLUSH_TIME,
+    CHECKPOINT_PVAR_LAST_CREATE_TIME,
+    CHECKPOINT_PVAR_LAST_RESTORE_TIME,
+    CHECKPOINT_PVAR_COMPRESSION_RATIO,
+    CHECKPOINT_PVAR_ASYNC_WRITES,
+    CHECKPOINT_PVAR_MINOR_FAULTS,
+    CHECKPOINT_PVAR_MAJOR_FAULTS,
+    CHECKPOINT_PVAR_DRAIN_RATE,
+    CHECKPOINT_NUM_PVARS
+};
+
+struct checkpoint_pvar {
+    const char* name;
+    const char* description;
+    /* the value is MPI_DOUBLE, otherwise MPI_UNSIGNED_LONG_LONG */
+    int is_double;
+};
+
+static const struct checkpoint_pvar checkpoint_pvars[CHECKPOINT_NUM_PVARS] = {
+    {"bytes_written", "the number of bytes written to checkpoints", 0},
+    {"bytes_read", "the number of bytes read from checkpoints", 0},
+    {"bytes_stored", "the number of bytes stored in checkpoint files after compression", 0},
+    {"num_created", "the number of created checkpoints", 0},
+    {"num_restored", "the number of restored checkpoints", 0},
+    {"create_time", "total time from the creation to the closing of checkpoints (s)", 1},
+    {"restore_time", "total time from the restoration to the closing of checkpoints (s)", 1},
+    {"flush_time", "total time spent synchronizing checkpoint files with the storage (s)", 1},
+    {"last_create_time", "the time from the creation to the closing of the last created "
+     "checkpoint (s)", 1},
+    {"last_restore_time", "the time from the restoration to the closing of the last restored "
+     "checkpoint (s)", 1},
+    {"compression_ratio", "bytes_written divided by bytes_stored", 1},
+    {"async_writes", "the number of outstanding asynchronous writes", 0},
+    {"minor_faults", "the number of minor page faults during checkpoints", 0},
+    {"major_faults", "the number of major page faults during checkpoints", 0},
+    {"drain_rate", "the current rate of the background drain (MB/s), 0 if unlimited", 1},
+};
+
+/* values are updated in MPI_Checkpoint_close and read by MPI_Checkpoint_pvar_read
+ * from any thread with "pvar_mutex" held */
+static unsigned long long pvar_counts[CHECKPOINT_NUM_PVARS];
+static double pvar_times[CHECKPOINT_NUM_PVARS];
+static pthread_mutex_t pvar_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* the number of checkpoints that are kept when the files are reused, 0 means no reuse */
+static int checkpoint_slots = 0;
+/* the files of the last checkpoints in the order of creation */
+static struct checkpoint_slot slots[CHECKPOINT_MAX_SLOTS];
+static int first_slot = 0;
+static int num_slots = 0;
+/* the directories of the checkpoints whose files were reused, they are
+   removed by rank 0 when all ranks moved their files */
+static struct checkpoint_slot stale_directories[CHECKPOINT_MAX_SLOTS];
+static int num_stale_directories = 0;
+/* closed handles that are reused by the next checkpoints */
+static struct mpi_checkpoint* free_checkpoints = 0;
+/* fortran checkpoints, the handle is the index in the table,
+   the unused entries are linked into the list of free entries */
+struct fortran_checkpoint {
+    MPI_Checkpoint checkpoint;
+    int next_free;
+};
+static struct fortran_checkpoint* checkpoints = 0;
+static int checkpoints_count = 0;
+static int first_free_checkpoint = -1;
+static pthread_mutex_t checkpoints_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t page_size = 4096;
+/* use transparent huge pages for the mappings */
+static int huge_pages = 0;
+static const size_t huge_page_size = 2UL*1024UL*1024UL;
+/* the granularity of growing and freeing the mappings */
+static size_t mapping_step = 4096;
+/* the directories where the files are striped (checkpoint-stripe-dirs) */
+static char stripe_directories[CHECKPOINT_MAX_STRIPES][4096];
+static int num_stripe_directories = 0;
+static size_t stripe_size = 16UL*1024UL*1024UL;
+/* the address and the size of the range that is reserved for the arena */
+static uintptr_t arena_address = 0x200000000000UL;
+static size_t arena_size = 64UL*1024UL*1024UL*1024UL;
+/* checksum the files and read them back in the background (background-validation) */
+static int background_validation = 0;
+
+/* Store the number of page faults of the calling thread in the counters. */
+static void checkpoint_faults(double* counters) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == -1) { return; }
+    counters[CHECKPOINT_MINOR_FAULTS] = usage.ru_minflt;
+    counters[CHECKPOINT_MAJOR_FAULTS] = usage.ru_majflt;
+}
+
+/*
+Ask the kernel to back the mapping with huge pages. This fails for the file systems
+that do not support huge pages, which is not an error.
+*/
+static void checkpoint_advise_huge_pages(void* data, size_t size) {
+    if (huge_pages) { madvise(data, size, MADV_HUGEPAGE); }
+}
+
+static inline double checkpoint_clock() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+/* Tracing. */
+
+enum { CHECKPOINT_TRACE_NAME_LENGTH = 32 };
+
+struct checkpoint_trace_event {
+    uint64_t timestamp_ns;
+    /* 'B' for begin and 'E' for end */
+    char phase;
+    char name[CHECKPOINT_TRACE_NAME_LENGTH];
+};
+
+/*
+Each thread records events in its own ring buffer. When the buffer is full
+the oldest events are overwritten. All buffers are linked together
+to write them at finalize.
+*/
+struct checkpoint_trace_buffer {
+    struct checkpoint_trace_buffer* next;
+    long thread_id;
+    /* the total number of events recorded by the thread */
+    size_t count;
+    struct checkpoint_trace_event events[];
+};
+
+/* the prefix of per-rank trace files, the tracing is disabled if empty */
+static char trace_filename[4096] = "";
+static int trace_enabled = 0;
+/* the capacity of each ring buffer (the number of events) */
+static size_t trace_buffer_size = 65536;
+static struct checkpoint_trace_buffer* trace_buffers = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct checkpoint_trace_buffer* trace_buffer = 0;
+/* MPI_Wtime and CLOCK_MONOTONIC at the same moment */
+static double trace_wtime_base = 0;
+static uint64_t trace_clock_base = 0;
+/* the difference between MPI_Wtime of rank 0 and this rank in seconds */
+static double trace_wtime_offset = 0;
+static int trace_rank = 0;
+
+static inline uint64_t checkpoint_trace_clock() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((uint64_t)t.tv_sec)*1000000000UL + t.tv_nsec;
+}
+
+static struct checkpoint_trace_buffer* checkpoint_trace_buffer_alloc() {
+    struct checkpoint_trace_buffer* buffer =
+        malloc(sizeof(struct checkpoint_trace_buffer) +
+               trace_buffer_size*sizeof(struct checkpoint_trace_event));
+    if (!buffer) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    buffer->thread_id = syscall(SYS_gettid);
+    buffer->count = 0;
+    pthread_mutex_lock(&trace_mutex);
+    buffer->next = trace_buffers;
+    trace_buffers = buffer;
+    pthread_mutex_unlock(&trace_mutex);
+    return buffer;
+}
+
+static void checkpoint_trace(char phase, const char* name) {
+    if (!trace_enabled) { return; }
+    uint64_t now = checkpoint_trace_clock();
+    if (!trace_buffer) { trace_buffer = checkpoint_trace_buffer_alloc(); }
+    struct checkpoint_trace_event* event =
+        trace_buffer->events + (trace_buffer->count % trace_buffer_size);
+    event->timestamp_ns = now;
+    event->phase = phase;
+    size_t i = 0;
+    for (; i<CHECKPOINT_TRACE_NAME_LENGTH-1 && name[i]; ++i) {
+        char ch = name[i];
+        event->name[i] = (ch == '"' || ch == '\\' || !isprint(ch)) ? '_' : ch;
+    }
+    event->name[i] = 0;
+    ++trace_buffer->count;
+}
+
+static inline void checkpoint_trace_begin(const char* name) {
+    if (trace_enabled) { checkpoint_trace('B', name); }
+}
+
+static inline void checkpoint_trace_end(const char* name) {
+    if (trace_enabled) { checkpoint_trace('E', name); }
+}
+
+/*
+Estimate the offset of MPI_Wtime of this rank relative to rank 0
+using the round trip with the minimum duration.
+*/
+static void checkpoint_trace_synchronize_clocks() {
+    int rank = 0, nranks = 1, flag = 0, *is_global = 0;
+    MPI_Comm comm = MPI_COMM_WORLD;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nranks);
+    trace_rank = rank;
+    MPI_Comm_get_attr(comm, MPI_WTIME_IS_GLOBAL, &is_global, &flag);
+    if (flag && *is_global) { return; }
+    const int tag = 4096, num_round_trips = 8;
+    for (int r=1; r<nranks; ++r) {
+        if (rank == 0) {
+            for (int i=0; i<num_round_trips; ++i) {
+                double t = 0;
+                MPI_Recv(&t, 1, MPI_DOUBLE, r, tag, comm, MPI_STATUS_IGNORE);
+                t = MPI_Wtime();
+                MPI_Send(&t, 1, MPI_DOUBLE, r, tag, comm);
+            }
+        } else if (rank == r) {
+            double min_round_trip = 1e100;
+            for (int i=0; i<num_round_trips; ++i) {
+                double t0 = MPI_Wtime(), t = 0;
+                MPI_Send(&t0, 1, MPI_DOUBLE, 0, tag, comm);
+                MPI_Recv(&t, 1, MPI_DOUBLE, 0, tag, comm, MPI_STATUS_IGNORE);
+                double t1 = MPI_Wtime();
+                if (t1-t0 < min_round_trip) {
+                    min_round_trip = t1-t0;
+                    trace_wtime_offset = t - 0.5*(t0+t1);
+                }
+            }
+        }
+    }
+}
+
+/*
+Write the events of all threads to "<trace-file>.<rank>.json" in Chrome trace format.
+The timestamps are MPI_Wtime of this rank in microseconds, the offset to
+the clock of rank 0 is stored in "otherData" and is applied by
+mpi_checkpoint_trace_merge.
+*/
+static void checkpoint_trace_write() {
+    if (!trace_enabled) { return; }
+    trace_enabled = 0;
+    char filename[4096+64];
+    snprintf(filename, sizeof(filename), "%s.%d.json", trace_filename, trace_rank);
+    FILE* file = fopen(filename, "w");
+    if (file == 0) {
+        fprintf(stderr, "unable to open \"%s\": %s\n", filename, strerror(errno));
+        return;
+    }
+    fprintf(file, "{\"otherData\": {\"rank\": %d, \"wtime_offset_us\": %.3f},\n",
+            trace_rank, trace_wtime_offset*1e6);
+    fprintf(file, "\"traceEvents\": [\n");
+    pthread_mutex_lock(&trace_mutex);
+    for (struct checkpoint_trace_buffer* b=trace_buffers; b; b=b->next) {
+        size_t first = (b->count > trace_buffer_size) ? b->count-trace_buffer_size : 0;
+        for (size_t i=first; i<b->count; ++i) {
+            const struct checkpoint_trace_event* e = b->events + (i % trace_buffer_size);
+            double ts = trace_wtime_base*1e6 + 1e-3*(double)(e->timestamp_ns - trace_clock_base);
+            fprintf(file, "{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, "
+                    "\"pid\": %d, \"tid\": %ld},\n",
+                    e->name, e->phase, ts, trace_rank, b->thread_id);
+        }
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"args\": {\"name\": \"rank %d\"}}\n", trace_rank, trace_rank);
+    fprintf(file, "]}\n");
+    if (fclose(file) == -1) { perror("fclose"); }
+}
+
+static void checkpoint_trace_init(int mpi_initialized) {
+    if (trace_filename[0] == 0 || trace_enabled) { return; }
+    if (mpi_initialized) {
+        checkpoint_trace_synchronize_clocks();
+        trace_wtime_base = MPI_Wtime();
+    }
+    trace_clock_base = checkpoint_trace_clock();
+    trace_enabled = 1;
+}
+
+/* Take the handle from the pool or allocate the new one. The table of contents is reused. */
+static struct mpi_checkpoint* checkpoint_alloc() {
+    struct mpi_checkpoint* checkpoint = free_checkpoints;
+    struct checkpoint_record* records = 0;
+    size_t max_records = 0;
+    if (checkpoint) {
+        free_checkpoints = checkpoint->next_free;
+        records = checkpoint->records;
+        max_records = checkpoint->max_records;
+    } else {
+        checkpoint = malloc(sizeof(struct mpi_checkpoint));
+        if (!checkpoint) {
+            fprintf(stderr, "not enough memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memset(checkpoint, 0, sizeof(struct mpi_checkpoint));
+    pthread_rwlock_init(&checkpoint->mapping_lock, 0);
+    checkpoint->f_handle = -1;
+    checkpoint->drain_fd = -1;
+    checkpoint->records = records;
+    checkpoint->max_records = max_records;
+    return checkpoint;
+}
+
+static void checkpoint_file_unmap(struct checkpoint_file* file) {
+    if (file->data && munmap(file->data, file->size) == -1) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+    file->data = 0;
+    if (file->fd != -1 && close(file->fd) == -1) {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+    file->fd = -1;
+}
+
+/* Map the file for reading. Returns -1 if the file can not be opened. */
+static int checkpoint_file_map(const char* filename, struct checkpoint_file* file) {
+    file->fd = open(filename, O_RDONLY|O_CLOEXEC);
+    file->data = 0;
+    file->size = 0;
+    file->data_size = 0;
+    if (file->fd == -1) { return -1; }
+    struct stat status;
+    if (fstat(file->fd, &status) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    file->size = status.st_size;
+    file->data_size = file->size;
+    if (file->size != 0) {
+        file->data = mmap(0, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (file->data == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        if (madvise(file->data, file->size, MADV_SEQUENTIAL) == -1) {
+            perror("madvise");
+            exit(EXIT_FAILURE);
+        }
+        checkpoint_advise_huge_pages(file->data, file->size);
+    }
+    return 0;
+}
+
+/* The size of the footer and the checksum that precedes it. */
+static size_t checkpoint_trailer_size(const struct checkpoint_footer* footer) {
+    return sizeof(struct checkpoint_footer) +
+           (footer->version >= 2 ? sizeof(struct checkpoint_checksum) : 0);
+}
+
+/* Returns -1 if the footer at the end of the file of "size" bytes is corrupted. */
+static int checkpoint_check_footer(const struct checkpoint_footer* footer, size_t size) {
+    if (memcmp(footer->magic, checkpoint_magic, sizeof(checkpoint_magic)) != 0) { return -1; }
+    const size_t trailer_size = checkpoint_trailer_size(footer);
+    if (size < trailer_size) { return -1; }
+    size_t toc_size = footer->num_records*sizeof(struct checkpoint_record);
+    if (footer->records_offset > size - trailer_size ||
+        footer->num_records > size/sizeof(struct checkpoint_record) ||
+        footer->records_offset + toc_size > size - trailer_size) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns -1 if the payload of any record is outside of the data. */
+static int checkpoint_check_records(const struct checkpoint_footer* footer,
+                                    const struct checkpoint_record* records) {
+    for (size_t i=0; i<footer->num_records; ++i) {
+        const struct checkpoint_record* r = records + i;
+        /* the size of the compressed record is stored in the record */
+        const uint64_t size = r->codec == CHECKPOINT_CODEC_NONE ? r->size : sizeof(uint64_t);
+        if (r->offset > footer->records_offset ||
+            size > footer->records_offset - r->offset ||
+            r->ndims > CHECKPOINT_MAX_DIMS) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+Read the footer and the table of contents of the mapped file.
+Returns -1 if the file does not have the footer, or the footer is corrupted.
+The records are allocated with malloc.
+*/
+static int checkpoint_file_read_toc(struct checkpoint_file* file,
+                                    struct checkpoint_footer* footer,
+                                    struct checkpoint_record** records) {
+    *records = 0;
+    if (file->size < sizeof(struct checkpoint_footer)) { return -1; }
+    memcpy(footer, ((char*)file->data) + file->size - sizeof(struct checkpoint_footer),
+           sizeof(struct checkpoint_footer));
+    if (checkpoint_check_footer(footer, file->size) == -1) { return -1; }
+    size_t toc_size = footer->num_records*sizeof(struct checkpoint_record);
+    *records = malloc(toc_size + 1);
+    if (!*records) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(*records, ((char*)file->data) + footer->records_offset, toc_size);
+    if (checkpoint_check_records(footer, *records) == -1) {
+        free(*records);
+        *records = 0;
+        return -1;
+    }
+    file->data_size = footer->records_offset;
+    return 0;
+}
+
+/*
+The files of the ranks are grouped into subdirectories of 256 files
+to avoid contention on a single directory. The name of the subdirectory
+is the hexadecimal number of the group.
+*/
+static void checkpoint_subdirectory(char* path, size_t n, const char* directory, int rank) {
+    if (snprintf(path, n, "%s/%02x", directory, rank/CHECKPOINT_RANKS_PER_DIRECTORY) < 0) {
+        perror("snprintf");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void checkpoint_path(char* path, size_t n, const char* directory, int rank) {
+    if (snprintf(path, n, "%s/%02x/%d", directory,
+                 rank/CHECKPOINT_RANKS_PER_DIRECTORY, rank) < 0) {
+        perror("snprintf");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* The size of the file "i" of the stream of "size_in_bytes" bytes. */
+static size_t checkpoint_stripe_file_size(const struct checkpoint_stripes* stripes, int i,
+                                          size_t size_in_bytes) {
+    const size_t num_stripes = (size_in_bytes + stripes->size - 1) / stripes->size;
+    if (num_stripes <= i) { return 0; }
+    const size_t last = i + ((num_stripes-1-i)/stripes->count)*stripes->count;
+    const size_t last_size = size_in_bytes - last*stripes->size;
+    return (last/stripes->count)*stripes->size + (last_size < stripes->size ?
+                                                  last_size : stripes->size);
+}
+
+/*
+Reserve the range of addresses for the striped mapping. The stripes are mapped
+to the range with MAP_FIXED.
+*/
+static void* checkpoint_reserve_addresses(size_t size) {
+    void* data = mmap(0, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+/*
+Map the stripes of the file of the rank for reading. The stripes are read
+from all directories in parallel. Returns -1 if the files can not be opened.
+*/
+static int checkpoint_file_map_striped(char* path, size_t n,
+                                       const struct checkpoint_stripes* stripes, int rank,
+                                       struct checkpoint_file* file) {
+    int fds[CHECKPOINT_MAX_STRIPES];
+    size_t sizes[CHECKPOINT_MAX_STRIPES];
+    file->fd = -1;
+    file->data = 0;
+    file->size = 0;
+    file->data_size = 0;
+    if (stripes->count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i=0; i<stripes->count; ++i) {
+        checkpoint_path(path, n, stripes->directories[i], rank);
+        fds[i] = open(path, O_RDONLY|O_CLOEXEC);
+        struct stat status;
+        if (fds[i] == -1 || fstat(fds[i], &status) == -1) {
+            int error = errno;
+            for (int j=0; j<=i; ++j) { if (fds[j] != -1) { close(fds[j]); } }
+            errno = error;
+            return -1;
+        }
+        sizes[i] = status.st_size;
+        file->size += sizes[i];
+    }
+    int ret = 0;
+    for (int i=0; i<stripes->count; ++i) {
+        if (sizes[i] != checkpoint_stripe_file_size(stripes, i, file->size)) { ret = -1; }
+    }
+    if (ret == 0 && file->size != 0) {
+        char* data = checkpoint_reserve_addresses(file->size);
+        for (size_t offset=0, k=0; offset<file->size; offset+=stripes->size, ++k) {
+            size_t size = file->size - offset;
+            if (size > stripes->size) { size = stripes->size; }
+            if (mmap(data + offset, size, PROT_READ, MAP_PRIVATE|MAP_FIXED,
+                     fds[k % stripes->count], (k / stripes->count)*stripes->size) == MAP_FAILED) {
+                perror("mmap");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (madvise(data, file->size, MADV_SEQUENTIAL) == -1) {
+            perror("madvise");
+            exit(EXIT_FAILURE);
+        }
+        checkpoint_advise_huge_pages(data, file->size);
+        /* start reading all stripes asynchronously */
+        for (int i=0; i<stripes->count; ++i) {
+            posix_fadvise(fds[i], 0, 0, POSIX_FADV_WILLNEED);
+        }
+        file->data = data;
+        file->data_size = file->size;
+    }
+    /* the mappings keep the files open */
+    for (int i=1; i<stripes->count; ++i) { close(fds[i]); }
+    file->fd = fds[0];
+    if (ret == -1) {
+        checkpoint_path(path, n, stripes->directories[0], rank);
+        checkpoint_file_unmap(file);
+        errno = EINVAL;
+    }
+    return ret;
+}
+
+/*
+Map the file of the rank for reading. Checkpoints that were created without
+subdirectories are also supported. Returns -1 if the file can not be opened.
+*/
+static int checkpoint_file_map_rank(char* path, size_t n, const char* directory,
+                                    const struct checkpoint_stripes* stripes, int rank,
+                                    struct checkpoint_file* file) {
+    if (stripes) { return checkpoint_file_map_striped(path, n, stripes, rank, file); }
+    checkpoint_path(path, n, directory, rank);
+    if (checkpoint_file_map(path, file) == 0) { return 0; }
+    if (errno != ENOENT) { return -1; }
+    if (snprintf(path, n, "%s/%d", directory, rank) < 0) {
+        perror("snprintf");
+        exit(EXIT_FAILURE);
+    }
+    return checkpoint_file_map(path, file);
+}
+
+/* Map the stripe "k" of the file that is written. New stripes are appended to their files. */
+static void checkpoint_map_stripe(struct mpi_checkpoint* checkpoint, size_t k, int new_stripe) {
+    const struct checkpoint_stripes* stripes = checkpoint->stripes;
+    const int fd = checkpoint->stripe_fds[k % stripes->count];
+    const off_t offset = (k / stripes->count)*stripes->size;
+    if (new_stripe && ftruncate(fd, offset + stripes->size) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    if (mmap(((char*)checkpoint->data) + k*stripes->size, stripes->size, PROT_WRITE,
+             MAP_SHARED|MAP_FIXED, fd, offset) == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+Map the stripes that cover the first "new_size" bytes of the file that is written.
+The stripes are mapped to the reserved range of addresses. When the range is exhausted,
+the range of twice the size is reserved and all stripes are mapped again.
+*/
+static void checkpoint_grow_striped(struct mpi_checkpoint* checkpoint, size_t new_size) {
+    const size_t size = checkpoint->stripes->size;
+    new_size = (new_size + size - 1)/size*size;
+    size_t k = checkpoint->size/size;
+    if (new_size > checkpoint->reserved_size) {
+        size_t reserved_size = 2*checkpoint->reserved_size;
+        if (reserved_size < new_size) { reserved_size = new_size; }
+        void* old_data = checkpoint->data;
+        checkpoint->data = checkpoint_reserve_addresses(reserved_size);
+        if (old_data && munmap(old_data, checkpoint->reserved_size) == -1) {
+            perror("munmap");
+            exit(EXIT_FAILURE);
+        }
+        checkpoint->reserved_size = reserved_size;
+        /* the old data is already written to the files */
+        checkpoint->start = checkpoint->size;
+        k = 0;
+    }
+    for (; k<new_size/size; ++k) {
+        checkpoint_map_stripe(checkpoint, k, k >= checkpoint->size/size);
+    }
+    checkpoint->size = new_size;
+    checkpoint_advise_huge_pages(checkpoint->data, new_size);
+}
+
+/* Write-behind
+
+The file is written to the storage while the next data is copied. When the write
+position passes the end of the window, the window is passed to the storage with
+sync_file_range(SYNC_FILE_RANGE_WRITE), and the window before it is waited for, and
+its pages are removed from the mapping and dropped from the page cache.
+At most two windows are dirty, i.e. the memory used by the page cache does not
+grow with the size of the checkpoint and MPI_Checkpoint_close flushes only the last
+windows. The pages are removed with MADV_DONTNEED instead of unmapping them,
+so that the offsets returned by MPI_Checkpoint_reserve_range remain valid.
+The windows end before the first reserved range that may not be filled yet, i.e.
+until MPI_Checkpoint_write_at has copied as many bytes as were reserved, so that
+the pages are not flushed and dropped before the threads copy the data to them. */
+
+/* the size of the window in bytes or 0 */
+static size_t write_behind_window = 64UL*1024UL*1024UL;
+
+/* The window of the new checkpoint rounded up to the mapping step, or 0 if it is disabled. */
+static size_t checkpoint_write_behind_window() {
+    if (write_behind_window == 0) { return 0; }
+    return (write_behind_window + mapping_step - 1)/mapping_step*mapping_step;
+}
+
+/* The end of the data that is completely written. */
+static size_t checkpoint_completed(struct mpi_checkpoint* checkpoint) {
+    if (checkpoint->reserved_bytes != 0 &&
+        __atomic_load_n(&checkpoint->filled_bytes, __ATOMIC_ACQUIRE) <
+        checkpoint->reserved_bytes) {
+        return checkpoint->unfilled;
+    }
+    return checkpoint->offset;
+}
+
+/* Pass the completed windows to the storage and drop the windows that are written. */
+static void checkpoint_write_behind(struct mpi_checkpoint* checkpoint) {
+    const size_t window = checkpoint->window;
+    if (window == 0 || checkpoint->offset - checkpoint->written < window) { return; }
+    const size_t end = checkpoint_completed(checkpoint);
+    if (end < checkpoint->written || end - checkpoint->written < window) { return; }
+    checkpoint_trace_begin("checkpoint_write_behind");
+    double t0 = checkpoint_clock();
+    for (; end - checkpoint->written >= window; checkpoint->written += window) {
+        const size_t first = checkpoint->written;
+        if (sync_file_range(checkpoint->fd, first, window, SYNC_FILE_RANGE_WRITE) == -1) {
+            perror("sync_file_range");
+            exit(EXIT_FAILURE);
+        }
+        if (first < window) { continue; }
+        const size_t previous = first - window;
+        if (sync_file_range(checkpoint->fd, previous, window,
+                            SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|
+                            SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+            perror("sync_file_range");
+            exit(EXIT_FAILURE);
+        }
+        if (madvise(((char*)checkpoint->data) + previous, window, MADV_DONTNEED) == -1) {
+            perror("madvise");
+            exit(EXIT_FAILURE);
+        }
+        posix_fadvise(checkpoint->fd, previous, window, POSIX_FADV_DONTNEED);
+    }
+    checkpoint->counters[CHECKPOINT_SYNC] += checkpoint_clock() - t0;
+    checkpoint_trace_end("checkpoint_write_behind");
+}
+
+/* Make sure that the mapping has room for another "size_in_bytes" bytes. */
+static void checkpoint_grow(struct mpi_checkpoint* checkpoint, size_t size_in_bytes) {
+    checkpoint_write_behind(checkpoint);
+    if (checkpoint->size - checkpoint->offset >= size_in_bytes) { return; }
+    checkpoint_trace_begin("checkpoint_grow");
+    double t0 = checkpoint_clock();
+    /* the threads of MPI_Checkpoint_write_at do not copy to the mapping that is moved */
+    pthread_rwlock_wrlock(&checkpoint->mapping_lock);
+    size_t old_size = 0;
+    if (checkpoint->stripes) {
+        old_size = checkpoint->size;
+        checkpoint_grow_striped(checkpoint, checkpoint->offset + size_in_bytes);
+    }
+    while (checkpoint->size - checkpoint->offset < size_in_bytes) {
+        size_t new_size = checkpoint->offset + size_in_bytes;
+        size_t remainder = new_size%mapping_step;
+        if (remainder != 0) { new_size += mapping_step-remainder; }
+        if (ftruncate(checkpoint->fd, new_size) == -1) {
+            perror("ftruncate");
+            exit(EXIT_FAILURE);
+        }
+        void* new_data = mremap(checkpoint->data, checkpoint->size, new_size, MREMAP_MAYMOVE);
+        if (new_data == MAP_FAILED) {
+            perror("mremap");
+            exit(EXIT_FAILURE);
+        }
+        old_size = checkpoint->size;
+        checkpoint->data = new_data;
+        checkpoint->size = new_size;
+        checkpoint_advise_huge_pages(new_data, new_size);
+    }
+    if (old_size != 0) {
+        if (madvise(((char*)checkpoint->data) + checkpoint->start,
+                    old_size-checkpoint->start, MADV_DONTNEED) == -1) {
+            perror("madvise");
+            exit(EXIT_FAILURE);
+        }
+        checkpoint->start = old_size;
+    }
+    pthread_rwlock_unlock(&checkpoint->mapping_lock);
+    checkpoint->counters[CHECKPOINT_GROW] += checkpoint_clock() - t0;
+    checkpoint_trace_end("checkpoint_grow");
+}
+
+/* Derived datatypes
+
+The type map of a non-contiguous datatype is flattened once into runs of
+equally sized blocks separated by a constant stride and cached as the attribute
+of the datatype. The elements are gathered to/scattered from the checkpoint
+using the runs. Datatypes with unsupported combiners are packed with MPI_Pack_external. */
+
+struct checkpoint_run {
+    MPI_Aint displacement;
+    MPI_Aint length;
+    MPI_Aint stride;
+    MPI_Aint count;
+};
+
+struct checkpoint_type {
+    MPI_Aint extent;
+    /* -1 if the type map could not be flattened */
+    int num_runs;
+    struct checkpoint_run runs[];
+};
+
+/* the blocks of the type map in the order of the type map */
+struct checkpoint_blocks {
+    MPI_Aint* displacements;
+    MPI_Aint* lengths;
+    size_t size;
+    size_t max_size;
+};
+
+static int type_keyval = MPI_KEYVAL_INVALID;
+
+static void checkpoint_blocks_append(struct checkpoint_blocks* blocks, MPI_Aint displacement,
+                                     MPI_Aint length) {
+    size_t n = blocks->size;
+    if (n != 0 && blocks->displacements[n-1] + blocks->lengths[n-1] == displacement) {
+        blocks->lengths[n-1] += length;
+        return;
+    }
+    if (n == blocks->max_size) {
+        blocks->max_size = n == 0 ? 64 : 2*n;
+        blocks->displacements = realloc(blocks->displacements,
+                                        blocks->max_size*sizeof(MPI_Aint));
+        blocks->lengths = realloc(blocks->lengths, blocks->max_size*sizeof(MPI_Aint));
+        if (!blocks->displacements || !blocks->lengths) {
+            fprintf(stderr, "not enough memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    blocks->displacements[n] = displacement;
+    blocks->lengths[n] = length;
+    blocks->size = n+1;
+}
+
+static int checkpoint_flatten(MPI_Datatype datatype, MPI_Aint displacement,
+                              struct checkpoint_blocks* blocks);
+
+static int checkpoint_flatten_repeat(MPI_Datatype datatype, MPI_Aint displacement,
+                                     MPI_Aint count, struct checkpoint_blocks* blocks) {
+    MPI_Aint lb = 0, extent = 0;
+    MPI_Type_get_extent(datatype, &lb, &extent);
+    int ret = 0;
+    for (MPI_Aint i=0; i<count && ret == 0; ++i) {
+        ret = checkpoint_flatten(datatype, displacement + i*extent, blocks);
+    }
+    return ret;
+}
+
+/* Append the blocks of the subarray type, "index" is the multidimensional index
+   in the C order. */
+static int checkpoint_flatten_subarray(MPI_Datatype datatype, MPI_Aint displacement, int ndims,
+                                       const int* sizes, const int* subsizes, const int* starts,
+                                       int order, struct checkpoint_blocks* blocks) {
+    int c_sizes[CHECKPOINT_MAX_DIMS], c_subsizes[CHECKPOINT_MAX_DIMS],
+        c_starts[CHECKPOINT_MAX_DIMS], index[CHECKPOINT_MAX_DIMS];
+    if (ndims <= 0 || ndims > CHECKPOINT_MAX_DIMS) { return -1; }
+    for (int i=0; i<ndims; ++i) {
+        int j = (order == MPI_ORDER_C) ? i : ndims-1-i;
+        c_sizes[j] = sizes[i];
+        c_subsizes[j] = subsizes[i];
+        c_starts[j] = starts[i];
+        if (subsizes[i] == 0) { return 0; }
+        index[j] = starts[i];
+    }
+    MPI_Aint lb = 0, extent = 0;
+    MPI_Type_get_extent(datatype, &lb, &extent);
+    int ret = 0;
+    while (ret == 0) {
+        MPI_Aint offset = 0;
+        for (int i=0; i<ndims; ++i) { offset = offset*c_sizes[i] + index[i]; }
+        ret = checkpoint_flatten_repeat(datatype, displacement + offset*extent,
+                                        c_subsizes[ndims-1], blocks);
+        int i = ndims-2;
+        while (i >= 0 && ++index[i] == c_starts[i] + c_subsizes[i]) {
+            index[i] = c_starts[i];
+            --i;
+        }
+        if (i < 0) { break; }
+    }
+    return ret;
+}
+
+/* Append the blocks of the type map. Returns -1 if the combiner is not supported. */
+static int checkpoint_flatten(MPI_Datatype datatype, MPI_Aint displacement,
+                              struct checkpoint_blocks* blocks) {
+    int num_integers = 0, num_addresses = 0, num_datatypes = 0, combiner = 0;
+    MPI_Type_get_envelope(datatype, &num_integers, &num_addresses, &num_datatypes, &combiner);
+    if (combiner == MPI_COMBINER_NAMED) {
+        int size = 0;
+        MPI_Type_size(datatype, &size);
+        checkpoint_blocks_append(blocks, displacement, size);
+        return 0;
+    }
+    int* integers = malloc((num_integers+1)*sizeof(int));
+    MPI_Aint* addresses = malloc((num_addresses+1)*sizeof(MPI_Aint));
+    MPI_Datatype* datatypes = malloc((num_datatypes+1)*sizeof(MPI_Datatype));
+    if (!integers || !addresses || !datatypes) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    MPI_Type_get_contents(datatype, num_integers, num_addresses, num_datatypes,
+                          integers, addresses, datatypes);
+    MPI_Aint lb = 0, extent = 0;
+    if (num_datatypes != 0) { MPI_Type_get_extent(datatypes[0], &lb, &extent); }
+    int ret = 0;
+    switch (combiner) {
+        case MPI_COMBINER_DUP:
+        case MPI_COMBINER_RESIZED:
+            ret = checkpoint_flatten(datatypes[0], displacement, blocks);
+            break;
+        case MPI_COMBINER_CONTIGUOUS:
+            ret = checkpoint_flatten_repeat(datatypes[0], displacement, integers[0], blocks);
+            break;
+        case MPI_COMBINER_VECTOR:
+        case MPI_COMBINER_HVECTOR:
+            for (int i=0; i<integers[0] && ret == 0; ++i) {
+                MPI_Aint stride = (combiner == MPI_COMBINER_VECTOR) ?
+                    ((MPI_Aint)integers[2])*extent : addresses[0];
+                ret = checkpoint_flatten_repeat(datatypes[0], displacement + i*stride,
+                                                integers[1], blocks);
+            }
+            break;
+        case MPI_COMBINER_INDEXED:
+        case MPI_COMBINER_HINDEXED:
+            for (int i=0; i<integers[0] && ret == 0; ++i) {
+                MPI_Aint offset = (combiner == MPI_COMBINER_INDEXED) ?
+                    ((MPI_Aint)integers[1+integers[0]+i])*extent : addresses[i];
+                ret = checkpoint_flatten_repeat(datatypes[0], displacement + offset,
+                                                integers[1+i], blocks);
+            }
+            break;
+        case MPI_COMBINER_INDEXED_BLOCK:
+        case MPI_COMBINER_HINDEXED_BLOCK:
+            for (int i=0; i<integers[0] && ret == 0; ++i) {
+                MPI_Aint offset = (combiner == MPI_COMBINER_INDEXED_BLOCK) ?
+                    ((MPI_Aint)integers[2+i])*extent : addresses[i];
+                ret = checkpoint_flatten_repeat(datatypes[0], displacement + offset,
+                                                integers[1], blocks);
+            }
+            break;
+        case MPI_COMBINER_STRUCT:
+            for (int i=0; i<integers[0] && ret == 0; ++i) {
+                ret = checkpoint_flatten_repeat(datatypes[i], displacement + addresses[i],
+                                                integers[1+i], blocks);
+            }
+            break;
+        case MPI_COMBINER_SUBARRAY: {
+            const int ndims = integers[0];
+            ret = checkpoint_flatten_subarray(datatypes[0], displacement, ndims,
+                                              integers+1, integers+1+ndims,
+                                              integers+1+2*ndims, integers[1+3*ndims],
+                                              blocks);
+            break;
+        }
+        default:
+            ret = -1;
+            break;
+    }
+    for (int i=0; i<num_datatypes; ++i) {
+        int ni = 0, na = 0, nd = 0, c = 0;
+        MPI_Type_get_envelope(datatypes[i], &ni, &na, &nd, &c);
+        if (c != MPI_COMBINER_NAMED) { MPI_Type_free(&datatypes[i]); }
+    }
+    free(integers);
+    free(addresses);
+    free(datatypes);
+    return ret;
+}
+
+static int checkpoint_type_delete(MPI_Datatype datatype, int keyval, void* value, void* extra) {
+    free(value);
+    return MPI_SUCCESS;
+}
+
+/* Returns the flattened type map or 0 if the datatype is contiguous. */
+static const struct checkpoint_type* checkpoint_type_get(MPI_Datatype datatype) {
+    int size = 0;
+    MPI_Aint lb = 0, extent = 0, true_lb = 0, true_extent = 0;
+    MPI_Type_size(datatype, &size);
+    MPI_Type_get_extent(datatype, &lb, &extent);
+    MPI_Type_get_true_extent(datatype, &true_lb, &true_extent);
+    if (true_lb == 0 && true_extent == size && extent == size) { return 0; }
+    if (type_keyval == MPI_KEYVAL_INVALID) {
+        MPI_Type_create_keyval(MPI_TYPE_NULL_COPY_FN, checkpoint_type_delete, &type_keyval, 0);
+    }
+    struct checkpoint_type* type = 0;
+    int found = 0;
+    MPI_Type_get_attr(datatype, type_keyval, &type, &found);
+    if (found) { return type; }
+    struct checkpoint_blocks blocks = {0, 0, 0, 0};
+    int ret = checkpoint_flatten(datatype, 0, &blocks);
+    if (ret != 0) { blocks.size = 0; }
+    type = malloc(sizeof(struct checkpoint_type) + blocks.size*sizeof(struct checkpoint_run));
+    if (!type) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    type->extent = extent;
+    type->num_runs = ret == 0 ? 0 : -1;
+    /* merge the blocks of the same length separated by the same stride into runs */
+    for (size_t i=0; i<blocks.size; ) {
+        struct checkpoint_run* run = type->runs + type->num_runs++;
+        run->displacement = blocks.displacements[i];
+        run->length = blocks.lengths[i];
+        run->stride = 0;
+        run->count = 1;
+        size_t j = i+1;
+        if (j < blocks.size && blocks.lengths[j] == run->length) {
+            run->stride = blocks.displacements[j] - blocks.displacements[i];
+            while (j < blocks.size && blocks.lengths[j] == run->length &&
+                   blocks.displacements[j] - blocks.displacements[j-1] == run->stride) {
+                ++j;
+            }
+            run->count = j-i;
+        }
+        i = j;
+    }
+    free(blocks.displacements);
+    free(blocks.lengths);
+    MPI_Type_set_attr(datatype, type_keyval, type);
+    return type;
+}
+
+/* Copy "count" elements of the datatype from the buffer to the packed bytes (to_buffer=0)
+   or from the packed bytes to the buffer (to_buffer=1). */
+static void checkpoint_type_copy(void* buf, MPI_Count count, MPI_Datatype datatype, char* packed,
+                                 size_t size_in_bytes, int to_buffer) {
+    const struct checkpoint_type* type = checkpoint_type_get(datatype);
+    if (!type) {
+        if (to_buffer) {
+            memcpy(buf, packed, size_in_bytes);
+        } else {
+            memcpy(packed, buf, size_in_bytes);
+        }
+        return;
+    }
+    if (type->num_runs < 0) {
+        /* MPI_Pack_external takes int count */
+        MPI_Aint position = 0;
+        for (MPI_Count i=0; i<count; i+=INT_MAX) {
+            int n = count-i < INT_MAX ? count-i : INT_MAX;
+            char* element = ((char*)buf) + i*type->extent;
+            if (to_buffer) {
+                MPI_Unpack_external("native", packed, size_in_bytes, &position,
+                                    element, n, datatype);
+            } else {
+                MPI_Pack_external("native", element, n, datatype, packed, size_in_bytes,
+                                  &position);
+            }
+        }
+        return;
+    }
+    for (MPI_Count i=0; i<count; ++i) {
+        char* element = ((char*)buf) + i*type->extent;
+        for (int k=0; k<type->num_runs; ++k) {
+            const struct checkpoint_run* run = type->runs + k;
+            char* block = element + run->displacement;
+            /* the constant size lets the compiler replace memcpy with the moves */
+            if (run->length == sizeof(double)) {
+                for (MPI_Aint j=0; j<run->count; ++j, block += run->stride) {
+                    if (to_buffer) {
+                        memcpy(block, packed, sizeof(double));
+                    } else {
+                        memcpy(packed, block, sizeof(double));
+                    }
+                    packed += sizeof(double);
+                }
+            } else {
+                for (MPI_Aint j=0; j<run->count; ++j, block += run->stride) {
+                    if (to_buffer) {
+                        memcpy(block, packed, run->length);
+                    } else {
+                        memcpy(packed, block, run->length);
+                    }
+                    packed += run->length;
+                }
+            }
+        }
+    }
+}
+
+static void checkpoint_types_free() {
+    if (type_keyval != MPI_KEYVAL_INVALID) { MPI_Type_free_keyval(&type_keyval); }
+}
+
+static void checkpoint_write_bytes(struct mpi_checkpoint* checkpoint, const void* buf,
+                                   size_t size_in_bytes) {
+    checkpoint_grow(checkpoint, size_in_bytes);
+    double t0 = checkpoint_clock();
+    if (checkpoint->window == 0) {
+        memcpy(((char*)checkpoint->data) + checkpoint->offset, buf, size_in_bytes);
+        checkpoint->offset += size_in_bytes;
+    }
+    /* the windows are written while the next windows are copied */
+    while (checkpoint->window != 0 && size_in_bytes != 0) {
+        size_t n = checkpoint->written + checkpoint->window - checkpoint->offset;
+        if (n > size_in_bytes) { n = size_in_bytes; }
+        memcpy(((char*)checkpoint->data) + checkpoint->offset, buf, n);
+        checkpoint->offset += n;
+        buf = ((const char*)buf) + n;
+        size_in_bytes -= n;
+        checkpoint_write_behind(checkpoint);
+    }
+    checkpoint->counters[CHECKPOINT_COPY] += checkpoint_clock() - t0;
+}
+
+static void checkpoint_write_elements(struct mpi_checkpoint* checkpoint, const void* buf,
+                                      MPI_Count count, MPI_Datatype datatype,
+                                      size_t size_in_bytes) {
+    if (checkpoint->window != 0 && checkpoint_type_get(datatype) == 0) {
+        checkpoint_write_bytes(checkpoint, buf, size_in_bytes);
+        return;
+    }
+    checkpoint_grow(checkpoint, size_in_bytes);
+    double t0 = checkpoint_clock();
+    checkpoint_type_copy((void*)buf, count, datatype,
+                         ((char*)checkpoint->data) + checkpoint->offset, size_in_bytes, 0);
+    checkpoint->counters[CHECKPOINT_COPY] += checkpoint_clock() - t0;
+    checkpoint->offset += size_in_bytes;
+}
+
+static struct checkpoint_record* checkpoint_add_record(struct mpi_checkpoint* checkpoint,
+                                                       enum checkpoint_record_kind kind,
+                                                       size_t size_in_bytes,
+                                                       int element_size) {
+    if (checkpoint->num_records == checkpoint->max_records) {
+        size_t n = checkpoint->max_records == 0 ? 16 : checkpoint->max_records*2;
+        struct checkpoint_record* records =
+            realloc(checkpoint->records, n*sizeof(struct checkpoint_record));
+        if (!records) {
+            fprintf(stderr, "not enough memory\n");
+            exit(EXIT_FAILURE);
+        }
+        checkpoint->records = records;
+        checkpoint->max_records = n;
+    }
+    struct checkpoint_record* r = checkpoint->records + checkpoint->num_records++;
+    memset(r, 0, sizeof(struct checkpoint_record));
+    r->offset = checkpoint->offset;
+    r->size = size_in_bytes;
+    r->kind = kind;
+    r->element_size = element_size;
+    return r;
+}
+
+/* Grow the file and the table of contents at once for the records that are written next. */
+static void checkpoint_reserve(struct mpi_checkpoint* checkpoint, size_t size_in_bytes,
+                               size_t num_records) {
+    const size_t n = checkpoint->num_records + num_records;
+    if (checkpoint->max_records < n) {
+        struct checkpoint_record* records =
+            realloc(checkpoint->records, n*sizeof(struct checkpoint_record));
+        if (!records) {
+            fprintf(stderr, "not enough memory\n");
+            exit(EXIT_FAILURE);
+        }
+        checkpoint->records = records;
+        checkpoint->max_records = n;
+    }
+    checkpoint_grow(checkpoint, size_in_bytes + n*sizeof(struct checkpoint_record) +
+                                sizeof(struct checkpoint_checksum) +
+                                sizeof(struct checkpoint_footer));
+}
+
+/* Compression
+
+The payload of MPI_Checkpoint_write is compressed if compression-level or compression-codec
+is set or if compression-autotune is enabled. The compressed record starts with the number
+of stored bytes (uint64_t), and the record's codec contains the codec id,
+the filter and the level. The data is compressed in chunks of whole elements:
+each chunk is packed, optionally shuffled (the bytes of the basic elements are
+grouped by their position within the element) and compressed independently.
+Each compressed chunk is preceded by its size (uint32_t); the chunks that
+do not become smaller are stored as is. */
+
+#define CHECKPOINT_CODEC_ID(codec) ((codec) & 0xff)
+#define CHECKPOINT_CODEC_LEVEL(codec) (((codec) >> 16) & 0xff)
+#define CHECKPOINT_CODEC(id, filter, level) ((id) | (filter) | ((level) << 16))
+#define CHECKPOINT_COMPRESSION_CHUNK (1UL*1024UL*1024UL)
+/* smaller payloads are not compressed */
+#define CHECKPOINT_COMPRESSION_MIN_SIZE 4096
+#define CHECKPOINT_SAMPLE_SIZE (256UL*1024UL)
+#define CHECKPOINT_SAMPLE_PIECES 4
+
+/*
+The codec interface. "compress" returns the size of the compressed data or 0
+if it does not fit into "out_size" bytes, "decompress" returns -1 if the data
+is corrupted or does not decompress to exactly "size" bytes.
+*/
+struct checkpoint_codec_ops {
+    const char* name;
+    uint32_t id;
+    /* the maximum size of the compressed data */
+    size_t (*bound)(size_t size);
+    size_t (*compress)(const char* in, size_t size, char* out, size_t out_size, int level);
+    int (*decompress)(const char* in, size_t in_size, char* out, size_t size);
+};
+
+/* choose the codec for each variable on the first checkpoint */
+static int compression_autotune = 0;
+/* the bandwidth of the storage in bytes per second, measured if not configured
+   (0 until the first measurement, the default bandwidth is used until then) */
+static double storage_bandwidth = 0;
+static double measured_storage_bandwidth = 0;
+#define CHECKPOINT_DEFAULT_BANDWIDTH 500e6
+/* the codecs are chosen again when the bandwidth changes by more than this factor */
+#define CHECKPOINT_RETUNE_FACTOR 2
+/* the codec of each variable (record index) chosen by the autotuning */
+struct checkpoint_tuned_codec {
+    uint32_t codec;
+    int element_size;
+    /* the bandwidth that the codec was chosen for, 0 if it was not known */
+    double bandwidth;
+};
+static struct checkpoint_tuned_codec* tuned_codecs = 0;
+static size_t num_tuned_codecs = 0;
+static char* chunk_buffer = 0;
+static char* shuffle_buffer = 0;
+static char* sample_buffer = 0;
+/* the level of the deflate stream "compressor" */
+static int compressor_level = 0;
+
+static void checkpoint_compression_buffers() {
+    if (chunk_buffer) { return; }
+    chunk_buffer = malloc(CHECKPOINT_COMPRESSION_CHUNK);
+    shuffle_buffer = malloc(CHECKPOINT_COMPRESSION_CHUNK);
+    sample_buffer = malloc(CHECKPOINT_SAMPLE_SIZE);
+    if (!chunk_buffer || !shuffle_buffer || !sample_buffer) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void checkpoint_compression_free() {
+    free(chunk_buffer);
+    free(shuffle_buffer);
+    free(sample_buffer);
+    free(tuned_codecs);
+    chunk_buffer = 0, shuffle_buffer = 0, sample_buffer = 0, tuned_codecs = 0;
+    num_tuned_codecs = 0;
+}
+
+static size_t checkpoint_deflate_bound(size_t size) {
+    return mz_deflateBound(&compressor, size);
+}
+
+static size_t checkpoint_deflate_compress(const char* in, size_t size, char* out,
+                                          size_t out_size, int level) {
+    if (level != compressor_level) {
+        mz_deflateEnd(&compressor);
+        if (mz_deflateInit(&compressor, level) != MZ_OK) { return 0; }
+        compressor_level = level;
+    } else if (mz_deflateReset(&compressor) != MZ_OK) {
+        return 0;
+    }
+    compressor.next_in = (const unsigned char*)in;
+    compressor.avail_in = size;
+    compressor.next_out = (unsigned char*)out;
+    compressor.avail_out = out_size < UINT_MAX ? out_size : UINT_MAX;
+    if (mz_deflate(&compressor, MZ_FINISH) != MZ_STREAM_END) { return 0; }
+    return compressor.next_out - (unsigned char*)out;
+}
+
+static int checkpoint_deflate_decompress(const char* in, size_t in_size, char* out,
+                                         size_t size) {
+    size_t n = tinfl_decompress_mem_to_mem(out, size, in, in_size,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER);
+    return n == size ? 0 : -1;
+}
+
+/*
+A byte-oriented LZ77 codec similar to LZ4. The block is a sequence of token,
+literal length, literals, match offset (2 bytes, little endian) and match length.
+The high four bits of the token are the number of literals, the low four bits
+are the match length minus CHECKPOINT_LZ_MIN_MATCH; the value 15 is followed by
+the remaining length as a sequence of bytes terminated by a byte less than 255.
+The last sequence contains only the literals.
+*/
+
+#define CHECKPOINT_LZ_HASH_BITS 14
+#define CHECKPOINT_LZ_MIN_MATCH 4
+#define CHECKPOINT_LZ_MAX_OFFSET 65535
+/* the last bytes of the block are always literals */
+#define CHECKPOINT_LZ_LAST_LITERALS 8
+
+static inline uint32_t checkpoint_lz_read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t checkpoint_lz_read64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t checkpoint_lz_hash(uint32_t v) {
+    return (v*2654435761U) >> (32 - CHECKPOINT_LZ_HASH_BITS);
+}
+
+static size_t checkpoint_lz_bound(size_t size) {
+    return size + size/255 + 16;
+}
+
+/* Write the part of the length that does not fit into the token. Returns 0 on overflow. */
+static char* checkpoint_lz_length(char* op, const char* oend, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (op == oend) { return 0; }
+        *op++ = (char)255;
+    }
+    if (op == oend) { return 0; }
+    *op++ = (char)length;
+    return op;
+}
+
+/* Write the sequence of literals and the match (if "match" is non-zero). */
+static char* checkpoint_lz_sequence(char* op, const char* oend, const char* literals,
+                                    size_t num_literals, size_t offset, size_t match) {
+    if (op == oend) { return 0; }
+    const size_t match_length = match ? match - CHECKPOINT_LZ_MIN_MATCH : 0;
+    char* token = op++;
+    *token = (char)(((num_literals < 15 ? num_literals : 15) << 4) |
+                    (match_length < 15 ? match_length : 15));
+    if (num_literals >= 15 && !(op = checkpoint_lz_length(op, oend, num_literals-15))) {
+        return 0;
+    }
+    if ((size_t)(oend - op) < num_literals) { return 0; }
+    memcpy(op, literals, num_literals);
+    op += num_literals;
+    if (!match) { return op; }
+    if (oend - op < 2) { return 0; }
+    *op++ = (char)(offset & 0xff);
+    *op++ = (char)(offset >> 8);
+    if (match_length >= 15 && !(op = checkpoint_lz_length(op, oend, match_length-15))) {
+        return 0;
+    }
+    return op;
+}
+
+static size_t checkpoint_lz_compress(const char* in, size_t size, char* out, size_t out_size,
+                                     int level) {
+    uint32_t table[1 << CHECKPOINT_LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const char* ip = in;
+    const char* anchor = in;
+    const char* iend = in + size;
+    const char* oend = out + out_size;
+    char* op = out;
+    /* the positions are stored as 32-bit offsets */
+    if (size > UINT32_MAX) { return 0; }
+    if (size > CHECKPOINT_LZ_LAST_LITERALS + CHECKPOINT_LZ_MIN_MATCH) {
+        const char* match_limit = iend - CHECKPOINT_LZ_LAST_LITERALS;
+        /* the step grows in the incompressible data */
+        size_t misses = 0;
+        while (ip < match_limit) {
+            const uint32_t sequence = checkpoint_lz_read32(ip);
+            const uint32_t h = checkpoint_lz_hash(sequence);
+            const char* ref = in + table[h];
+            table[h] = ip - in;
+            if (ref >= ip || ip - ref > CHECKPOINT_LZ_MAX_OFFSET ||
+                checkpoint_lz_read32(ref) != sequence) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) { --ip, --ref; }
+            const char* p = ip + CHECKPOINT_LZ_MIN_MATCH;
+            const char* q = ref + CHECKPOINT_LZ_MIN_MATCH;
+            while (p + 8 <= match_limit) {
+                const uint64_t diff = checkpoint_lz_read64(p) ^ checkpoint_lz_read64(q);
+                if (diff) {
+                    /* "p" and "q" point to the first different bytes */
+                    const size_t n = __builtin_ctzll(diff) >> 3;
+                    p += n, q += n;
+                    break;
+                }
+                p += 8, q += 8;
+            }
+            if (p + 8 > match_limit) {
+                while (p < match_limit && *p == *q) { ++p, ++q; }
+            }
+            op = checkpoint_lz_sequence(op, oend, anchor, ip - anchor, ip - ref, p - ip);
+            if (!op) { return 0; }
+            ip = anchor = p;
+            if (ip < match_limit) {
+                table[checkpoint_lz_hash(checkpoint_lz_read32(ip-2))] = ip - 2 - in;
+            }
+        }
+    }
+    op = checkpoint_lz_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    return op ? (size_t)(op - out) : 0;
+}
+
+/* Read the part of the length that does not fit into the token. Returns 0 on overflow. */
+static const char* checkpoint_lz_read_length(const char* ip, const char* iend, size_t* length) {
+    unsigned char byte = 255;
+    while (byte == 255) {
+        if (ip == iend) { return 0; }
+        byte = (unsigned char)*ip++;
+        *length += byte;
+    }
+    return ip;
+}
+
+static int checkpoint_lz_decompress(const char* in, size_t in_size, char* out, size_t size) {
+    const char* ip = in;
+    const char* iend = in + in_size;
+    char* op = out;
+    const char* oend = out + size;
+    while (ip != iend) {
+        const unsigned char token = (unsigned char)*ip++;
+        size_t num_literals = token >> 4;
+        if (num_literals == 15 && !(ip = checkpoint_lz_read_length(ip, iend, &num_literals))) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < num_literals || (size_t)(oend - op) < num_literals) {
+            return -1;
+        }
+        memcpy(op, ip, num_literals);
+        op += num_literals, ip += num_literals;
+        if (ip == iend) { break; }
+        if (iend - ip < 2) { return -1; }
+        const size_t offset = ((unsigned char)ip[0]) | (((unsigned char)ip[1]) << 8);
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !(ip = checkpoint_lz_read_length(ip, iend, &match))) { return -1; }
+        match += CHECKPOINT_LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || (size_t)(oend - op) < match) {
+            return -1;
+        }
+        const char* ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+        } else if (offset >= 8) {
+            /* the overlapping match is copied in the pieces that do not overlap */
+            size_t i = 0;
+            for (; i+8 <= match; i += 8) { memcpy(op+i, ref+i, 8); }
+            for (; i < match; ++i) { op[i] = ref[i]; }
+        } else {
+            for (size_t i=0; i<match; ++i) { op[i] = ref[i]; }
+        }
+        op += match;
+    }
+    return op == oend ? 0 : -1;
+}
+
+/* The codecs indexed by the codec id. */
+static const struct checkpoint_codec_ops checkpoint_codecs[] = {
+    {"none", CHECKPOINT_CODEC_NONE, 0, 0, 0},
+    {"deflate", CHECKPOINT_CODEC_DEFLATE, checkpoint_deflate_bound,
+     checkpoint_deflate_compress, checkpoint_deflate_decompress},
+    {"lz", CHECKPOINT_CODEC_LZ, checkpoint_lz_bound,
+     checkpoint_lz_compress, checkpoint_lz_decompress},
+};
+
+/* The codec with the id of "codec" or 0 if there is no such codec. */
+static const struct checkpoint_codec_ops* checkpoint_codec_get(uint32_t codec) {
+    const uint32_t id = CHECKPOINT_CODEC_ID(codec);
+    if (id == CHECKPOINT_CODEC_NONE ||
+        id >= sizeof(checkpoint_codecs)/sizeof(checkpoint_codecs[0])) {
+        return 0;
+    }
+    return checkpoint_codecs + id;
+}
+
+/* The number of bytes in each chunk of the payload of elements of "element_size" bytes. */
+static size_t checkpoint_chunk_size(int element_size) {
+    if (element_size > CHECKPOINT_COMPRESSION_CHUNK) { return CHECKPOINT_COMPRESSION_CHUNK; }
+    return (CHECKPOINT_COMPRESSION_CHUNK/element_size)*element_size;
+}
+
+/* The bytes of the elements are shuffled only for the basic datatypes. */
+static int checkpoint_shuffle_width(uint32_t codec, int element_size) {
+    if (!(codec & CHECKPOINT_FILTER_SHUFFLE) || element_size > 16) { return 1; }
+    return element_size;
+}
+
+/* Group the bytes of the elements by their position in the element (inverse=0) or back. */
+static void checkpoint_shuffle(const char* in, char* out, size_t size, int width,
+                               int inverse) {
+    const size_t n = size/width;
+    for (int b=0; b<width; ++b) {
+        for (size_t i=0; i<n; ++i) {
+            if (inverse) {
+                out[i*width + b] = in[b*n + i];
+            } else {
+                out[b*n + i] = in[i*width + b];
+            }
+        }
+    }
+    /* the tail that is not a whole element is copied as is */
+    memcpy(out + n*width, in + n*width, size - n*width);
+}
+
+/*
+Compress "count" elements of the datatype to "out". The payload is split into chunks
+of elements of "element_size" bytes. Returns the number of stored bytes or 0
+if the compressed data does not fit into "out_size" bytes.
+*/
+static size_t checkpoint_compress(const void* buf, MPI_Count count, MPI_Datatype datatype,
+                                  int element_size, uint32_t codec, char* out,
+                                  size_t out_size) {
+    const struct checkpoint_codec_ops* ops = checkpoint_codec_get(codec);
+    if (!ops) { return 0; }
+    MPI_Aint lb = 0, extent = 0;
+    MPI_Type_get_extent(datatype, &lb, &extent);
+    int type_size = 0;
+    MPI_Type_size(datatype, &type_size);
+    const int contiguous = checkpoint_type_get(datatype) == 0;
+    const int width = checkpoint_shuffle_width(codec, element_size);
+    const size_t chunk_size = checkpoint_chunk_size(element_size);
+    const size_t total = count*type_size;
+    size_t stored = 0;
+    for (size_t position=0; position<total; position+=chunk_size) {
+        const size_t size = total-position < chunk_size ? total-position : chunk_size;
+        const char* chunk = ((const char*)buf) + position;
+        if (!contiguous) {
+            /* the chunks of non-contiguous datatypes contain whole elements */
+            checkpoint_type_copy(((char*)buf) + (position/type_size)*extent, size/type_size,
+                                 datatype, chunk_buffer, size, 0);
+            chunk = chunk_buffer;
+        }
+        if (width > 1) {
+            checkpoint_shuffle(chunk, shuffle_buffer, size, width, 0);
+            chunk = shuffle_buffer;
+        }
+        if (out_size - stored < sizeof(uint32_t)) { return 0; }
+        char* header = out + stored;
+        stored += sizeof(uint32_t);
+        /* the compressed chunk has to be smaller than the original one */
+        const size_t avail = out_size - stored < size-1 ? out_size - stored : size-1;
+        uint32_t n = ops->compress(chunk, size, out + stored, avail,
+                                   CHECKPOINT_CODEC_LEVEL(codec));
+        if (n == 0) {
+            if (out_size - stored < size) { return 0; }
+            memcpy(out + stored, chunk, size);
+            n = size;
+        }
+        memcpy(header, &n, sizeof(uint32_t));
+        stored += n;
+    }
+    return stored;
+}
+
+/*
+Decompress "count" elements of the datatype of "type_size" bytes and "extent".
+The contiguous payloads are decompressed without calling MPI, i.e. from any thread.
+Returns -1 if the data is corrupted.
+*/
+static int checkpoint_decompress_elements(const char* in, size_t in_size, void* buf,
+                                          MPI_Count count, MPI_Datatype datatype,
+                                          int type_size, MPI_Aint extent, int contiguous,
+                                          int element_size, uint32_t codec) {
+    const struct checkpoint_codec_ops* ops = checkpoint_codec_get(codec);
+    if (!ops) { return -1; }
+    checkpoint_compression_buffers();
+    const int width = checkpoint_shuffle_width(codec, element_size);
+    const size_t chunk_size = checkpoint_chunk_size(element_size);
+    const size_t total = count*type_size;
+    if (!contiguous && type_size > CHECKPOINT_COMPRESSION_CHUNK) { return -1; }
+    size_t consumed = 0;
+    for (size_t position=0; position<total; position+=chunk_size) {
+        const size_t size = total-position < chunk_size ? total-position : chunk_size;
+        char* element = ((char*)buf) + (contiguous ? position : (position/type_size)*extent);
+        char* chunk = (contiguous && width == 1) ? element : chunk_buffer;
+        uint32_t n = 0;
+        if (in_size - consumed < sizeof(uint32_t)) { return -1; }
+        memcpy(&n, in + consumed, sizeof(uint32_t));
+        consumed += sizeof(uint32_t);
+        if (in_size - consumed < n) { return -1; }
+        if (n == size) {
+            memcpy(chunk, in + consumed, size);
+        } else if (ops->decompress(in + consumed, n, chunk, size) != 0) {
+            return -1;
+        }
+        consumed += n;
+        if (width > 1) {
+            char* out = contiguous ? element : shuffle_buffer;
+            checkpoint_shuffle(chunk, out, size, width, 1);
+            chunk = out;
+        }
+        if (!contiguous) {
+            checkpoint_type_copy(element, size/type_size, datatype, chunk, size, 1);
+        }
+    }
+    return consumed == in_size ? 0 : -1;
+}
+
+/* Decompress "count" elements of the datatype. Returns -1 if the data is corrupted. */
+static int checkpoint_decompress(const char* in, size_t in_size, void* buf, MPI_Count count,
+                                 MPI_Datatype datatype, int element_size, uint32_t codec) {
+    MPI_Aint lb = 0, extent = 0;
+    MPI_Type_get_extent(datatype, &lb, &extent);
+    int type_size = 0;
+    MPI_Type_size(datatype, &type_size);
+    const int contiguous = checkpoint_type_get(datatype) == 0;
+    return checkpoint_decompress_elements(in, in_size, buf, count, datatype, type_size, extent,
+                                          contiguous, element_size, codec);
+}
+
+/*
+Copy evenly spaced pieces of the payload to the sample buffer.
+Returns the size of the sample or 0 if the elements are too large to be sampled.
+*/
+static size_t checkpoint_sample(const void* buf, MPI_Count count, MPI_Datatype datatype,
+                                int element_size) {
+    const size_t piece_size = CHECKPOINT_SAMPLE_SIZE/CHECKPOINT_SAMPLE_PIECES;
+    const size_t total = count*element_size;
+    size_t sample_size = 0;
+    if (checkpoint_type_get(datatype) == 0) {
+        const size_t align = element_size <= piece_size ? element_size : 1;
+        for (int k=0; k<CHECKPOINT_SAMPLE_PIECES; ++k) {
+            size_t first = total/align*k/CHECKPOINT_SAMPLE_PIECES*align;
+            size_t n = total - first < piece_size ? total - first : piece_size;
+            memcpy(sample_buffer + sample_size, ((const char*)buf) + first, n);
+            sample_size += n;
+            if (total <= piece_size) { break; }
+        }
+        return sample_size;
+    }
+    if (element_size > piece_size) { return 0; }
+    MPI_Aint lb = 0, extent = 0;
+    MPI_Type_get_extent(datatype, &lb, &extent);
+    const MPI_Count piece_count = piece_size/element_size;
+    for (int k=0; k<CHECKPOINT_SAMPLE_PIECES; ++k) {
+        MPI_Count first = count*k/CHECKPOINT_SAMPLE_PIECES;
+        MPI_Count n = count*(k+1)/CHECKPOINT_SAMPLE_PIECES - first;
+        if (n > piece_count) { n = piece_count; }
+        checkpoint_type_copy(((char*)buf) + first*extent, n, datatype,
+                             sample_buffer + sample_size, n*element_size, 0);
+        sample_size += n*element_size;
+    }
+    return sample_size;
+}
+
+/*
+Choose the codec with the minimum expected time of compressing and storing the payload.
+The time is estimated by compressing the sample of the payload with each codec.
+*/
+static uint32_t checkpoint_autotune(const void* buf, MPI_Count count, MPI_Datatype datatype,
+                                    int element_size, size_t size_in_bytes,
+                                    double bandwidth) {
+    static const uint32_t candidates[] = {
+        CHECKPOINT_CODEC(CHECKPOINT_CODEC_LZ, 0, 0),
+        CHECKPOINT_CODEC(CHECKPOINT_CODEC_LZ, CHECKPOINT_FILTER_SHUFFLE, 0),
+        CHECKPOINT_CODEC(CHECKPOINT_CODEC_DEFLATE, 0, 1),
+        CHECKPOINT_CODEC(CHECKPOINT_CODEC_DEFLATE, CHECKPOINT_FILTER_SHUFFLE, 1),
+        CHECKPOINT_CODEC(CHECKPOINT_CODEC_DEFLATE, 0, 6),
+        CHECKPOINT_CODEC(CHECKPOINT_CODEC_DEFLATE, CHECKPOINT_FILTER_SHUFFLE, 6),
+    };
+    uint32_t best = CHECKPOINT_CODEC_NONE;
+    double best_time = size_in_bytes/bandwidth;
+    double best_ratio = 1;
+    const size_t sample_size = checkpoint_sample(buf, count, datatype, element_size);
+    if (sample_size == 0) { return best; }
+    for (size_t i=0; i<sizeof(candidates)/sizeof(candidates[0]); ++i) {
+        const uint32_t codec = candidates[i];
+        if ((codec & CHECKPOINT_FILTER_SHUFFLE) &&
+            checkpoint_shuffle_width(codec, element_size) == 1) {
+            continue;
+        }
+        double t0 = checkpoint_clock();
+        /* larger outputs are not useful */
+        size_t stored = checkpoint_compress(sample_buffer, sample_size, MPI_BYTE, element_size,
+                                            codec, chunk_buffer, sample_size);
+        double t = checkpoint_clock() - t0;
+        if (stored == 0) { continue; }
+        const double ratio = ((double)stored)/sample_size;
+        const double expected = size_in_bytes*(t/sample_size + ratio/bandwidth);
+        if (expected < best_time) {
+            best = codec;
+            best_time = expected;
+            best_ratio = ratio;
+        }
+    }
+    if (verbose > 1) {
+        const struct checkpoint_codec_ops* ops = checkpoint_codec_get(best);
+        fprintf(stderr, "codec %s%s, level %d, stored/written %f, expected time %f s\n",
+                ops ? ops->name : "none", (best & CHECKPOINT_FILTER_SHUFFLE) ? "+shuffle" : "",
+                CHECKPOINT_CODEC_LEVEL(best), best_ratio, best_time);
+        fflush(stderr);
+    }
+    return best;
+}
+
+/* The codec of the payload of the record "index". */
+static uint32_t checkpoint_choose_codec(size_t index, const void* buf, MPI_Count count,
+                                        MPI_Datatype datatype, int element_size,
+                                        size_t size_in_bytes) {
+    if (size_in_bytes < CHECKPOINT_COMPRESSION_MIN_SIZE || element_size == 0 ||
+        (checkpoint_type_get(datatype) != 0 && element_size > CHECKPOINT_COMPRESSION_CHUNK)) {
+        return CHECKPOINT_CODEC_NONE;
+    }
+    if (!compression_autotune) {
+        if (compression_codec == -1) {
+            if (compression_level == 0) { return CHECKPOINT_CODEC_NONE; }
+            return CHECKPOINT_CODEC(CHECKPOINT_CODEC_DEFLATE, 0, compression_level);
+        }
+        if (compression_codec == CHECKPOINT_CODEC_DEFLATE) {
+            const int level = compression_level == 0 ? MZ_DEFAULT_LEVEL : compression_level;
+            return CHECKPOINT_CODEC(CHECKPOINT_CODEC_DEFLATE, 0, level);
+        }
+        return compression_codec;
+    }
+    checkpoint_compression_buffers();
+    if (index >= num_tuned_codecs) {
+        size_t n = num_tuned_codecs == 0 ? 16 : num_tuned_codecs;
+        while (n <= index) { n *= 2; }
+        tuned_codecs = realloc(tuned_codecs, n*sizeof(struct checkpoint_tuned_codec));
+        if (!tuned_codecs) {
+            fprintf(stderr, "not enough memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(tuned_codecs + num_tuned_codecs, 0,
+               (n-num_tuned_codecs)*sizeof(struct checkpoint_tuned_codec));
+        num_tuned_codecs = n;
+    }
+    struct checkpoint_tuned_codec* tuned = tuned_codecs + index;
+    const double bandwidth = storage_bandwidth > 0 ? storage_bandwidth :
+                             measured_storage_bandwidth;
+    /* choose again when the bandwidth is measured for the first time or changes a lot */
+    if (tuned->element_size != element_size ||
+        (bandwidth > 0 && (tuned->bandwidth == 0 ||
+                           bandwidth > tuned->bandwidth*CHECKPOINT_RETUNE_FACTOR ||
+                           bandwidth*CHECKPOINT_RETUNE_FACTOR < tuned->bandwidth))) {
+        tuned->codec = checkpoint_autotune(buf, count, datatype, element_size, size_in_bytes,
+                                           bandwidth > 0 ? bandwidth :
+                                           CHECKPOINT_DEFAULT_BANDWIDTH);
+        tuned->element_size = element_size;
+        tuned->bandwidth = bandwidth;
+    }
+    return tuned->codec;
+}
+
+/*
+Compress the payload to the checkpoint file. Returns zero if the payload is
+not compressible with the codec and has to be written as is.
+*/
+static int checkpoint_write_compressed(struct mpi_checkpoint* checkpoint,
+                                       struct checkpoint_record* r, const void* buf,
+                                       MPI_Count count, MPI_Datatype datatype,
+                                       int element_size, uint32_t codec) {
+    checkpoint_compression_buffers();
+    const size_t size_in_bytes = r->size;
+    /* the compressed payload is stored only if it is smaller */
+    const size_t max_size = size_in_bytes - sizeof(uint64_t);
+    checkpoint_grow(checkpoint, size_in_bytes);
+    double t0 = checkpoint_clock();
+    char* data = ((char*)checkpoint->data) + checkpoint->offset;
+    uint64_t stored = checkpoint_compress(buf, count, datatype, element_size, codec,
+                                          data + sizeof(uint64_t), max_size);
+    checkpoint->counters[CHECKPOINT_COMPRESS] += checkpoint_clock() - t0;
+    if (stored == 0) { return 0; }
+    memcpy(data, &stored, sizeof(uint64_t));
+    r->codec = codec;
+    checkpoint->offset += sizeof(uint64_t) + stored;
+    checkpoint->bytes_saved += size_in_bytes - sizeof(uint64_t) - stored;
+    return 1;
+}
+
+/*
+The record at the read position. Zero-sized records are skipped when "size_in_bytes"
+is non-zero. Returns 0 if there is no such record.
+*/
+static const struct checkpoint_record* checkpoint_current_record(
+        struct mpi_checkpoint* checkpoint, size_t size_in_bytes) {
+    const struct checkpoint_record* records = checkpoint->records;
+    size_t i = checkpoint->next_record;
+    while (i < checkpoint->num_records &&
+           (records[i].offset < checkpoint->offset ||
+            (records[i].offset == checkpoint->offset && records[i].size == 0 &&
+             size_in_bytes != 0))) {
+        ++i;
+    }
+    if (i == checkpoint->num_records || records[i].offset != checkpoint->offset) { return 0; }
+    checkpoint->next_record = i+1;
+    return records + i;
+}
+
+/* Add the bytes to the checksum, the size must be a multiple of 4. */
+static void checkpoint_checksum_update(struct checkpoint_checksum* checksum, const char* data,
+                                       size_t size) {
+    uint64_t sum = checksum->sum, weighted_sum = checksum->weighted_sum;
+    for (size_t i=0; i<size; i+=sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(word));
+        sum += word;
+        weighted_sum += sum;
+    }
+    checksum->sum = sum;
+    checksum->weighted_sum = weighted_sum;
+}
+
+/*
+Append the table of contents and the footer to the file. With background-validation
+the checksum of the data and the table of contents is written before the footer.
+*/
+static void checkpoint_write_toc(struct mpi_checkpoint* checkpoint) {
+    const char zeros[sizeof(uint64_t)] = {0};
+    size_t remainder = checkpoint->offset % sizeof(uint64_t);
+    if (remainder != 0) {
+        checkpoint_write_bytes(checkpoint, zeros, sizeof(uint64_t)-remainder);
+    }
+    struct checkpoint_footer footer;
+    memset(&footer, 0, sizeof(footer));
+    memcpy(footer.magic, checkpoint_magic, sizeof(checkpoint_magic));
+    footer.records_offset = checkpoint->offset;
+    footer.num_records = checkpoint->num_records;
+    footer.version = background_validation ? 2 : 1;
+    footer.nprocs = checkpoint->nprocs;
+    checkpoint_write_bytes(checkpoint, checkpoint->records,
+                           checkpoint->num_records*sizeof(struct checkpoint_record));
+    struct checkpoint_checksum checksum = {0, 0};
+    if (background_validation) {
+        checkpoint_trace_begin("checkpoint_checksum");
+        double t0 = checkpoint_clock();
+        checkpoint_checksum_update(&checksum, checkpoint->data, checkpoint->offset);
+        checkpoint->counters[CHECKPOINT_COPY] += checkpoint_clock() - t0;
+        checkpoint_trace_end("checkpoint_checksum");
+    }
+    const size_t trailer_size = checkpoint_trailer_size(&footer);
+    if (checkpoint->reuse_file) {
+        /* the file is not truncated, the footer is written at the end of the file */
+        checkpoint_grow(checkpoint, trailer_size);
+        checkpoint->offset = checkpoint->size - trailer_size;
+    }
+    if (background_validation) {
+        checkpoint_write_bytes(checkpoint, &checksum, sizeof(checksum));
+    }
+    checkpoint_write_bytes(checkpoint, &footer, sizeof(footer));
+}
+
+static void checkpoint_slot_close(struct checkpoint_slot* slot) {
+    if (munmap(slot->data, slot->size) == -1) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+    if (close(slot->fd) == -1) {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Keep the file of the closed checkpoint. The oldest file is closed if there are no free slots. */
+static void checkpoint_slot_put(struct mpi_checkpoint* checkpoint) {
+    if (num_slots == checkpoint_slots) {
+        checkpoint_slot_close(slots + first_slot);
+        first_slot = (first_slot+1) % CHECKPOINT_MAX_SLOTS;
+        --num_slots;
+    }
+    struct checkpoint_slot* slot = slots + (first_slot+num_slots) % CHECKPOINT_MAX_SLOTS;
+    slot->communicator = checkpoint->communicator;
+    slot->nprocs = checkpoint->nprocs;
+    memcpy(slot->directory, checkpoint->directory, sizeof(slot->directory));
+    slot->fd = checkpoint->fd;
+    slot->data = checkpoint->data;
+    slot->size = checkpoint->size;
+    ++num_slots;
+}
+
+/*
+Take the file of the oldest checkpoint if all slots are used.
+Returns zero if there is no file to reuse.
+*/
+static int checkpoint_slot_take(MPI_Comm comm, struct checkpoint_slot* slot) {
+    if (checkpoint_slots == 0 || num_slots != checkpoint_slots ||
+        slots[first_slot].communicator != comm) {
+        return 0;
+    }
+    *slot = slots[first_slot];
+    first_slot = (first_slot+1) % CHECKPOINT_MAX_SLOTS;
+    --num_slots;
+    return 1;
+}
+
+/*
+Close the files that are in the directory of the new checkpoint
+(i.e. the checkpoint was created within the same second) as they are overwritten.
+*/
+static void checkpoint_slots_discard(const char* directory) {
+    int n = 0;
+    for (int i=0; i<num_slots; ++i) {
+        struct checkpoint_slot* slot = slots + (first_slot+i) % CHECKPOINT_MAX_SLOTS;
+        if (strcmp(slot->directory, directory) == 0) {
+            checkpoint_slot_close(slot);
+        } else {
+            if (n != i) { slots[(first_slot+n) % CHECKPOINT_MAX_SLOTS] = *slot; }
+            ++n;
+        }
+    }
+    num_slots = n;
+}
+
+static void checkpoint_slots_free() {
+    for (; num_slots != 0; --num_slots) {
+        checkpoint_slot_close(slots + first_slot);
+        first_slot = (first_slot+1) % CHECKPOINT_MAX_SLOTS;
+    }
+}
+
+/* Remove the directories of reused checkpoints that became empty. */
+static void checkpoint_remove_stale_directories() {
+    char path[4096+16];
+    int n = 0;
+    for (int i=0; i<num_stale_directories; ++i) {
+        struct checkpoint_slot* d = stale_directories + i;
+        const int nsubdirs = (d->nprocs + CHECKPOINT_RANKS_PER_DIRECTORY - 1) /
+                             CHECKPOINT_RANKS_PER_DIRECTORY;
+        for (int j=0; j<nsubdirs; ++j) {
+            snprintf(path, sizeof(path), "%s/%02x", d->directory, j);
+            rmdir(path);
+        }
+        snprintf(path, sizeof(path), "%s/metadata", d->directory);
+        unlink(path);
+        if (rmdir(d->directory) == -1 && errno != ENOENT) {
+            if (n != i) { stale_directories[n] = *d; }
+            ++n;
+        }
+    }
+    num_stale_directories = n;
+}
+
+static void checkpoint_add_stale_directory(const struct checkpoint_slot* slot) {
+    if (num_stale_directories == CHECKPOINT_MAX_SLOTS) { checkpoint_remove_stale_directories(); }
+    if (num_stale_directories == CHECKPOINT_MAX_SLOTS) { return; }
+    stale_directories[num_stale_directories++] = *slot;
+}
+
+/* Shared memory tier
+
+With shm-tier each rank copies its newest checkpoint file to the POSIX shared memory
+segment "/mpi-checkpoint.<hash>.<rank>" when the checkpoint is closed, where "hash" is
+the hash of the absolute path of the checkpoint directory, i.e. the jobs that run
+the same program on the node use different segments. The segment of the previous
+checkpoint is removed when the new one is written. The segment outlives the process,
+and MPI_Checkpoint_restore maps the segment instead of the file if it contains
+the requested checkpoint, i.e. the program that crashed restarts on the same nodes
+without reading the storage. The segment is removed when
+the program finishes (MPI_Checkpoint_finalize or MPI_Finalize) unless shm-tier-keep
+is set. The segment starts with the header, and the file is stored at the next page. */
+
+#define CHECKPOINT_SHM_MAGIC "MPICKSHM"
+
+struct checkpoint_shm_header {
+    char magic[8];
+    /* the size of the checkpoint file */
+    uint64_t size;
+    /* the index of the file */
+    int64_t rank;
+    char directory[4096];
+};
+
+static int shm_tier = 0;
+static int shm_tier_keep = 0;
+/* the segment that was written or mapped by this process */
+static char shm_segment[256] = "";
+
+/* The absolute path of the checkpoint directory that may not exist. */
+static void checkpoint_shm_directory(const char* directory, char* path, size_t n) {
+    char cwd[4096] = "";
+    if (directory[0] != '/' && !getcwd(cwd, sizeof(cwd))) { cwd[0] = 0; }
+    snprintf(path, n, "%s%s%s", cwd, cwd[0] ? "/" : "", directory);
+}
+
+/* The name of the segment of the rank that contains the file of the checkpoint "directory". */
+static void checkpoint_shm_name(char* name, size_t n, const char* directory, int rank) {
+    char path[sizeof(((struct checkpoint_shm_header*)0)->directory)];
+    checkpoint_shm_directory(directory, path, sizeof(path));
+    /* 64-bit FNV-1a */
+    uint64_t hash = 14695981039346656037UL;
+    for (const char* p=path; *p; ++p) { hash = (hash ^ (unsigned char)*p)*1099511628211UL; }
+    snprintf(name, n, "/mpi-checkpoint.%016llx.%d", (unsigned long long)hash, rank);
+}
+
+static size_t checkpoint_shm_offset() {
+    return (sizeof(struct checkpoint_shm_header) + page_size - 1)/page_size*page_size;
+}
+
+/* Copy the file of the checkpoint to the segment of the rank. */
+static void checkpoint_shm_save(const struct mpi_checkpoint* checkpoint) {
+    char name[256];
+    checkpoint_shm_name(name, sizeof(name), checkpoint->directory, checkpoint->rank);
+    checkpoint_trace_begin("checkpoint_shm");
+    const size_t size = checkpoint_shm_offset() + checkpoint->offset;
+    int fd = shm_open(name, O_CREAT|O_RDWR|O_CLOEXEC, 0600);
+    /* the pages are allocated in advance to get ENOSPC instead of SIGBUS */
+    int ret = fd == -1 ? -1 : 0;
+    if (ret == 0 && (ftruncate(fd, size) == -1 || (errno = posix_fallocate(fd, 0, size)))) {
+        ret = -1;
+    }
+    struct checkpoint_shm_header* header = MAP_FAILED;
+    if (ret == 0) { header = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0); }
+    if (header == MAP_FAILED) {
+        if (verbose) {
+            fprintf(stderr, "Unable to copy checkpoint to shared memory \"%s\": %s\n",
+                    name, strerror(errno));
+            fflush(stderr);
+        }
+        if (fd != -1) {
+            shm_unlink(name);
+            close(fd);
+        }
+        /* the segment of the previous checkpoint is kept */
+        if (strcmp(shm_segment, name) == 0) { shm_segment[0] = 0; }
+        checkpoint_trace_end("checkpoint_shm");
+        return;
+    }
+    /* the magic is written last, so that the segment is valid only if it is complete */
+    memset(header->magic, 0, sizeof(header->magic));
+    memcpy(((char*)header) + checkpoint_shm_offset(), checkpoint->data, checkpoint->offset);
+    header->size = checkpoint->offset;
+    header->rank = checkpoint->rank;
+    checkpoint_shm_directory(checkpoint->directory, header->directory,
+                             sizeof(header->directory));
+    __sync_synchronize();
+    memcpy(header->magic, CHECKPOINT_SHM_MAGIC, sizeof(header->magic));
+    if (munmap(header, size) == -1) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+    if (shm_segment[0] != 0 && strcmp(shm_segment, name) != 0 &&
+        shm_unlink(shm_segment) == -1 && errno != ENOENT) {
+        perror("shm_unlink");
+    }
+    snprintf(shm_segment, sizeof(shm_segment), "%s", name);
+    checkpoint_trace_end("checkpoint_shm");
+}
+
+/*
+Map the file "rank" of the checkpoint "directory" from the segment of the rank.
+Returns -1 if the segment does not contain the file.
+*/
+static int checkpoint_shm_map(const char* directory, int rank, char* path, size_t n,
+                              struct checkpoint_file* file) {
+    char name[256];
+    checkpoint_shm_name(name, sizeof(name), directory, rank);
+    int fd = shm_open(name, O_RDONLY|O_CLOEXEC, 0);
+    if (fd == -1) { return -1; }
+    struct checkpoint_shm_header header;
+    char path_of_directory[sizeof(header.directory)];
+    checkpoint_shm_directory(directory, path_of_directory, sizeof(path_of_directory));
+    struct stat status;
+    const size_t offset = checkpoint_shm_offset();
+    if (fstat(fd, &status) == -1 || status.st_size < offset ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, CHECKPOINT_SHM_MAGIC, sizeof(header.magic)) != 0 ||
+        header.rank != rank || header.size > status.st_size - offset ||
+        strncmp(header.directory, path_of_directory, sizeof(header.directory)) != 0) {
+        close(fd);
+        return -1;
+    }
+    file->fd = fd;
+    file->size = header.size;
+    file->data_size = header.size;
+    file->data = 0;
+    if (file->size != 0) {
+        file->data = mmap(0, file->size, PROT_READ, MAP_SHARED, fd, offset);
+        if (file->data == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+    snprintf(path, n, "/dev/shm%s", name);
+    snprintf(shm_segment, sizeof(shm_segment), "%s", name);
+    return 0;
+}
+
+/* Remove the segment after the successful run. */
+static void checkpoint_shm_cleanup() {
+    if (shm_segment[0] == 0 || shm_tier_keep) { return; }
+    if (shm_unlink(shm_segment) == -1 && errno != ENOENT) { perror("shm_unlink"); }
+    shm_segment[0] = 0;
+}
+
+/* Background drain
+
+With background-drain the file of the closed checkpoint is written, truncated and
+closed by the drain thread, so that MPI_Checkpoint_close does not wait for the storage.
+The data is staged in the memory file (memfd) instead of the page cache of the checkpoint
+file, so that the kernel does not write it back on its own schedule. The drain thread
+copies the data to the file in chunks with pwrite and waits until each chunk reaches
+the storage, i.e. the rate bounds the actual traffic, and each chunk takes tokens from
+the token bucket that is refilled at the drain rate. The rate is either fixed (drain-rate)
+or adapted to the iteration time reported by MPI_Checkpoint_iteration (drain-share):
+the rate is halved when the last iterations were slower than the iterations without
+the drain by more than the share, and is increased by a constant step otherwise (AIMD). */
+
+#define CHECKPOINT_DRAIN_CHUNK (1UL*1024UL*1024UL)
+/* the maximum number of tokens in the bucket in seconds of the drain rate */
+#define CHECKPOINT_DRAIN_BURST 0.05
+#define CHECKPOINT_DRAIN_MIN_RATE (1e6)
+#define CHECKPOINT_DRAIN_INITIAL_RATE (64e6)
+#define CHECKPOINT_DRAIN_RATE_STEP (8e6)
+/* the number of iterations that are averaged before the rate is changed */
+#define CHECKPOINT_DRAIN_WINDOW 3
+
+/* the file of the closed checkpoint that is written by the drain thread */
+struct checkpoint_drain {
+    /* the memory file with the staged data and the checkpoint file */
+    int fd;
+    int file_fd;
+    void* data;
+    size_t size;
+    /* the size of the file */
+    size_t offset;
+    struct checkpoint_drain* next;
+};
+
+static int background_drain = 0;
+/* the maximum drain rate in bytes per second, 0 means unlimited */
+static double drain_max_rate = 0;
+/* the allowed slowdown of the iterations, 0 means the rate is not adapted */
+static double drain_share = 0;
+static pthread_t drain_thread;
+static int drain_thread_started = 0;
+static int drain_stop = 0;
+/* protects all variables below */
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static struct checkpoint_drain* first_drain = 0;
+static struct checkpoint_drain* last_drain = 0;
+/* the number of queued files and the file that is written */
+static int num_drains = 0;
+/* the current drain rate in bytes per second, 0 means unlimited */
+static double drain_rate = 0;
+static double drain_tokens = 0;
+static double drain_time = 0;
+/* iteration times */
+static double last_iteration = 0;
+static double iteration_baseline = 0;
+static double iteration_sum = 0;
+static int num_iterations = 0;
+
+/* Wait until the bucket has "size" tokens. */
+static void checkpoint_drain_throttle(size_t size) {
+    pthread_mutex_lock(&drain_mutex);
+    const double rate = drain_rate;
+    double now = checkpoint_clock();
+    double wait = 0;
+    if (rate > 0) {
+        drain_tokens += (now - drain_time)*rate;
+        if (drain_tokens > rate*CHECKPOINT_DRAIN_BURST) {
+            drain_tokens = rate*CHECKPOINT_DRAIN_BURST;
+        }
+        drain_tokens -= size;
+        if (drain_tokens < 0) { wait = -drain_tokens/rate; }
+    }
+    drain_time = now;
+    pthread_mutex_unlock(&drain_mutex);
+    if (wait > 0) {
+        struct timespec t;
+        t.tv_sec = (time_t)wait;
+        t.tv_nsec = (long)((wait - t.tv_sec)*1e9);
+        while (nanosleep(&t, &t) == -1 && errno == EINTR) {}
+    }
+}
+
+/* Write the staged data to the file in throttled chunks, truncate and close the files. */
+static void checkpoint_drain_file(struct checkpoint_drain* drain) {
+    checkpoint_trace_begin("checkpoint_drain");
+    const size_t chunk = CHECKPOINT_DRAIN_CHUNK > mapping_step ? CHECKPOINT_DRAIN_CHUNK :
+                         mapping_step;
+    for (size_t offset=0; offset<drain->offset; offset+=chunk) {
+        size_t size = drain->offset - offset;
+        if (size > chunk) { size = chunk; }
+        checkpoint_drain_throttle(size);
+        for (size_t n=0; n<size; ) {
+            ssize_t ret = pwrite(drain->file_fd, ((char*)drain->data) + offset + n, size - n,
+                                 offset + n);
+            if (ret == -1 && errno == EINTR) { continue; }
+            if (ret == -1) {
+                perror("pwrite");
+                exit(EXIT_FAILURE);
+            }
+            n += ret;
+        }
+        /* the chunk is on the storage before the next chunk takes tokens */
+        if (sync_file_range(drain->file_fd, offset, size,
+                            SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|
+                            SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+            perror("sync_file_range");
+            exit(EXIT_FAILURE);
+        }
+        posix_fadvise(drain->file_fd, offset, size, POSIX_FADV_DONTNEED);
+    }
+    if (munmap(drain->data, drain->size) == -1) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(drain->file_fd, drain->offset) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    if (fdatasync(drain->file_fd) == -1) {
+        perror("fdatasync");
+        exit(EXIT_FAILURE);
+    }
+    if (close(drain->fd) == -1 || close(drain->file_fd) == -1) {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+    checkpoint_trace_end("checkpoint_drain");
+}
+
+static void* checkpoint_drain_main(void* arg) {
+    pthread_mutex_lock(&drain_mutex);
+    for (;;) {
+        while (!first_drain && !drain_stop) { pthread_cond_wait(&drain_cond, &drain_mutex); }
+        struct checkpoint_drain* drain = first_drain;
+        if (!drain) { break; }
+        first_drain = drain->next;
+        if (!first_drain) { last_drain = 0; }
+        pthread_mutex_unlock(&drain_mutex);
+        checkpoint_drain_file(drain);
+        free(drain);
+        pthread_mutex_lock(&drain_mutex);
+        --num_drains;
+        pthread_cond_broadcast(&drain_cond);
+    }
+    pthread_mutex_unlock(&drain_mutex);
+    return 0;
+}
+
+/* Pass the file of the checkpoint to the drain thread. */
+static void checkpoint_drain_put(struct mpi_checkpoint* checkpoint) {
+    struct checkpoint_drain* drain = malloc(sizeof(struct checkpoint_drain));
+    if (!drain) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    drain->fd = checkpoint->fd;
+    drain->file_fd = checkpoint->drain_fd;
+    drain->data = checkpoint->data;
+    drain->size = checkpoint->size;
+    drain->offset = checkpoint->offset;
+    drain->next = 0;
+    pthread_mutex_lock(&drain_mutex);
+    if (!drain_thread_started) {
+        drain_stop = 0;
+        drain_rate = drain_share > 0 && drain_max_rate == 0 ? CHECKPOINT_DRAIN_INITIAL_RATE :
+                     drain_max_rate;
+        drain_tokens = 0;
+        drain_time = checkpoint_clock();
+        if (pthread_create(&drain_thread, 0, checkpoint_drain_main, 0) != 0) {
+            fprintf(stderr, "Unable to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+        drain_thread_started = 1;
+    }
+    if (last_drain) { last_drain->next = drain; } else { first_drain = drain; }
+    last_drain = drain;
+    ++num_drains;
+    pthread_cond_broadcast(&drain_cond);
+    pthread_mutex_unlock(&drain_mutex);
+    checkpoint->data = 0;
+    checkpoint->size = 0;
+    checkpoint->fd = -1;
+    checkpoint->drain_fd = -1;
+    checkpoint->offset = 0;
+}
+
+/* Wait until all files are written and stop the drain thread. */
+static void checkpoint_drain_finish() {
+    pthread_mutex_lock(&drain_mutex);
+    const int started = drain_thread_started;
+    drain_stop = 1;
+    drain_thread_started = 0;
+    pthread_cond_broadcast(&drain_cond);
+    pthread_mutex_unlock(&drain_mutex);
+    if (started) { pthread_join(drain_thread, 0); }
+}
+
+/* Wait until all queued files are written. */
+static void checkpoint_drain_wait() {
+    pthread_mutex_lock(&drain_mutex);
+    while (num_drains != 0) { pthread_cond_wait(&drain_cond, &drain_mutex); }
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+/* Adapt the drain rate to the time of the last iterations (AIMD). */
+static void checkpoint_drain_adapt(double iteration_time) {
+    pthread_mutex_lock(&drain_mutex);
+    if (num_drains == 0) {
+        /* the baseline is the moving average of the iterations without the drain */
+        iteration_baseline = iteration_baseline == 0 ? iteration_time :
+                             0.75*iteration_baseline + 0.25*iteration_time;
+        iteration_sum = 0;
+        num_iterations = 0;
+    } else if (drain_share > 0 && iteration_baseline > 0) {
+        iteration_sum += iteration_time;
+        if (++num_iterations == CHECKPOINT_DRAIN_WINDOW) {
+            if (iteration_sum/num_iterations > (1 + drain_share)*iteration_baseline) {
+                drain_rate /= 2;
+                if (drain_rate < CHECKPOINT_DRAIN_MIN_RATE) {
+                    drain_rate = CHECKPOINT_DRAIN_MIN_RATE;
+                }
+            } else {
+                drain_rate += CHECKPOINT_DRAIN_RATE_STEP;
+                if (drain_max_rate > 0 && drain_rate > drain_max_rate) {
+                    drain_rate = drain_max_rate;
+                }
+            }
+            iteration_sum = 0;
+            num_iterations = 0;
+        }
+    }
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+/* Lazy restore
+
+With lazy-restore MPI_Checkpoint_read does not copy the payload to the array. Instead
+the whole pages of the array are discarded and registered with userfaultfd, and
+the lazy restore thread fills each page from the checkpoint file (or from the staging
+buffer of the prefetch thread) when the program touches it. When there are no page
+faults, the thread fills the pending pages in the order of the reads. The mapping of
+the file is passed to the thread when the checkpoint is closed and is unmapped when
+all pages are filled. */
+
+/* smaller arrays are copied */
+#define CHECKPOINT_LAZY_MIN_SIZE (1UL*1024UL*1024UL)
+/* the number of bytes that are filled between the checks for page faults */
+#define CHECKPOINT_LAZY_CHUNK (256UL*1024UL)
+/* the number of pages that are filled on the page fault */
+#define CHECKPOINT_LAZY_FAULT_PAGES 16
+
+/* the mapping of the restored file that is used by the pending ranges */
+struct checkpoint_lazy_source {
+    int fd;
+    void* data;
+    size_t size;
+    int num_ranges;
+    /* the checkpoint is closed and the mapping is owned by the thread */
+    int closed;
+};
+
+/* the pages of the array that are filled by the lazy restore thread */
+struct checkpoint_lazy_range {
+    char* first;
+    char* last;
+    /* the first page that is not filled by the thread yet */
+    char* next;
+    /* the data of the first page */
+    const char* data;
+    struct checkpoint_lazy_source* source;
+    /* the staging buffer that is freed when all pages are filled */
+    char* staged;
+    struct checkpoint_lazy_range* next_range;
+};
+
+static int lazy_restore = 0;
+static int lazy_fd = -1;
+/* wakes up the thread when a range is added */
+static int lazy_pipe[2] = {-1, -1};
+static pthread_t lazy_thread;
+static int lazy_thread_started = 0;
+/* protects all variables below */
+static pthread_mutex_t lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int lazy_stop = 0;
+static struct checkpoint_lazy_range* first_range = 0;
+static struct checkpoint_lazy_range* last_range = 0;
+
+static void checkpoint_lazy_source_unmap(struct checkpoint_lazy_source* source) {
+    if (source->data && munmap(source->data, source->size) == -1) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+    if (source->fd != -1 && close(source->fd) == -1) {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+    free(source);
+}
+
+/*
+Fill "size" bytes at "address" from the range. Returns the number of bytes
+that were filled or skipped (the pages that are already filled), or -1 if
+the pages are no longer mapped.
+*/
+static ssize_t checkpoint_lazy_copy(struct checkpoint_lazy_range* range, char* address,
+                                    size_t size) {
+    struct uffdio_copy copy;
+    copy.dst = (uintptr_t)address;
+    copy.src = (uintptr_t)(range->data + (address - range->first));
+    copy.len = size;
+    copy.mode = 0;
+    copy.copy = 0;
+    if (ioctl(lazy_fd, UFFDIO_COPY, &copy) == 0) { return size; }
+    if (errno == EEXIST) {
+        const size_t copied = copy.copy > 0 ? copy.copy : 0;
+        return copied + page_size;
+    }
+    if (errno == EAGAIN) { return copy.copy > 0 ? copy.copy : 0; }
+    return -1;
+}
+
+/* Unregister the range and release the mapping of the closed checkpoint. */
+static void checkpoint_lazy_complete(struct checkpoint_lazy_range* range) {
+    struct uffdio_range r = {(uintptr_t)range->first, range->last - range->first};
+    ioctl(lazy_fd, UFFDIO_UNREGISTER, &r);
+    free(range->staged);
+    struct checkpoint_lazy_source* source = range->source;
+    if (source && --source->num_ranges == 0 && source->closed) {
+        checkpoint_lazy_source_unmap(source);
+    }
+    free(range);
+}
+
+/* Fill the pages at the address of the page fault and wake up the program. */
+static void checkpoint_lazy_fault(char* address) {
+    address = (char*)(((uintptr_t)address)/page_size*page_size);
+    struct checkpoint_lazy_range* range = first_range;
+    while (range && !(range->first <= address && address < range->last)) {
+        range = range->next_range;
+    }
+    if (range) {
+        size_t size = range->last - address;
+        if (size > CHECKPOINT_LAZY_FAULT_PAGES*page_size) {
+            size = CHECKPOINT_LAZY_FAULT_PAGES*page_size;
+        }
+        while (size != 0) {
+            ssize_t n = checkpoint_lazy_copy(range, address, size);
+            if (n <= 0 || n >= (ssize_t)size) { break; }
+            address += n, size -= n;
+        }
+    } else {
+        /* the page of the completed range was discarded by the program */
+        struct uffdio_zeropage zero = {{(uintptr_t)address, page_size}, 0, 0};
+        ioctl(lazy_fd, UFFDIO_ZEROPAGE, &zero);
+    }
+    /* the page may have been filled before the fault was read */
+    struct uffdio_range r = {(uintptr_t)address, page_size};
+    ioctl(lazy_fd, UFFDIO_WAKE, &r);
+}
+
+/* Fill the next chunk of the first range. */
+static void checkpoint_lazy_stream() {
+    struct checkpoint_lazy_range* range = first_range;
+    size_t size = range->last - range->next;
+    if (size > CHECKPOINT_LAZY_CHUNK) { size = CHECKPOINT_LAZY_CHUNK; }
+    ssize_t n = checkpoint_lazy_copy(range, range->next, size);
+    range->next = n == -1 ? range->last : range->next + n;
+    if (range->next >= range->last) {
+        first_range = range->next_range;
+        if (!first_range) { last_range = 0; }
+        checkpoint_lazy_complete(range);
+    }
+}
+
+static void* checkpoint_lazy_main(void* arg) {
+    struct pollfd fds[2] = {{lazy_fd, POLLIN, 0}, {lazy_pipe[0], POLLIN, 0}};
+    for (;;) {
+        pthread_mutex_lock(&lazy_mutex);
+        const int pending = first_range != 0;
+        const int stop = lazy_stop;
+        pthread_mutex_unlock(&lazy_mutex);
+        if (stop && !pending) { break; }
+        if (poll(fds, 2, pending ? 0 : -1) == -1) {
+            if (errno == EINTR) { continue; }
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            if (read(lazy_pipe[0], buf, sizeof(buf)) == -1 && errno != EAGAIN) {
+                perror("read");
+                exit(EXIT_FAILURE);
+            }
+        }
+        pthread_mutex_lock(&lazy_mutex);
+        if (fds[0].revents & POLLIN) {
+            /* the page faults are handled before the pending pages */
+            struct uffd_msg msg;
+            while (read(lazy_fd, &msg, sizeof(msg)) == sizeof(msg)) {
+                if (msg.event == UFFD_EVENT_PAGEFAULT) {
+                    checkpoint_lazy_fault((char*)(uintptr_t)msg.arg.pagefault.address);
+                }
+            }
+        } else if (first_range) {
+            checkpoint_lazy_stream();
+        }
+        pthread_mutex_unlock(&lazy_mutex);
+    }
+    return 0;
+}
+
+/*
+Open userfaultfd and start the thread. Returns -1 if userfaultfd is not available.
+The file descriptor that handles only the faults of the user mode (UFFD_USER_MODE_ONLY)
+is not used: the system calls that access the registered pages would fail with EFAULT
+instead of waiting for the thread.
+*/
+static int checkpoint_lazy_start() {
+    if (lazy_thread_started) { return 0; }
+    lazy_fd = syscall(SYS_userfaultfd, O_CLOEXEC|O_NONBLOCK);
+    struct uffdio_api api = {UFFD_API, 0, 0};
+    if (lazy_fd == -1 || ioctl(lazy_fd, UFFDIO_API, &api) == -1) {
+        if (verbose) {
+            fprintf(stderr, "userfaultfd is not available, lazy restore is disabled: %s\n",
+                    strerror(errno));
+            fflush(stderr);
+        }
+        if (lazy_fd != -1) { close(lazy_fd); }
+        lazy_fd = -1;
+        lazy_restore = 0;
+        return -1;
+    }
+    if (pipe2(lazy_pipe, O_CLOEXEC|O_NONBLOCK) == -1) {
+        perror("pipe2");
+        exit(EXIT_FAILURE);
+    }
+    lazy_stop = 0;
+    if (pthread_create(&lazy_thread, 0, checkpoint_lazy_main, 0) != 0) {
+        fprintf(stderr, "Unable to create thread\n");
+        exit(EXIT_FAILURE);
+    }
+    lazy_thread_started = 1;
+    return 0;
+}
+
+/*
+Register the whole pages of the array with userfaultfd, so that they are filled
+from "data" by the lazy restore thread, and copy the rest of the array.
+The staging buffer is freed by the thread. Returns -1 if the array has to be copied.
+*/
+static int checkpoint_lazy_read(struct mpi_checkpoint* checkpoint, void* buf, size_t size,
+                                const char* data, char* staged) {
+    char* first = (char*)((((uintptr_t)buf) + page_size - 1)/page_size*page_size);
+    char* last = (char*)((((uintptr_t)buf) + size)/page_size*page_size);
+    if (!lazy_restore || last <= first || last - first < CHECKPOINT_LAZY_MIN_SIZE) {
+        return -1;
+    }
+    if (checkpoint_lazy_start() == -1) { return -1; }
+    struct checkpoint_lazy_range* range = malloc(sizeof(struct checkpoint_lazy_range));
+    unsigned char* resident = malloc((last - first)/page_size);
+    if (!range || !resident) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&lazy_mutex);
+    /* the array that is filled by the thread is copied */
+    int ret = 0;
+    for (struct checkpoint_lazy_range* r=first_range; r; r=r->next_range) {
+        if (r->first < last && first < r->last) { ret = -1; }
+    }
+    struct uffdio_register reg;
+    reg.range.start = (uintptr_t)first;
+    reg.range.len = last - first;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ret == 0 && ioctl(lazy_fd, UFFDIO_REGISTER, &reg) == -1) { ret = -1; }
+    if (ret == 0) {
+        /* only the discarded pages of the private anonymous memory are missing */
+        if (madvise(first, last - first, MADV_DONTNEED) == -1 ||
+            mincore(first, last - first, resident) == -1) {
+            ret = -1;
+        }
+        for (size_t i=0; ret == 0 && i<(last - first)/page_size; ++i) {
+            if (resident[i] & 1) { ret = -1; }
+        }
+        if (ret == -1) { ioctl(lazy_fd, UFFDIO_UNREGISTER, &reg.range); }
+    }
+    free(resident);
+    if (ret == -1) {
+        pthread_mutex_unlock(&lazy_mutex);
+        free(range);
+        return -1;
+    }
+    range->first = first;
+    range->last = last;
+    range->next = first;
+    range->data = data + (first - (char*)buf);
+    range->staged = staged;
+    range->source = 0;
+    range->next_range = 0;
+    if (!staged) {
+        if (!checkpoint->lazy_source) {
+            checkpoint->lazy_source = calloc(1, sizeof(struct checkpoint_lazy_source));
+            if (!checkpoint->lazy_source) {
+                fprintf(stderr, "not enough memory\n");
+                exit(EXIT_FAILURE);
+            }
+            checkpoint->lazy_source->fd = -1;
+        }
+        range->source = checkpoint->lazy_source;
+        ++range->source->num_ranges;
+    }
+    if (last_range) { last_range->next_range = range; } else { first_range = range; }
+    last_range = range;
+    pthread_mutex_unlock(&lazy_mutex);
+    if (write(lazy_pipe[1], "", 1) == -1 && errno != EAGAIN) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(buf, data, first - (char*)buf);
+    memcpy(last, data + (last - (char*)buf), ((char*)buf) + size - last);
+    return 0;
+}
+
+/* Pass the mapping of the closed checkpoint to the thread if the pages are not filled yet. */
+static void checkpoint_lazy_release(struct mpi_checkpoint* checkpoint) {
+    struct checkpoint_lazy_source* source = checkpoint->lazy_source;
+    checkpoint->lazy_source = 0;
+    pthread_mutex_lock(&lazy_mutex);
+    if (source->num_ranges == 0) {
+        free(source);
+    } else {
+        source->fd = checkpoint->fd;
+        source->data = checkpoint->data;
+        source->size = checkpoint->size;
+        source->closed = 1;
+        checkpoint->fd = -1;
+        checkpoint->data = 0;
+        checkpoint->size = 0;
+    }
+    pthread_mutex_unlock(&lazy_mutex);
+}
+
+/* Wait until all pages are filled and stop the thread. */
+static void checkpoint_lazy_finish() {
+    if (!lazy_thread_started) { return; }
+    pthread_mutex_lock(&lazy_mutex);
+    lazy_stop = 1;
+    pthread_mutex_unlock(&lazy_mutex);
+    if (write(lazy_pipe[1], "", 1) == -1 && errno != EAGAIN) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    pthread_join(lazy_thread, 0);
+    lazy_thread_started = 0;
+    close(lazy_pipe[0]);
+    close(lazy_pipe[1]);
+    close(lazy_fd);
+    lazy_pipe[0] = lazy_pipe[1] = lazy_fd = -1;
+}
+
+/* Durability
+
+The durability level decides what MPI_Checkpoint_close waits for. With "none" the files
+are left in the page cache, with "pagecache" the writeback of the files is started but
+close does not wait for it, and with "fsync" each rank flushes its files. With
+"fsync+dirsync" the directories are flushed as well, so that the names of the files
+survive the crash of the node. If the level is set, close waits for all ranks, and
+rank 0 writes the file "metadata" to the checkpoint directory under a temporary name
+and atomically renames it: a checkpoint that has the metadata is complete, and the level
+in the metadata tells the restart tooling whether the checkpoint survives a node reboot.
+If the level is not set, the files are flushed as with "fsync" and the metadata
+is not written. */
+
+enum checkpoint_durability {
+    CHECKPOINT_DURABILITY_NONE = 0,
+    CHECKPOINT_DURABILITY_PAGECACHE,
+    CHECKPOINT_DURABILITY_FSYNC,
+    CHECKPOINT_DURABILITY_DIRSYNC,
+    CHECKPOINT_NUM_DURABILITY_LEVELS
+};
+
+static const char* checkpoint_durability_names[CHECKPOINT_NUM_DURABILITY_LEVELS] = {
+    "none", "pagecache", "fsync", "fsync+dirsync"
+};
+
+/* the level from the durability option or -1 if it is not set */
+static int durability = -1;
+
+/* The level that decides how the files are flushed. */
+static int checkpoint_flush_level() {
+    return durability == -1 ? CHECKPOINT_DURABILITY_FSYNC : durability;
+}
+
+/* Start the writeback of the file without waiting for it. */
+static void checkpoint_start_writeback(int fd) {
+    if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE) == -1) {
+        perror("sync_file_range");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int checkpoint_sync_directory(const char* path) {
+    int fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd == -1) { return -1; }
+    int ret = fsync(fd);
+    if (close(fd) == -1) { ret = -1; }
+    return ret;
+}
+
+/*
+Flush the checkpoint directory (without the trailing "/"), its subdirectories and
+its parent directory that contains the name of the checkpoint directory.
+*/
+static int checkpoint_sync_directories(const char* directory, int nprocs) {
+    char path[4096+16];
+    const int nsubdirs = (nprocs + CHECKPOINT_RANKS_PER_DIRECTORY - 1) /
+                         CHECKPOINT_RANKS_PER_DIRECTORY;
+    for (int i=0; i<nsubdirs; ++i) {
+        snprintf(path, sizeof(path), "%s/%02x", directory, i);
+        if (checkpoint_sync_directory(path) == -1) { return -1; }
+    }
+    if (checkpoint_sync_directory(directory) == -1) { return -1; }
+    snprintf(path, sizeof(path), "%s", directory);
+    char* slash = strrchr(path, '/');
+    if (slash == path) { slash[1] = 0; }
+    else if (slash) { *slash = 0; }
+    else { strcpy(path, "."); }
+    return checkpoint_sync_directory(path);
+}
+
+static void checkpoint_write_metadata(const struct mpi_checkpoint* checkpoint) {
+    char path[4096+16], tmp[4096+16];
+    snprintf(path, sizeof(path), "%s/metadata", checkpoint->directory);
+    snprintf(tmp, sizeof(tmp), "%s/metadata.tmp", checkpoint->directory);
+    FILE* file = fopen(tmp, "w");
+    int ret = file ? 0 : -1;
+    if (file) {
+        fprintf(file, "nprocs = %d\n", checkpoint->nprocs);
+        fprintf(file, "timestamp = %lld\n", (long long)checkpoint->timestamp);
+        fprintf(file, "durability = %s\n", checkpoint_durability_names[durability]);
+        if (fflush(file) == EOF) { ret = -1; }
+        if (ret == 0 && durability >= CHECKPOINT_DURABILITY_FSYNC &&
+            fsync(fileno(file)) == -1) { ret = -1; }
+        if (fclose(file) == EOF) { ret = -1; }
+    }
+    if (ret == 0) { ret = rename(tmp, path); }
+    if (ret == 0 && durability == CHECKPOINT_DURABILITY_DIRSYNC) {
+        const struct checkpoint_stripes* stripes = checkpoint->stripes;
+        for (int i=0; stripes && i<stripes->count && ret == 0; ++i) {
+            ret = checkpoint_sync_directories(stripes->directories[i], checkpoint->nprocs);
+        }
+        if (ret == 0) {
+            ret = checkpoint_sync_directories(checkpoint->directory, checkpoint->nprocs);
+        }
+    }
+    if (ret == -1) {
+        fprintf(stderr, "Unable to write checkpoint metadata \"%s\": %s\n",
+                path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+Wait for all ranks to release their files and write the metadata on rank 0.
+The other ranks do not wait for rank 0.
+*/
+static void checkpoint_commit(struct mpi_checkpoint* checkpoint) {
+    checkpoint_trace_begin("checkpoint_commit");
+    double t0 = checkpoint_clock();
+    MPI_Comm comm = checkpoint->communicator;
+    int rank = 0, one = 1, nreleased = 0;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Reduce(&one, &nreleased, 1, MPI_INT, MPI_SUM, 0, comm);
+    if (rank == 0) { checkpoint_write_metadata(checkpoint); }
+    checkpoint->counters[CHECKPOINT_CLOSE] += checkpoint_clock() - t0;
+    checkpoint_trace_end("checkpoint_commit");
+}
+
+/* Background validation
+
+With background-validation the checksum of each file is written before the footer,
+and MPI_Checkpoint_close passes the file of the rank to the validation thread that
+runs with the lowest CPU and I/O priority. The thread reads the file back with O_DIRECT
+(bypassing the page cache, so that the data comes from the storage), checks the footer,
+the table of contents and the checksum, and marks the file as validated or bad in
+the file "<rank>.status" next to it (next to the first stripe of the striped file).
+The thread can not communicate with the other ranks, i.e. the checkpoint is validated
+when the files of all ranks are validated. The drained files are read after the drain
+thread has written them, and the reused files are not moved to the next checkpoint
+until they are validated. */
+
+/* the size of the reads, a multiple of the alignment of O_DIRECT */
+#define CHECKPOINT_VALIDATION_CHUNK (1UL*1024UL*1024UL)
+#define CHECKPOINT_VALIDATION_ALIGNMENT 4096UL
+/* ioprio_set(2) constants that are not in the libc headers */
+#define CHECKPOINT_IOPRIO_WHO_PROCESS 1
+#define CHECKPOINT_IOPRIO_CLASS_IDLE 3
+#define CHECKPOINT_IOPRIO_CLASS_SHIFT 13
+
+/* the file of the committed checkpoint that is read back by the validation thread */
+struct checkpoint_validation {
+    /* the file of the rank or its stripes in the order of the stripes */
+    char paths[CHECKPOINT_MAX_STRIPES][4096];
+    int count;
+    /* the stripe size or 0 if the file is not striped */
+    size_t stripe_size;
+    int rank;
+    /* the opened files and the size of the stream */
+    int fds[CHECKPOINT_MAX_STRIPES];
+    size_t size;
+    struct checkpoint_validation* next;
 };
 
-static char checkpoint_prefix[4096] = "checkpoint";
-/* minimum checkpoint interval in seconds */
-static int checkpoint_min_interval = 0;
-const size_t checkpoint_initial_size = 4096;
-static int last_checkpoint_timestamp = 0;
-static int initialized = 0;
-static int verbose = 0;
-static int no_checkpoint = 0;
-static int compression_level = 0;
-/* the name of the checkpoint from which we plan to restore the program */
-static const char* checkpoint_filename = 0;
-static mz_stream compressor = {0};
-static mz_stream decompressor = {0};
-static char* compression_buffer = 0;
-static double checkpoint_t0 = 0;
-static double checkpoint_t1 = 0;
-/* fortran checkpoints */
-static MPI_Checkpoint checkpoints[4096/sizeof(MPI_Checkpoint)];
-static int checkpoints_count = 0;
-static size_t page_size = 4096;
+static pthread_t validation_thread;
+static int validation_thread_started = 0;
+static int validation_stop = 0;
+/* protects all variables below */
+static pthread_mutex_t validation_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t validation_cond = PTHREAD_COND_INITIALIZER;
+static struct checkpoint_validation* first_validation = 0;
+static struct checkpoint_validation* last_validation = 0;
+/* the number of queued files and the file that is read */
+static int num_validations = 0;
 
-static struct mpi_checkpoint* checkpoint_alloc() {
-    struct mpi_checkpoint* checkpoint = malloc(sizeof(struct mpi_checkpoint));
-    if (!checkpoint) {
+/* The path of the status of the file of the rank. */
+static void checkpoint_status_path(char* path, size_t n, const char* file_path) {
+    if (snprintf(path, n, "%s.status", file_path) < 0) {
+        perror("snprintf");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+Open the files with O_DIRECT. The file systems that do not support O_DIRECT are read
+through the page cache after the cached pages are dropped. Returns -1 on error.
+*/
+static int checkpoint_validation_open(struct checkpoint_validation* v) {
+    size_t sizes[CHECKPOINT_MAX_STRIPES];
+    v->size = 0;
+    for (int i=0; i<v->count; ++i) { v->fds[i] = -1; }
+    for (int i=0; i<v->count; ++i) {
+        v->fds[i] = open(v->paths[i], O_RDONLY|O_DIRECT|O_CLOEXEC);
+        if (v->fds[i] == -1 && errno == EINVAL) {
+            v->fds[i] = open(v->paths[i], O_RDONLY|O_CLOEXEC);
+            if (v->fds[i] != -1) { posix_fadvise(v->fds[i], 0, 0, POSIX_FADV_DONTNEED); }
+        }
+        struct stat status;
+        if (v->fds[i] == -1 || fstat(v->fds[i], &status) == -1) { return -1; }
+        sizes[i] = status.st_size;
+        v->size += sizes[i];
+    }
+    if (v->stripe_size == 0) { return 0; }
+    /* only the size and the number of the stripes are used */
+    struct checkpoint_stripes stripes;
+    stripes.size = v->stripe_size;
+    stripes.count = v->count;
+    for (int i=0; i<v->count; ++i) {
+        if (sizes[i] != checkpoint_stripe_file_size(&stripes, i, v->size)) { return -1; }
+    }
+    return 0;
+}
+
+static void checkpoint_validation_close(struct checkpoint_validation* v) {
+    for (int i=0; i<v->count; ++i) {
+        if (v->fds[i] != -1) { close(v->fds[i]); }
+        v->fds[i] = -1;
+    }
+}
+
+/*
+Read "size" bytes (a multiple of the alignment) at the aligned offset of the stream.
+The read ends at the end of the stream. Returns the number of bytes read or -1.
+*/
+static ssize_t checkpoint_validation_read(const struct checkpoint_validation* v, char* buf,
+                                          size_t size, size_t offset) {
+    size_t nread = 0;
+    while (nread != size && offset + nread < v->size) {
+        size_t position = offset + nread, n = size - nread;
+        int fd = v->fds[0];
+        if (v->stripe_size != 0) {
+            const size_t k = position / v->stripe_size;
+            const size_t remaining = v->stripe_size - position % v->stripe_size;
+            if (n > remaining) { n = remaining; }
+            fd = v->fds[k % v->count];
+            position = (k / v->count)*v->stripe_size + position % v->stripe_size;
+        }
+        ssize_t ret = pread(fd, buf + nread, n, position);
+        if (ret == -1 && errno == EINTR) { continue; }
+        if (ret <= 0) { return -1; }
+        nread += ret;
+    }
+    return nread;
+}
+
+/* Read the file back and check it. Returns 0 or the description of the problem. */
+static const char* checkpoint_validate_file(struct checkpoint_validation* v, char* buf,
+                                            struct checkpoint_footer* footer) {
+    const size_t alignment = CHECKPOINT_VALIDATION_ALIGNMENT;
+    const size_t max_trailer_size = sizeof(struct checkpoint_checksum) +
+                                    sizeof(struct checkpoint_footer);
+    if (checkpoint_validation_open(v) == -1) { return "unable to open the file"; }
+    if (v->size < sizeof(struct checkpoint_footer)) { return "no footer"; }
+    /* read the aligned block(s) that contain the footer and the checksum */
+    size_t first = v->size < max_trailer_size ? 0 : v->size - max_trailer_size;
+    first -= first % alignment;
+    const size_t tail_size = (v->size - first + alignment - 1)/alignment*alignment;
+    if (checkpoint_validation_read(v, buf, tail_size, first) != v->size - first) {
+        return "unable to read the footer";
+    }
+    memcpy(footer, buf + v->size - first - sizeof(struct checkpoint_footer),
+           sizeof(struct checkpoint_footer));
+    if (checkpoint_check_footer(footer, v->size) == -1) { return "corrupted footer"; }
+    struct checkpoint_checksum expected = {0, 0};
+    if (footer->version >= 2) {
+        memcpy(&expected, buf + v->size - first - max_trailer_size, sizeof(expected));
+    }
+    /* read the data and the table of contents */
+    const size_t toc_size = footer->num_records*sizeof(struct checkpoint_record);
+    const size_t end = footer->records_offset + toc_size;
+    char* toc = malloc(toc_size + 1);
+    if (!toc) {
         fprintf(stderr, "not enough memory\n");
         exit(EXIT_FAILURE);
     }
-    memset(checkpoint, 0, sizeof(struct mpi_checkpoint));
-    return checkpoint;
+    struct checkpoint_checksum checksum = {0, 0};
+    const char* problem = 0;
+    for (size_t offset=0; offset<end && !problem; offset+=CHECKPOINT_VALIDATION_CHUNK) {
+        size_t size = end - offset;
+        if (size > CHECKPOINT_VALIDATION_CHUNK) { size = CHECKPOINT_VALIDATION_CHUNK; }
+        ssize_t nread = checkpoint_validation_read(v, buf, CHECKPOINT_VALIDATION_CHUNK, offset);
+        if (nread == -1 || (size_t)nread < size) {
+            problem = "unable to read the data";
+            break;
+        }
+        if (footer->version >= 2) { checkpoint_checksum_update(&checksum, buf, size); }
+        /* the part of the table of contents in this chunk */
+        if (offset + size > footer->records_offset) {
+            const size_t toc_first = offset > footer->records_offset ? offset :
+                                     footer->records_offset;
+            memcpy(toc + toc_first - footer->records_offset, buf + toc_first - offset,
+                   offset + size - toc_first);
+        }
+    }
+    if (!problem && checkpoint_check_records(footer, (struct checkpoint_record*)toc) == -1) {
+        problem = "corrupted table of contents";
+    }
+    if (!problem && footer->version >= 2 &&
+        (checksum.sum != expected.sum || checksum.weighted_sum != expected.weighted_sum)) {
+        problem = "checksum mismatch";
+    }
+    free(toc);
+    return problem;
 }
 
-static void checkpoint_free(struct mpi_checkpoint* checkpoint) {
-    if (checkpoint->data) {
-        if (checkpoint->flags & CHECKPOINT_WRITE_ONLY) {
-            if (msync(checkpoint->data, checkpoint->size, MS_SYNC) == -1) {
-                perror("msync");
-                exit(EXIT_FAILURE);
-            }
+/* Write the status under a temporary name and rename it. */
+static void checkpoint_validation_mark(const struct checkpoint_validation* v,
+                                       const char* status) {
+    char path[4096+16], tmp[4096+32];
+    checkpoint_status_path(path, sizeof(path), v->paths[0]);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* file = fopen(tmp, "w");
+    int ret = file ? 0 : -1;
+    if (file) {
+        fprintf(file, "%s\n", status);
+        if (fclose(file) == EOF) { ret = -1; }
+    }
+    if (ret == 0) { ret = rename(tmp, path); }
+    /* the solver continues, the file without the status is not validated */
+    if (ret == -1) {
+        fprintf(stderr, "Unable to write checkpoint status \"%s\": %s\n",
+                path, strerror(errno));
+        fflush(stderr);
+    }
+}
+
+static void checkpoint_validate(struct checkpoint_validation* v, char* buf) {
+    checkpoint_trace_begin("checkpoint_validate");
+    /* the files are read from the storage after they are written */
+    checkpoint_drain_wait();
+    struct checkpoint_footer footer;
+    const char* problem = checkpoint_validate_file(v, buf, &footer);
+    checkpoint_validation_close(v);
+    char status[256];
+    if (problem) {
+        snprintf(status, sizeof(status), "bad %s", problem);
+    } else {
+        snprintf(status, sizeof(status), "validated %u", footer.nprocs);
+    }
+    checkpoint_validation_mark(v, status);
+    if (verbose || problem) {
+        fprintf(stderr, "rank %d checkpoint %s is %s\n", v->rank, v->paths[0], status);
+        fflush(stderr);
+    }
+    checkpoint_trace_end("checkpoint_validate");
+}
+
+static void* checkpoint_validation_main(void* arg) {
+    /* use the time when the CPU and the storage are idle */
+    const int thread_id = syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, thread_id, 19);
+    syscall(SYS_ioprio_set, CHECKPOINT_IOPRIO_WHO_PROCESS, thread_id,
+            CHECKPOINT_IOPRIO_CLASS_IDLE << CHECKPOINT_IOPRIO_CLASS_SHIFT);
+    void* buf = 0;
+    if (posix_memalign(&buf, CHECKPOINT_VALIDATION_ALIGNMENT, CHECKPOINT_VALIDATION_CHUNK) != 0) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&validation_mutex);
+    for (;;) {
+        while (!first_validation && !validation_stop) {
+            pthread_cond_wait(&validation_cond, &validation_mutex);
+        }
+        struct checkpoint_validation* v = first_validation;
+        if (!v) { break; }
+        first_validation = v->next;
+        if (!first_validation) { last_validation = 0; }
+        pthread_mutex_unlock(&validation_mutex);
+        checkpoint_validate(v, buf);
+        free(v);
+        pthread_mutex_lock(&validation_mutex);
+        --num_validations;
+        pthread_cond_broadcast(&validation_cond);
+    }
+    pthread_mutex_unlock(&validation_mutex);
+    free(buf);
+    return 0;
+}
+
+/* Pass the file of the closed checkpoint to the validation thread. */
+static void checkpoint_validation_put(const struct mpi_checkpoint* checkpoint) {
+    struct checkpoint_validation* v = malloc(sizeof(struct checkpoint_validation));
+    if (!v) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    const struct checkpoint_stripes* stripes = checkpoint->stripes;
+    if (stripes) {
+        for (int i=0; i<stripes->count; ++i) {
+            checkpoint_path(v->paths[i], sizeof(v->paths[i]), stripes->directories[i],
+                            checkpoint->rank);
+        }
+        v->count = stripes->count;
+        v->stripe_size = stripes->size;
+    } else {
+        checkpoint_path(v->paths[0], sizeof(v->paths[0]), checkpoint->directory,
+                        checkpoint->rank);
+        v->count = 1;
+        v->stripe_size = 0;
+    }
+    v->rank = checkpoint->rank;
+    v->next = 0;
+    pthread_mutex_lock(&validation_mutex);
+    if (!validation_thread_started) {
+        validation_stop = 0;
+        if (pthread_create(&validation_thread, 0, checkpoint_validation_main, 0) != 0) {
+            fprintf(stderr, "Unable to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+        validation_thread_started = 1;
+    }
+    if (last_validation) { last_validation->next = v; } else { first_validation = v; }
+    last_validation = v;
+    ++num_validations;
+    pthread_cond_broadcast(&validation_cond);
+    pthread_mutex_unlock(&validation_mutex);
+}
+
+/* Wait until all queued files are validated. */
+static void checkpoint_validation_wait() {
+    pthread_mutex_lock(&validation_mutex);
+    while (num_validations != 0) { pthread_cond_wait(&validation_cond, &validation_mutex); }
+    pthread_mutex_unlock(&validation_mutex);
+}
+
+/* Wait until all files are validated and stop the validation thread. */
+static void checkpoint_validation_finish() {
+    pthread_mutex_lock(&validation_mutex);
+    const int started = validation_thread_started;
+    validation_stop = 1;
+    validation_thread_started = 0;
+    pthread_cond_broadcast(&validation_cond);
+    pthread_mutex_unlock(&validation_mutex);
+    if (started) { pthread_join(validation_thread, 0); }
+}
+
+static void* checkpoint_sync_stripe(void* fd) {
+    if (fdatasync(*(int*)fd) == -1) {
+        perror("fdatasync");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/* Flush the stripes to all devices in parallel, truncate and close the files. */
+static void checkpoint_release_striped(struct mpi_checkpoint* checkpoint) {
+    const struct checkpoint_stripes* stripes = checkpoint->stripes;
+    checkpoint_trace_begin("checkpoint_sync");
+    double t0 = checkpoint_clock();
+    const int level = checkpoint_flush_level();
+    pthread_t threads[CHECKPOINT_MAX_STRIPES];
+    for (int i=1; i<stripes->count && level >= CHECKPOINT_DURABILITY_FSYNC; ++i) {
+        if (pthread_create(threads + i, 0, checkpoint_sync_stripe,
+                           checkpoint->stripe_fds + i) != 0) {
+            fprintf(stderr, "Unable to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (level >= CHECKPOINT_DURABILITY_FSYNC) {
+        checkpoint_sync_stripe(checkpoint->stripe_fds);
+        for (int i=1; i<stripes->count; ++i) { pthread_join(threads[i], 0); }
+    } else if (level == CHECKPOINT_DURABILITY_PAGECACHE) {
+        for (int i=0; i<stripes->count; ++i) {
+            checkpoint_start_writeback(checkpoint->stripe_fds[i]);
+        }
+    }
+    double t1 = checkpoint_clock();
+    checkpoint->counters[CHECKPOINT_SYNC] += t1 - t0;
+    checkpoint_trace_end("checkpoint_sync");
+    checkpoint_trace_begin("checkpoint_release");
+    if (munmap(checkpoint->data, checkpoint->reserved_size) == -1) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+    for (int i=0; i<stripes->count; ++i) {
+        const int fd = checkpoint->stripe_fds[i];
+        if (ftruncate(fd, checkpoint_stripe_file_size(stripes, i, checkpoint->offset)) == -1) {
+            perror("ftruncate");
+            exit(EXIT_FAILURE);
+        }
+        if (close(fd) == -1) {
+            perror("close");
+            exit(EXIT_FAILURE);
+        }
+    }
+    checkpoint->data = 0;
+    checkpoint->size = 0;
+    checkpoint->reserved_size = 0;
+    checkpoint->offset = 0;
+    checkpoint->fd = -1;
+    checkpoint->counters[CHECKPOINT_CLOSE] += checkpoint_clock() - t1;
+    checkpoint_trace_end("checkpoint_release");
+}
+
+/* Flush the data to the file and close the file. */
+static void checkpoint_release(struct mpi_checkpoint* checkpoint) {
+    if (checkpoint->data == 0 && checkpoint->fd == -1) { return; }
+    if (checkpoint->data && (checkpoint->flags & CHECKPOINT_WRITE_ONLY)) {
+        checkpoint_write_toc(checkpoint);
+        if (shm_tier) { checkpoint_shm_save(checkpoint); }
+    }
+    if (checkpoint->stripes && checkpoint->data && (checkpoint->flags & CHECKPOINT_WRITE_ONLY)) {
+        checkpoint_release_striped(checkpoint);
+        return;
+    }
+    if (checkpoint->data && (checkpoint->flags & CHECKPOINT_WRITE_ONLY)) {
+        if (checkpoint->drain_fd != -1) {
+            checkpoint_drain_put(checkpoint);
+            return;
         }
+    }
+    checkpoint_trace_begin("checkpoint_sync");
+    double t0 = checkpoint_clock();
+    if (checkpoint->data && (checkpoint->flags & CHECKPOINT_WRITE_ONLY)) {
+        const int level = checkpoint_flush_level();
+        if (level >= CHECKPOINT_DURABILITY_FSYNC &&
+            msync(checkpoint->data, checkpoint->size, MS_SYNC) == -1) {
+            perror("msync");
+            exit(EXIT_FAILURE);
+        }
+        if (level == CHECKPOINT_DURABILITY_PAGECACHE) {
+            checkpoint_start_writeback(checkpoint->fd);
+        }
+    }
+    double t1 = checkpoint_clock();
+    checkpoint->counters[CHECKPOINT_SYNC] += t1 - t0;
+    checkpoint_trace_end("checkpoint_sync");
+    checkpoint_trace_begin("checkpoint_release");
+    if (checkpoint->reuse_file && checkpoint->data) {
+        checkpoint_slot_put(checkpoint);
+        checkpoint->data = 0;
+        checkpoint->size = 0;
+        checkpoint->fd = -1;
+        checkpoint->offset = 0;
+    }
+    if (checkpoint->files) {
+        for (int i=0; i<checkpoint->nprocs; ++i) {
+            checkpoint_file_unmap(checkpoint->files + i);
+        }
+    }
+    if (checkpoint->lazy_source) { checkpoint_lazy_release(checkpoint); }
+    if (checkpoint->data) {
         if (munmap(checkpoint->data, checkpoint->size) == -1) {
             perror("munmap");
             exit(EXIT_FAILURE);
@@ -90,16 +3372,76 @@ static void checkpoint_free(struct mpi_checkpoint* checkpoint) {
         }
         checkpoint->fd = -1;
     }
-    free(checkpoint);
+    checkpoint->counters[CHECKPOINT_CLOSE] += checkpoint_clock() - t1;
+    checkpoint_trace_end("checkpoint_release");
+}
+
+static void checkpoint_staged_free(char** staged, size_t num_staged) {
+    if (!staged) { return; }
+    for (size_t i=0; i<num_staged; ++i) { free(staged[i]); }
+    free(staged);
+}
+
+/* Put the handle to the pool. */
+static void checkpoint_free(struct mpi_checkpoint* checkpoint) {
+    checkpoint_release(checkpoint);
+    free(checkpoint->stripes);
+    checkpoint->stripes = 0;
+    free(checkpoint->files);
+    free(checkpoint->all_records);
+    checkpoint_staged_free(checkpoint->staged, checkpoint->num_staged);
+    checkpoint->staged = 0;
+    checkpoint->num_staged = 0;
+    checkpoint->files = 0;
+    checkpoint->all_records = 0;
+    pthread_rwlock_destroy(&checkpoint->mapping_lock);
+    checkpoint->next_free = free_checkpoints;
+    free_checkpoints = checkpoint;
+}
+
+static void checkpoint_pool_free() {
+    while (free_checkpoints) {
+        struct mpi_checkpoint* checkpoint = free_checkpoints;
+        free_checkpoints = checkpoint->next_free;
+        pthread_rwlock_destroy(&checkpoint->mapping_lock);
+        free(checkpoint->records);
+        free(checkpoint);
+    }
 }
 
 static int add_fortran_checkpoint(MPI_Checkpoint c_checkpoint, MPI_Fint* error) {
-    if (checkpoints_count == sizeof(checkpoints)/sizeof(MPI_Checkpoint)) {
-        *error = MPI_ERR_OTHER;
-        return -1;
+    pthread_mutex_lock(&checkpoints_mutex);
+    if (first_free_checkpoint == -1) {
+        int n = checkpoints_count == 0 ? 64 : 2*checkpoints_count;
+        struct fortran_checkpoint* new_checkpoints =
+            realloc(checkpoints, n*sizeof(struct fortran_checkpoint));
+        if (!new_checkpoints) {
+            pthread_mutex_unlock(&checkpoints_mutex);
+            *error = MPI_ERR_NO_MEM;
+            return -1;
+        }
+        checkpoints = new_checkpoints;
+        for (int i=n-1; i>=checkpoints_count; --i) {
+            checkpoints[i].checkpoint = MPI_CHECKPOINT_NULL;
+            checkpoints[i].next_free = first_free_checkpoint;
+            first_free_checkpoint = i;
+        }
+        checkpoints_count = n;
     }
-    checkpoints[checkpoints_count] = c_checkpoint;
-    return checkpoints_count++;
+    int i = first_free_checkpoint;
+    first_free_checkpoint = checkpoints[i].next_free;
+    checkpoints[i].checkpoint = c_checkpoint;
+    c_checkpoint->f_handle = i;
+    pthread_mutex_unlock(&checkpoints_mutex);
+    return i;
+}
+
+static void remove_fortran_checkpoint(MPI_Fint f_checkpoint) {
+    pthread_mutex_lock(&checkpoints_mutex);
+    checkpoints[f_checkpoint].checkpoint = MPI_CHECKPOINT_NULL;
+    checkpoints[f_checkpoint].next_free = first_free_checkpoint;
+    first_free_checkpoint = f_checkpoint;
+    pthread_mutex_unlock(&checkpoints_mutex);
 }
 
 static void read_configuration_file(const char* filename) {
@@ -145,6 +3487,96 @@ static void read_configuration_file(const char* filename) {
                 fprintf(stderr, "bad checkpoint interval: %d\n", checkpoint_min_interval);
                 exit(EXIT_FAILURE);
             }
+        } else if (strcmp(first1, "trace-file") == 0) {
+            strncpy(trace_filename, first2, sizeof(trace_filename)-1);
+        } else if (strcmp(first1, "trace-buffer-size") == 0) {
+            long n = atol(first2);
+            if (n <= 0) {
+                fprintf(stderr, "bad trace buffer size: %ld\n", n);
+                exit(EXIT_FAILURE);
+            }
+            trace_buffer_size = n;
+        } else if (strcmp(first1, "statistics-file") == 0) {
+            strncpy(statistics_filename, first2, sizeof(statistics_filename)-1);
+        } else if (strcmp(first1, "checkpoint-slots") == 0) {
+            checkpoint_slots = atoi(first2);
+            if (checkpoint_slots < 0 || checkpoint_slots == 1 ||
+                checkpoint_slots > CHECKPOINT_MAX_SLOTS) {
+                fprintf(stderr, "bad number of checkpoint slots: %d\n", checkpoint_slots);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(first1, "checkpoint-stripe-dirs") == 0) {
+            num_stripe_directories = 0;
+            for (char* d = strtok(first2, " \t,"); d; d = strtok(0, " \t,")) {
+                if (num_stripe_directories == CHECKPOINT_MAX_STRIPES) {
+                    fprintf(stderr, "too many stripe directories (max. %d)\n",
+                            CHECKPOINT_MAX_STRIPES);
+                    exit(EXIT_FAILURE);
+                }
+                strncpy(stripe_directories[num_stripe_directories++], d, 4095);
+            }
+        } else if (strcmp(first1, "checkpoint-stripe-size") == 0) {
+            long long n = atoll(first2);
+            if (n <= 0) {
+                fprintf(stderr, "bad stripe size: %lld\n", n);
+                exit(EXIT_FAILURE);
+            }
+            stripe_size = n;
+        } else if (strcmp(first1, "compression-autotune") == 0) {
+            compression_autotune = atoi(first2);
+        } else if (strcmp(first1, "storage-bandwidth") == 0) {
+            storage_bandwidth = atof(first2)*1e6;
+            if (storage_bandwidth < 0) {
+                fprintf(stderr, "bad storage bandwidth: %s\n", first2);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(first1, "background-drain") == 0) {
+            background_drain = atoi(first2);
+        } else if (strcmp(first1, "drain-rate") == 0) {
+            drain_max_rate = atof(first2)*1e6;
+            if (drain_max_rate < 0) {
+                fprintf(stderr, "bad drain rate: %s\n", first2);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(first1, "drain-share") == 0) {
+            char* suffix = 0;
+            drain_share = strtod(first2, &suffix);
+            if (strcmp(suffix, "%") == 0) { drain_share /= 100; }
+            else if (*suffix != 0 || drain_share < 0) {
+                fprintf(stderr, "bad drain share: %s\n", first2);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(first1, "background-validation") == 0) {
+            background_validation = atoi(first2);
+        } else if (strcmp(first1, "write-behind-window") == 0) {
+            write_behind_window = strtoull(first2, 0, 10)*1024UL*1024UL;
+        } else if (strcmp(first1, "durability") == 0) {
+            durability = -1;
+            for (int i=0; i<CHECKPOINT_NUM_DURABILITY_LEVELS; ++i) {
+                if (strcmp(first2, checkpoint_durability_names[i]) == 0) { durability = i; }
+            }
+            if (durability == -1) {
+                fprintf(stderr, "bad durability: %s\n", first2);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(first1, "shm-tier") == 0) {
+            shm_tier = atoi(first2);
+        } else if (strcmp(first1, "shm-tier-keep") == 0) {
+            shm_tier_keep = atoi(first2);
+        } else if (strcmp(first1, "lazy-restore") == 0) {
+            lazy_restore = atoi(first2);
+        } else if (strcmp(first1, "restore-prefetch") == 0) {
+            restore_prefetch = atoi(first2);
+        } else if (strcmp(first1, "arena-address") == 0) {
+            arena_address = strtoull(first2, 0, 0);
+            if (arena_address % huge_page_size != 0) {
+                fprintf(stderr, "bad arena address: %s\n", first2);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(first1, "arena-size") == 0) {
+            arena_size = strtoull(first2, 0, 10)*1024UL*1024UL*1024UL;
+        } else if (strcmp(first1, "huge-pages") == 0) {
+            huge_pages = atoi(first2);
         } else if (strcmp(first1, "verbose") == 0) {
             verbose = atoi(first2);
         } else if (strcmp(first1, "compression-level") == 0) {
@@ -154,6 +3586,17 @@ static void read_configuration_file(const char* filename) {
                 fprintf(stderr, "bad compression level: %d\n", compression_level);
                 exit(EXIT_FAILURE);
             }
+        } else if (strcmp(first1, "compression-codec") == 0) {
+            compression_codec = -1;
+            for (size_t i=0; i<sizeof(checkpoint_codecs)/sizeof(checkpoint_codecs[0]); ++i) {
+                if (strcmp(first2, checkpoint_codecs[i].name) == 0) {
+                    compression_codec = checkpoint_codecs[i].id;
+                }
+            }
+            if (compression_codec == -1) {
+                fprintf(stderr, "bad compression codec: %s\n", first2);
+                exit(EXIT_FAILURE);
+            }
         } else {
         }
     }
@@ -163,22 +3606,319 @@ static void read_configuration_file(const char* filename) {
 
 /* The path must end with "/". */
 static int mkdir_p(char* path, mode_t mode) {
-    char* first = path, last = 0;
-    while (*path) {
-        if (*path == '/') {
-            *path = 0;
-            if (mkdir(first, mode) == -1 && errno != EEXIST) {
-                *path = '/';
-                return -1;
-            }
-            *path = '/';
-            first = path+1;
+    for (char* last = path+1; *last; ++last) {
+        if (*last == '/') {
+            *last = 0;
+            int ret = mkdir(path, mode);
+            *last = '/';
+            if (ret == -1 && errno != EEXIST) { return -1; }
+        }
+    }
+    return 0;
+}
+
+/*
+Create the checkpoint directory and the subdirectories for all ranks.
+The directory must end with "/". Returns zero on success and errno on error.
+*/
+static int checkpoint_make_directories(char* directory, int nranks) {
+    if (mkdir_p(directory, 0755) == -1) { return errno; }
+    char path[4096];
+    const int nsubdirs = (nranks + CHECKPOINT_RANKS_PER_DIRECTORY - 1) /
+                         CHECKPOINT_RANKS_PER_DIRECTORY;
+    for (int i=0; i<nsubdirs; ++i) {
+        if (snprintf(path, sizeof(path), "%s%02x", directory, i) < 0) { return errno; }
+        if (mkdir(path, 0755) == -1 && errno != EEXIST) { return errno; }
+    }
+    return 0;
+}
+
+/*
+Create the subdirectory of the rank that was not created by rank 0, i.e. the directory
+is on the local storage of another node. Returns -1 on error.
+*/
+static int checkpoint_make_subdirectory(const char* directory, int rank) {
+    char path[4096+16];
+    checkpoint_subdirectory(path, sizeof(path)-1, directory, rank);
+    strcat(path, "/");
+    return mkdir_p(path, 0755);
+}
+
+/*
+The stripes of the checkpoint "directory" (without the trailing "/") in the
+directories from checkpoint-stripe-dirs. The stripe size is a multiple of the mapping step.
+*/
+static struct checkpoint_stripes* checkpoint_stripes_new(const char* directory) {
+    struct checkpoint_stripes* stripes = malloc(sizeof(struct checkpoint_stripes));
+    if (!stripes) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    const char* basename = strrchr(directory, '/');
+    basename = basename ? basename+1 : directory;
+    stripes->size = (stripe_size + mapping_step - 1)/mapping_step*mapping_step;
+    stripes->count = num_stripe_directories;
+    for (int i=0; i<stripes->count; ++i) {
+        if (snprintf(stripes->directories[i], sizeof(stripes->directories[i]), "%s/%s",
+                     stripe_directories[i], basename) < 0) {
+            perror("snprintf");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return stripes;
+}
+
+/*
+Create the directories of the stripes and write their description to the
+checkpoint directory. Returns zero on success and errno on error.
+*/
+static int checkpoint_stripes_save(const struct checkpoint_stripes* stripes,
+                                   const char* directory, int nranks) {
+    char path[4096];
+    for (int i=0; i<stripes->count; ++i) {
+        snprintf(path, sizeof(path), "%s/", stripes->directories[i]);
+        int ret = checkpoint_make_directories(path, nranks);
+        if (ret != 0) { return ret; }
+    }
+    snprintf(path, sizeof(path), "%s/stripes", directory);
+    FILE* file = fopen(path, "w");
+    if (!file) { return errno; }
+    fprintf(file, "stripe-size = %zu\n", stripes->size);
+    for (int i=0; i<stripes->count; ++i) {
+        fprintf(file, "stripe-dir = %s\n", stripes->directories[i]);
+    }
+    if (fclose(file) == EOF) { return errno; }
+    return 0;
+}
+
+/*
+Read the description of the stripes from the checkpoint directory.
+The number of stripes is zero if the checkpoint is not striped.
+*/
+static void checkpoint_stripes_load(const char* directory, struct checkpoint_stripes* stripes) {
+    char path[4096];
+    memset(stripes, 0, sizeof(struct checkpoint_stripes));
+    snprintf(path, sizeof(path), "%s/stripes", directory);
+    FILE* file = fopen(path, "r");
+    if (!file) { return; }
+    char line[4096+64];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "stripe-size = ", 14) == 0) {
+            stripes->size = strtoull(line+14, 0, 10);
+        } else if (strncmp(line, "stripe-dir = ", 13) == 0 &&
+                   stripes->count != CHECKPOINT_MAX_STRIPES) {
+            char* directory = stripes->directories[stripes->count++];
+            snprintf(directory, sizeof(stripes->directories[0]), "%.4095s", line+13);
+        }
+    }
+    fclose(file);
+    if (stripes->size == 0) { stripes->count = 0; }
+}
+
+/* Prefetch
+
+When the program is started with MPI_CHECKPOINT, MPI_Checkpoint_init starts the prefetch
+thread that maps the file of the rank (the rank in MPI_COMM_WORLD) and reads it into
+the page cache while the program initializes itself. With restore-prefetch = 2 the thread
+also decompresses the compressed records into the staging buffers. MPI_Checkpoint_restore
+waits for the thread and takes the mapped file if the rank reads the same file. */
+
+struct checkpoint_prefetch {
+    pthread_t thread;
+    int started;
+    /* the checkpoint directory and the index of the file */
+    char directory[4096];
+    int index;
+    char path[4096];
+    /* -1 if the file can not be opened */
+    int ret;
+    struct checkpoint_file file;
+    /* the decompressed payloads of the records or 0 */
+    char** staged;
+    size_t num_staged;
+    double time;
+};
+
+static struct checkpoint_prefetch prefetch;
+
+/* Decompress the compressed records of the prefetched file to the staging buffers. */
+static void checkpoint_prefetch_decompress(struct checkpoint_prefetch* p) {
+    struct checkpoint_footer footer;
+    struct checkpoint_record* records = 0;
+    if (checkpoint_file_read_toc(&p->file, &footer, &records) == -1) { return; }
+    p->staged = calloc(footer.num_records, sizeof(char*));
+    if (p->staged) { p->num_staged = footer.num_records; }
+    for (size_t i=0; i<p->num_staged; ++i) {
+        const struct checkpoint_record* r = records + i;
+        uint64_t stored = 0;
+        if (r->codec == CHECKPOINT_CODEC_NONE ||
+            r->offset + sizeof(uint64_t) > p->file.data_size) {
+            continue;
+        }
+        const char* data = ((const char*)p->file.data) + r->offset;
+        memcpy(&stored, data, sizeof(uint64_t));
+        if (stored > p->file.data_size - r->offset - sizeof(uint64_t)) { continue; }
+        char* buf = malloc(r->size);
+        if (!buf) { break; }
+        /* the payload is decompressed as the packed elements */
+        if (checkpoint_decompress_elements(data + sizeof(uint64_t), stored, buf, r->size,
+                                           MPI_BYTE, 1, 1, 1, r->element_size,
+                                           r->codec) == -1) {
+            free(buf);
+            continue;
         }
-        ++path;
+        p->staged[i] = buf;
+    }
+    free(records);
+}
+
+static void* checkpoint_prefetch_main(void* arg) {
+    struct checkpoint_prefetch* p = arg;
+    double t0 = checkpoint_clock();
+    struct checkpoint_stripes* stripes = malloc(sizeof(struct checkpoint_stripes));
+    if (!stripes) { return 0; }
+    checkpoint_stripes_load(p->directory, stripes);
+    p->ret = shm_tier ? checkpoint_shm_map(p->directory, p->index, p->path, sizeof(p->path),
+                                           &p->file) : -1;
+    if (p->ret == -1) {
+        p->ret = checkpoint_file_map_rank(p->path, sizeof(p->path), p->directory,
+                                          stripes->count != 0 ? stripes : 0, p->index,
+                                          &p->file);
+    }
+    free(stripes);
+    if (p->ret == -1 || !p->file.data) { return 0; }
+    posix_fadvise(p->file.fd, 0, 0, POSIX_FADV_WILLNEED);
+    /* fault in all pages of the file */
+    volatile char sum = 0;
+    for (size_t offset=0; offset<p->file.size; offset+=page_size) {
+        sum += ((const char*)p->file.data)[offset];
+    }
+    if (restore_prefetch > 1) { checkpoint_prefetch_decompress(p); }
+    p->time = checkpoint_clock() - t0;
+    return 0;
+}
+
+/* Start the prefetch of the file of the rank. */
+static void checkpoint_prefetch_start(const char* directory, int index) {
+    memset(&prefetch, 0, sizeof(prefetch));
+    snprintf(prefetch.directory, sizeof(prefetch.directory), "%s", directory);
+    prefetch.index = index;
+    prefetch.ret = -1;
+    prefetch.file.fd = -1;
+    if (pthread_create(&prefetch.thread, 0, checkpoint_prefetch_main, &prefetch) != 0) {
+        fprintf(stderr, "Unable to create thread\n");
+        exit(EXIT_FAILURE);
+    }
+    prefetch.started = 1;
+}
+
+/* Wait for the prefetch thread. */
+static void checkpoint_prefetch_wait() {
+    if (!prefetch.started) { return; }
+    pthread_join(prefetch.thread, 0);
+    prefetch.started = 0;
+}
+
+/* Wait for the prefetch thread and release the file that was not taken. */
+static void checkpoint_prefetch_finish() {
+    checkpoint_prefetch_wait();
+    if (prefetch.ret == 0) { checkpoint_file_unmap(&prefetch.file); }
+    checkpoint_staged_free(prefetch.staged, prefetch.num_staged);
+    prefetch.staged = 0;
+    prefetch.num_staged = 0;
+    prefetch.ret = -1;
+}
+
+/*
+Take the prefetched file if it is the file "index" of the checkpoint "directory".
+Returns -1 if the file was not prefetched.
+*/
+static int checkpoint_prefetch_take(const char* directory, int index, char* path, size_t n,
+                                    struct checkpoint_file* file, char*** staged,
+                                    size_t* num_staged) {
+    checkpoint_prefetch_wait();
+    if (prefetch.ret == -1 || prefetch.index != index ||
+        strcmp(prefetch.directory, directory) != 0) {
+        checkpoint_prefetch_finish();
+        return -1;
+    }
+    if (verbose) {
+        fprintf(stderr, "rank %d prefetched %s in %f seconds\n", index, prefetch.path,
+                prefetch.time);
+        fflush(stderr);
     }
+    snprintf(path, n, "%s", prefetch.path);
+    *file = prefetch.file;
+    *staged = prefetch.staged;
+    *num_staged = prefetch.num_staged;
+    prefetch.ret = -1;
+    prefetch.staged = 0;
+    prefetch.num_staged = 0;
     return 0;
 }
 
+/*
+Decide on rank 0 whether the next call to MPI_Checkpoint_create should
+create a checkpoint. The time of the next call is predicted from the time
+between the last two calls.
+*/
+static void checkpoint_decide(long long* message) {
+    time_t now = time(0);
+    time_t period = (last_create_timestamp == 0) ? 0 : now-last_create_timestamp;
+    last_create_timestamp = now;
+    time_t next = now + period;
+    message[0] = (next-last_checkpoint_timestamp >= checkpoint_min_interval);
+    message[1] = next;
+}
+
+static void checkpoint_decision_free() {
+    if (decision.request != MPI_REQUEST_NULL) {
+        MPI_Wait(&decision.request, MPI_STATUS_IGNORE);
+    }
+    decision.communicator = MPI_COMM_NULL;
+}
+
+/*
+Returns non-zero if all ranks agreed to create the checkpoint.
+The first call for the communicator uses blocking broadcast,
+all subsequent calls complete the broadcast started in the previous call.
+*/
+static int checkpoint_agree(MPI_Comm comm, time_t* timestamp) {
+    int rank = 0;
+    MPI_Comm_rank(comm, &rank);
+    if (decision.communicator == comm && decision.request != MPI_REQUEST_NULL) {
+        MPI_Wait(&decision.request, MPI_STATUS_IGNORE);
+    } else {
+        checkpoint_decision_free();
+        if (rank == 0) {
+            last_create_timestamp = 0;
+            checkpoint_decide(decision.message);
+        }
+        MPI_Bcast(decision.message, 2, MPI_LONG_LONG_INT, 0, comm);
+        decision.communicator = comm;
+    }
+    int create = decision.message[0] != 0;
+    *timestamp = decision.message[1];
+    if (create) { last_checkpoint_timestamp = *timestamp; }
+    if (rank == 0) { checkpoint_decide(decision.message); }
+    MPI_Ibcast(decision.message, 2, MPI_LONG_LONG_INT, 0, comm, &decision.request);
+    return create;
+}
+
+/* Called by MPI_Finalize when MPI_COMM_SELF is freed. */
+static int checkpoint_finalize_callback(MPI_Comm comm, int keyval, void* value, void* extra) {
+    checkpoint_decision_free();
+    checkpoint_types_free();
+    checkpoint_drain_finish();
+    checkpoint_validation_finish();
+    checkpoint_lazy_finish();
+    checkpoint_prefetch_finish();
+    checkpoint_shm_cleanup();
+    checkpoint_trace_write();
+    return MPI_SUCCESS;
+}
+
 int MPI_Checkpoint_init() {
     strcpy(checkpoint_prefix, program_invocation_short_name);
     const char* config = getenv("MPI_CHECKPOINT_CONFIG");
@@ -190,30 +3930,122 @@ int MPI_Checkpoint_init() {
     memset(&compressor, 0, sizeof(compressor));
     memset(&decompressor, 0, sizeof(decompressor));
     int ret = mz_deflateInit(&compressor, compression_level);
+    compressor_level = compression_level;
     ret |= mz_inflateInit(&decompressor);
     initialized = 1;
     page_size = sysconf(_SC_PAGE_SIZE);
     if (page_size <= 0) { page_size = 4096UL; }
+    mapping_step = huge_pages ? huge_page_size : page_size;
+    /* complete pending broadcasts even if the program calls
+       MPI_Checkpoint_finalize after MPI_Finalize */
+    int mpi_initialized = 0;
+    MPI_Initialized(&mpi_initialized);
+    if (mpi_initialized && finalize_keyval == MPI_KEYVAL_INVALID) {
+        MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, checkpoint_finalize_callback,
+                               &finalize_keyval, 0);
+        MPI_Comm_set_attr(MPI_COMM_SELF, finalize_keyval, 0);
+    }
+    checkpoint_trace_init(mpi_initialized);
+    const char* filename = checkpoint_filename;
+    if (mpi_initialized && restore_prefetch && !no_checkpoint && filename &&
+        strcmp(filename, "") != 0 && strcmp(filename, "dmtcp") != 0 &&
+        strcmp(filename, "auto") != 0 && !prefetch.started) {
+        int rank = 0;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        checkpoint_prefetch_start(filename, rank);
+    }
     return ret == 0 ? MPI_SUCCESS : MPI_ERR_OTHER;
 }
 
+/* Registered regions
+
+MPI_Checkpoint_register adds the array to the list of regions that are written by
+MPI_Checkpoint_commit and read by MPI_Checkpoint_recover in the order of registration.
+The sizes of all regions are known before the checkpoint is created, so commit grows
+the file and the table of contents once, and the regions are copied without remapping. */
+
+#define CHECKPOINT_REGION_NAME_LENGTH 64
+
+struct checkpoint_region {
+    void* buf;
+    MPI_Count count;
+    MPI_Datatype datatype;
+    char name[CHECKPOINT_REGION_NAME_LENGTH];
+};
+
+static struct checkpoint_region* regions = 0;
+static size_t num_regions = 0;
+static size_t max_regions = 0;
+
+static void checkpoint_regions_free() {
+    free(regions);
+    regions = 0;
+    num_regions = 0;
+    max_regions = 0;
+}
+
 int MPI_Checkpoint_finalize() {
     int ret = mz_deflateEnd(&compressor);
     ret |= mz_inflateEnd(&decompressor);
+    checkpoint_drain_finish();
+    checkpoint_validation_finish();
+    checkpoint_lazy_finish();
+    checkpoint_prefetch_finish();
+    checkpoint_shm_cleanup();
+    checkpoint_compression_free();
+    checkpoint_slots_free();
+    checkpoint_remove_stale_directories();
+    checkpoint_pool_free();
+    checkpoint_regions_free();
+    int mpi_finalized = 1;
+    MPI_Finalized(&mpi_finalized);
+    if (!mpi_finalized) {
+        checkpoint_decision_free();
+        checkpoint_types_free();
+        if (statistics_op != MPI_OP_NULL) { MPI_Op_free(&statistics_op); }
+    } else {
+        checkpoint_trace_write();
+    }
     return ret == 0 ? MPI_SUCCESS : MPI_ERR_OTHER;
 }
 
+/* Open the stripes of the file of the rank and map the first stripe. */
+static void checkpoint_create_striped(struct mpi_checkpoint* checkpoint, int rank) {
+    char path[4096];
+    const struct checkpoint_stripes* stripes = checkpoint->stripes;
+    for (int i=0; i<stripes->count; ++i) {
+        checkpoint_path(path, sizeof(path), stripes->directories[i], rank);
+        checkpoint->stripe_fds[i] = open(path, O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC, 0644);
+        /* the directories on the local devices of other nodes are not created by rank 0 */
+        if (checkpoint->stripe_fds[i] == -1 && errno == ENOENT &&
+            checkpoint_make_subdirectory(stripes->directories[i], rank) == 0) {
+            checkpoint->stripe_fds[i] = open(path, O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC, 0644);
+        }
+        if (checkpoint->stripe_fds[i] == -1) {
+            fprintf(stderr, "Unable to open checkpoint \"%s\" for writing: %s\n",
+                    path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    checkpoint->fd = checkpoint->stripe_fds[0];
+    checkpoint->flags = CHECKPOINT_WRITE_ONLY;
+    checkpoint_grow(checkpoint, 1);
+    if (verbose) {
+        fprintf(stderr, "rank %d creating %s in %d stripes\n", rank, path, stripes->count);
+        fflush(stderr);
+    }
+}
+
 int MPI_Checkpoint_create(MPI_Comm comm, MPI_Checkpoint* file) {
     checkpoint_t0 = MPI_Wtime();
     if (!initialized) { MPI_Checkpoint_init(); }
     /* return if no checkpoint is requested */
     if (no_checkpoint) { return MPI_ERR_NO_CHECKPOINT; }
-    int current_timestamp = time(0);
     /* return if the last checkpoint is recent enough */
-    if (current_timestamp-last_checkpoint_timestamp < checkpoint_min_interval) {
-        return MPI_ERR_NO_CHECKPOINT;
-    }
-    last_checkpoint_timestamp = current_timestamp;
+    time_t now = 0;
+    if (!checkpoint_agree(comm, &now)) { return MPI_ERR_NO_CHECKPOINT; }
+    /* the program that creates checkpoints does not restore the prefetched file */
+    checkpoint_prefetch_finish();
     int rank = 0;
     MPI_Comm_rank(comm, &rank);
     /* create checkpoint using DMTCP */
@@ -236,52 +4068,323 @@ int MPI_Checkpoint_create(MPI_Comm comm, MPI_Checkpoint* file) {
         return MPI_ERR_NO_CHECKPOINT;
     }
     /* create checkpoint manually */
+    checkpoint_trace_begin("checkpoint_create");
+    double t0 = checkpoint_clock();
     char newfilename[4096];
-    /* synchronize time */
-    time_t now = time(0);
-    MPI_Bcast(&now, sizeof(now), MPI_BYTE, 0, comm);
     if (snprintf(newfilename, sizeof(newfilename), "%s.%lu.checkpoint/",
                  checkpoint_prefix, now) < 0) {
         perror("snprintf");
         exit(EXIT_FAILURE);
     }
-    if (mkdir_p(newfilename, 0755) == -1) {
-        perror("mkdir");
-        exit(EXIT_FAILURE);
+    /* rank 0 creates all directories while other ranks wait */
+    int nranks = 1, status = 0;
+    MPI_Comm_size(comm, &nranks);
+    struct checkpoint_stripes* stripes = 0;
+    if (num_stripe_directories != 0) {
+        newfilename[strlen(newfilename)-1] = 0;
+        stripes = checkpoint_stripes_new(newfilename);
+        strcat(newfilename, "/");
     }
-    if (snprintf(newfilename, sizeof(newfilename), "%s.%lu.checkpoint/%d",
-                 checkpoint_prefix, now, rank) < 0) {
-        perror("snprintf");
+    if (rank == 0) {
+        if (stripes) {
+            status = mkdir_p(newfilename, 0755) == -1 ? errno : 0;
+            if (status == 0) { status = checkpoint_stripes_save(stripes, newfilename, nranks); }
+        } else {
+            status = checkpoint_make_directories(newfilename, nranks);
+        }
+    }
+    MPI_Bcast(&status, 1, MPI_INT, 0, comm);
+    if (status != 0) {
+        fprintf(stderr, "Unable to create checkpoint directory \"%s\": %s\n",
+                newfilename, strerror(status));
         exit(EXIT_FAILURE);
     }
+    double t1 = checkpoint_clock();
     MPI_Checkpoint checkpoint = checkpoint_alloc();
-    checkpoint->fd = open(newfilename, O_CREAT|O_RDWR|O_CLOEXEC, 0644);
-    if (checkpoint->fd == -1) {
-        fprintf(stderr, "Unable to open checkpoint \"%s\" for writing: %s\n",
+    snprintf(checkpoint->directory, sizeof(checkpoint->directory), "%.*s",
+             (int)strlen(newfilename)-1, newfilename);
+    checkpoint->counters[CHECKPOINT_MKDIR] = t1 - t0;
+    checkpoint->counters[CHECKPOINT_TOTAL] = t0;
+    checkpoint_faults(checkpoint->counters);
+    checkpoint->timestamp = now;
+    checkpoint->stripes = stripes;
+    if (stripes) {
+        checkpoint_create_striped(checkpoint, rank);
+        checkpoint->counters[CHECKPOINT_OPEN] = checkpoint_clock() - t1;
+        checkpoint->communicator = comm;
+        checkpoint->nprocs = nranks;
+        checkpoint->rank = rank;
+        *file = checkpoint;
+        checkpoint_trace_end("checkpoint_create");
+        return MPI_SUCCESS;
+    }
+    /* open the file relative to the subdirectory to resolve the path only once */
+    checkpoint_subdirectory(newfilename, sizeof(newfilename), checkpoint->directory, rank);
+    int directory_fd = open(newfilename, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (directory_fd == -1 && errno == ENOENT &&
+        checkpoint_make_subdirectory(checkpoint->directory, rank) == 0) {
+        directory_fd = open(newfilename, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    }
+    if (directory_fd == -1) {
+        fprintf(stderr, "Unable to open checkpoint directory \"%s\": %s\n",
                 newfilename, strerror(errno));
         exit(EXIT_FAILURE);
     }
+    char basename[64];
+    snprintf(basename, sizeof(basename), "%d", rank);
     checkpoint->flags = CHECKPOINT_WRITE_ONLY;
-    checkpoint->size = checkpoint_initial_size;
-    if (ftruncate(checkpoint->fd, checkpoint->size) == -1) {
-        perror("ftruncate");
+    checkpoint->reuse_file = checkpoint_slots != 0;
+    struct checkpoint_slot slot;
+    checkpoint_slots_discard(checkpoint->directory);
+    /* the file is not overwritten while it is validated */
+    if (checkpoint_slots != 0) { checkpoint_validation_wait(); }
+    if (checkpoint_slot_take(comm, &slot)) {
+        /* move the file of the oldest checkpoint to the new directory */
+        checkpoint_path(newfilename, sizeof(newfilename), slot.directory, rank);
+        if (renameat(AT_FDCWD, newfilename, directory_fd, basename) == -1) {
+            fprintf(stderr, "Unable to reuse checkpoint \"%s\": %s\n",
+                    newfilename, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (background_validation) {
+            char status_path[4096+16];
+            checkpoint_status_path(status_path, sizeof(status_path), newfilename);
+            unlink(status_path);
+        }
+        checkpoint->fd = slot.fd;
+        checkpoint->data = slot.data;
+        checkpoint->size = slot.size;
+        /* the file is not valid until the new footer is written */
+        memset(((char*)checkpoint->data) + checkpoint->size - sizeof(struct checkpoint_footer),
+               0, sizeof(struct checkpoint_footer));
+        if (rank == 0) { checkpoint_add_stale_directory(&slot); }
+    } else {
+        checkpoint->fd = openat(directory_fd, basename, O_CREAT|O_RDWR|O_CLOEXEC, 0644);
+        /* the drained checkpoint is written to the memory file */
+        if (checkpoint->fd != -1 && background_drain && durability == -1 &&
+            !checkpoint->reuse_file) {
+            checkpoint->drain_fd = checkpoint->fd;
+            checkpoint->fd = memfd_create("mpi-checkpoint", MFD_CLOEXEC);
+            if (checkpoint->fd == -1) {
+                perror("memfd_create");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (close(directory_fd) == -1) {
+        perror("close");
         exit(EXIT_FAILURE);
     }
-    checkpoint->data = mmap(0, checkpoint->size, PROT_WRITE, MAP_SHARED, checkpoint->fd, 0);
-    if (checkpoint->data == MAP_FAILED) {
-        perror("mmap");
+    if (rank == 0) { checkpoint_remove_stale_directories(); }
+    checkpoint_path(newfilename, sizeof(newfilename), checkpoint->directory, rank);
+    if (checkpoint->fd == -1) {
+        fprintf(stderr, "Unable to open checkpoint \"%s\" for writing: %s\n",
+                newfilename, strerror(errno));
         exit(EXIT_FAILURE);
     }
+    if (checkpoint->data == 0) {
+        checkpoint->size = huge_pages ? huge_page_size : checkpoint_initial_size;
+        if (ftruncate(checkpoint->fd, checkpoint->size) == -1) {
+            perror("ftruncate");
+            exit(EXIT_FAILURE);
+        }
+        checkpoint->data = mmap(0, checkpoint->size, PROT_WRITE, MAP_SHARED,
+                                checkpoint->fd, 0);
+        if (checkpoint->data == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        checkpoint_advise_huge_pages(checkpoint->data, checkpoint->size);
+    }
+    /* the reused files and the files that are copied to shared memory stay in memory,
+       the drain thread limits the rate itself, and the checksum is computed from the
+       mapping when the checkpoint is closed */
+    if (!checkpoint->reuse_file && !background_drain && !shm_tier && !background_validation &&
+        checkpoint_flush_level() >= CHECKPOINT_DURABILITY_FSYNC) {
+        checkpoint->window = checkpoint_write_behind_window();
+    }
+    checkpoint->counters[CHECKPOINT_OPEN] = checkpoint_clock() - t1;
     checkpoint->communicator = comm;
+    checkpoint->nprocs = nranks;
+    checkpoint->rank = rank;
     *file = checkpoint;
     if (verbose) {
         fprintf(stderr, "rank %d creating %s\n", rank, newfilename);
         fflush(stderr);
     }
+    checkpoint_trace_end("checkpoint_create");
     return MPI_SUCCESS;
 }
 
-int MPI_Checkpoint_restore(MPI_Comm comm, MPI_Checkpoint* file) {
+/*
+Read the tables of contents of all files of the checkpoint. Each rank
+reads the files "rank", "rank+nranks", "rank+2*nranks" etc. and then
+the tables are exchanged between all ranks.
+*/
+static int checkpoint_gather_records(struct mpi_checkpoint* checkpoint) {
+    MPI_Comm comm = checkpoint->communicator;
+    int rank = 0, nranks = 1;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nranks);
+    const int nprocs = checkpoint->nprocs;
+    const size_t num_records = checkpoint->num_records;
+    const size_t toc_size = num_records*sizeof(struct checkpoint_record);
+    checkpoint->files = malloc(nprocs*sizeof(struct checkpoint_file));
+    checkpoint->all_records = malloc(nprocs*toc_size + 1);
+    int* counts = malloc(2*nranks*sizeof(int));
+    char* send_buffer = malloc(((nprocs+nranks-1)/nranks)*toc_size + 1);
+    char* recv_buffer = malloc(nprocs*toc_size + 1);
+    if (!checkpoint->files || !checkpoint->all_records || !counts ||
+        !send_buffer || !recv_buffer) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i=0; i<nprocs; ++i) {
+        struct checkpoint_file* f = checkpoint->files + i;
+        f->fd = -1, f->data = 0, f->size = 0, f->data_size = 0;
+    }
+    int* displs = counts + nranks;
+    int ret = MPI_SUCCESS;
+    size_t send_count = 0;
+    char filename[4096];
+    for (int i=rank; i<nprocs; i+=nranks) {
+        struct checkpoint_file* f = checkpoint->files + i;
+        struct checkpoint_footer footer;
+        struct checkpoint_record* records = 0;
+        if (checkpoint_file_map_rank(filename, sizeof(filename), checkpoint->directory,
+                                     checkpoint->stripes, i, f) == -1 ||
+            checkpoint_file_read_toc(f, &footer, &records) == -1 ||
+            footer.num_records != num_records) {
+            fprintf(stderr, "Bad checkpoint file \"%s\"\n", filename);
+            ret = MPI_ERR_OTHER;
+        } else {
+            memcpy(send_buffer + send_count, records, toc_size);
+        }
+        send_count += toc_size;
+        free(records);
+    }
+    for (int i=0; i<nranks; ++i) {
+        counts[i] = ((nprocs-i+nranks-1)/nranks)*toc_size;
+        if (i >= nprocs) { counts[i] = 0; }
+        displs[i] = (i == 0) ? 0 : displs[i-1] + counts[i-1];
+    }
+    MPI_Allgatherv(send_buffer, send_count, MPI_BYTE,
+                   recv_buffer, counts, displs, MPI_BYTE, comm);
+    for (int i=0; i<nranks && i<nprocs; ++i) {
+        int k = 0;
+        for (int j=i; j<nprocs; j+=nranks, ++k) {
+            memcpy(checkpoint->all_records + j*num_records,
+                   recv_buffer + displs[i] + k*toc_size, toc_size);
+        }
+    }
+    int ret_all = MPI_SUCCESS;
+    MPI_Allreduce(&ret, &ret_all, 1, MPI_INT, MPI_MAX, comm);
+    free(recv_buffer);
+    free(send_buffer);
+    free(counts);
+    return ret_all;
+}
+
+/*
+Returns the number of ranks that created the checkpoint if the files of all ranks
+are validated (background-validation), or -1 otherwise.
+*/
+static int checkpoint_validated(const char* directory) {
+    char path[4096+16], file_path[4096];
+    struct checkpoint_stripes* stripes = malloc(sizeof(struct checkpoint_stripes));
+    if (!stripes) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+    checkpoint_stripes_load(directory, stripes);
+    /* the status of the striped file is next to its first stripe */
+    const char* files_directory = stripes->count != 0 ? stripes->directories[0] : directory;
+    int nprocs = -1;
+    for (int rank=0; rank == 0 || rank < nprocs; ++rank) {
+        checkpoint_path(file_path, sizeof(file_path), files_directory, rank);
+        checkpoint_status_path(path, sizeof(path), file_path);
+        FILE* file = fopen(path, "r");
+        int n = -1;
+        if (file) {
+            if (fscanf(file, "validated %d", &n) != 1) { n = -1; }
+            fclose(file);
+        }
+        if (n <= 0 || (rank != 0 && n != nprocs)) {
+            nprocs = -1;
+            break;
+        }
+        nprocs = n;
+    }
+    free(stripes);
+    return nprocs;
+}
+
+static int checkpoint_compare_timestamps(const void* a, const void* b) {
+    const unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/*
+Find the directory of the newest checkpoint "<checkpoint-prefix>.<timestamp>.checkpoint"
+that can be restored (MPI_CHECKPOINT=auto). With background-validation the checkpoint
+is chosen if the files of all ranks are validated, otherwise if it has the metadata
+(durability), i.e. the bad and the incomplete checkpoints are skipped.
+Returns -1 if there is no such checkpoint.
+*/
+static int checkpoint_find_newest(char* directory, size_t n) {
+    char parent[4096];
+    snprintf(parent, sizeof(parent), "%s", checkpoint_prefix);
+    char* slash = strrchr(parent, '/');
+    const char* prefix = slash ? checkpoint_prefix + (slash - parent) + 1 : checkpoint_prefix;
+    if (!slash) { strcpy(parent, "."); }
+    else if (slash == parent) { slash[1] = 0; }
+    else { *slash = 0; }
+    DIR* dir = opendir(parent);
+    if (!dir) { return -1; }
+    const size_t prefix_length = strlen(prefix);
+    unsigned long* timestamps = 0;
+    size_t count = 0, max_count = 0;
+    struct dirent* entry = 0;
+    while ((entry = readdir(dir))) {
+        const char* name = entry->d_name;
+        if (strncmp(name, prefix, prefix_length) != 0 || name[prefix_length] != '.' ||
+            !isdigit(name[prefix_length+1])) {
+            continue;
+        }
+        char* suffix = 0;
+        const unsigned long timestamp = strtoul(name + prefix_length + 1, &suffix, 10);
+        if (strcmp(suffix, ".checkpoint") != 0) { continue; }
+        if (count == max_count) {
+            max_count = max_count == 0 ? 16 : 2*max_count;
+            unsigned long* tmp = realloc(timestamps, max_count*sizeof(unsigned long));
+            if (!tmp) {
+                fprintf(stderr, "not enough memory\n");
+                exit(EXIT_FAILURE);
+            }
+            timestamps = tmp;
+        }
+        timestamps[count++] = timestamp;
+    }
+    closedir(dir);
+    qsort(timestamps, count, sizeof(unsigned long), checkpoint_compare_timestamps);
+    int ret = -1;
+    char path[4096+16];
+    for (size_t i=0; i<count && ret == -1; ++i) {
+        snprintf(directory, n, "%.4000s.%lu.checkpoint", checkpoint_prefix, timestamps[i]);
+        snprintf(path, sizeof(path), "%s/metadata", directory);
+        if (background_validation ? checkpoint_validated(directory) > 0 :
+                                    access(path, F_OK) == 0) {
+            ret = 0;
+        } else if (verbose) {
+            fprintf(stderr, "skipping checkpoint %s\n", directory);
+            fflush(stderr);
+        }
+    }
+    free(timestamps);
+    return ret;
+}
+
+int MPI_Checkpoint_restore(MPI_Comm comm, MPI_Checkpoint* file_out) {
     checkpoint_t0 = MPI_Wtime();
     if (!initialized) { MPI_Checkpoint_init(); }
     /* return if no checkpoint is requested */
@@ -292,52 +4395,251 @@ int MPI_Checkpoint_restore(MPI_Comm comm, MPI_Checkpoint* file) {
     /* do nothing if DMTCP checkpoints are used */
     if (strcmp(filename, "dmtcp") == 0) { return MPI_ERR_NO_CHECKPOINT; }
     /* restore manually */
-    int rank = 0;
+    int rank = 0, nranks = 1;
     MPI_Comm_rank(comm, &rank);
-    char newfilename[4096];
-    if (snprintf(newfilename, sizeof(newfilename), "%s/%d", filename, rank) < 0) {
-        perror("snprintf");
-        exit(EXIT_FAILURE);
-    }
-    int checkpoint_fd = open(newfilename, O_RDONLY|O_CLOEXEC);
-    if (checkpoint_fd == -1) {
-        fprintf(stderr, "Unable to open checkpoint \"%s\" for reading: %s\n",
-                newfilename, strerror(errno));
-        exit(EXIT_FAILURE);
+    MPI_Comm_size(comm, &nranks);
+    /* rank 0 chooses the newest checkpoint and broadcasts its directory */
+    char newest[4096-64];
+    if (strcmp(filename, "auto") == 0) {
+        if (rank != 0 || checkpoint_find_newest(newest, sizeof(newest)) == -1) {
+            newest[0] = 0;
+        }
+        MPI_Bcast(newest, sizeof(newest), MPI_CHAR, 0, comm);
+        if (newest[0] == 0) { return MPI_ERR_NO_CHECKPOINT; }
+        filename = newest;
     }
+    checkpoint_trace_begin("checkpoint_restore");
+    double t0 = checkpoint_clock();
     MPI_Checkpoint checkpoint = checkpoint_alloc();
-    checkpoint->fd = checkpoint_fd;
     checkpoint->flags = CHECKPOINT_READ_ONLY;
-    struct stat status;
-    if (fstat(checkpoint->fd, &status) == -1) {
-        perror("fstat");
+    checkpoint->communicator = comm;
+    checkpoint->fd = -1;
+    checkpoint->counters[CHECKPOINT_TOTAL] = t0;
+    checkpoint_faults(checkpoint->counters);
+    strncpy(checkpoint->directory, filename, sizeof(checkpoint->directory)-1);
+    /* the table of contents is read from the file */
+    free(checkpoint->records);
+    checkpoint->records = 0;
+    checkpoint->max_records = 0;
+    /* rank 0 finds out the number of ranks that created the checkpoint */
+    char newfilename[4096];
+    struct checkpoint_file file = {-1, 0, 0, 0};
+    struct checkpoint_footer footer;
+    /* the number of ranks and the number of records */
+    long long info[2] = {nranks, 0};
+    /* rank 0 reads the description of the stripes */
+    struct checkpoint_stripes* stripes = malloc(sizeof(struct checkpoint_stripes));
+    if (!stripes) {
+        fprintf(stderr, "not enough memory\n");
         exit(EXIT_FAILURE);
     }
-    checkpoint->size = status.st_size;
-    if (checkpoint->size == 0) {
-        checkpoint->data = 0;
+    if (rank == 0) { checkpoint_stripes_load(filename, stripes); }
+    MPI_Bcast(stripes, sizeof(struct checkpoint_stripes), MPI_BYTE, 0, comm);
+    if (stripes->count != 0) {
+        checkpoint->stripes = stripes;
     } else {
-        checkpoint->data = mmap(0, checkpoint->size, PROT_READ, MAP_PRIVATE, checkpoint->fd, 0);
-        if (checkpoint->data == MAP_FAILED) {
-            perror("mmap");
+        free(stripes);
+    }
+    /* the staging buffers of the prefetched file */
+    char** staged = 0;
+    size_t num_staged = 0;
+    if (rank == 0) {
+        if (checkpoint_prefetch_take(filename, 0, newfilename, sizeof(newfilename), &file,
+                                     &staged, &num_staged) == -1 &&
+            (!shm_tier ||
+             checkpoint_shm_map(filename, 0, newfilename, sizeof(newfilename), &file) == -1) &&
+            checkpoint_file_map_rank(newfilename, sizeof(newfilename), filename,
+                                     checkpoint->stripes, 0, &file) == -1) {
+            fprintf(stderr, "Unable to open checkpoint \"%s\" for reading: %s\n",
+                    newfilename, strerror(errno));
             exit(EXIT_FAILURE);
         }
-        if (madvise(checkpoint->data, checkpoint->size, MADV_SEQUENTIAL) == -1) {
-            perror("madvise");
+        if (checkpoint_file_read_toc(&file, &footer, &checkpoint->records) == 0) {
+            info[0] = footer.nprocs;
+            info[1] = footer.num_records;
+        }
+    }
+    MPI_Bcast(info, 2, MPI_LONG_LONG_INT, 0, comm);
+    const int nprocs = info[0];
+    checkpoint->nprocs = nprocs;
+    /* N-to-M restore requires the same records in all files */
+    checkpoint->num_records = info[1];
+    /* ranks that do not have their own file read the file of rank "rank % nprocs" */
+    if (rank != 0) {
+        if (checkpoint_prefetch_take(filename, rank % nprocs, newfilename, sizeof(newfilename),
+                                     &file, &staged, &num_staged) == -1 &&
+            (!shm_tier || checkpoint_shm_map(filename, rank % nprocs, newfilename,
+                                             sizeof(newfilename), &file) == -1) &&
+            checkpoint_file_map_rank(newfilename, sizeof(newfilename), filename,
+                                     checkpoint->stripes, rank % nprocs, &file) == -1) {
+            fprintf(stderr, "Unable to open checkpoint \"%s\" for reading: %s\n",
+                    newfilename, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (checkpoint_file_read_toc(&file, &footer, &checkpoint->records) == 0 &&
+            nprocs == nranks) {
+            checkpoint->num_records = footer.num_records;
+        }
+    }
+    checkpoint->fd = file.fd;
+    checkpoint->data = file.data;
+    checkpoint->size = file.size;
+    checkpoint->data_size = file.data_size;
+    if (!checkpoint->records) { checkpoint->num_records = 0; }
+    /* the records of N-to-M restore are not the records of the file */
+    if (nprocs == nranks) {
+        checkpoint->staged = staged;
+        checkpoint->num_staged = num_staged;
+    } else {
+        checkpoint_staged_free(staged, num_staged);
+    }
+    if (nprocs != nranks) {
+        if (checkpoint_gather_records(checkpoint) != MPI_SUCCESS) {
+            fprintf(stderr, "Unable to restore checkpoint \"%s\" created by %d ranks "
+                    "using %d ranks\n", filename, nprocs, nranks);
             exit(EXIT_FAILURE);
         }
     }
+    checkpoint->counters[CHECKPOINT_OPEN] = checkpoint_clock() - t0;
+    checkpoint->timestamp = time(0);
     if (verbose) {
-        fprintf(stderr, "rank %d restored from %s\n", rank, newfilename);
+        fprintf(stderr, "rank %d restored from %s (%d ranks)\n", rank, newfilename, nprocs);
         fflush(stderr);
     }
-    checkpoint->communicator = comm;
-    *file = checkpoint;
+    checkpoint_trace_end("checkpoint_restore");
+    *file_out = checkpoint;
     return MPI_SUCCESS;
 }
 
+/* Combine arrays of minimum, maximum and sum values. */
+static void checkpoint_statistics_combine(void* in, void* inout, int* len, MPI_Datatype* type) {
+    const double* a = in;
+    double* b = inout;
+    const int n = *len/3;
+    for (int i=0; i<n; ++i) {
+        if (a[i] < b[i]) { b[i] = a[i]; }
+        if (a[n+i] > b[n+i]) { b[n+i] = a[n+i]; }
+        b[2*n+i] += a[2*n+i];
+    }
+}
+
+/*
+Append the statistics of the checkpoint to the statistics file.
+The file is in JSON lines format if its name ends with ".json", otherwise
+it is in CSV format. The "statistics" array contains
+minimum, maximum and sum of each counter over all ranks.
+*/
+static void checkpoint_write_statistics(const struct mpi_checkpoint* checkpoint,
+                                        const double* statistics, int nranks) {
+    const int n = CHECKPOINT_NUM_COUNTERS;
+    const char* operation = (checkpoint->flags & CHECKPOINT_WRITE_ONLY) ? "create" : "restore";
+    const size_t length = strlen(statistics_filename);
+    const int json = length >= 5 && strcmp(statistics_filename + length - 5, ".json") == 0;
+    FILE* file = fopen(statistics_filename, "a");
+    if (file == 0) {
+        fprintf(stderr, "unable to open \"%s\": %s\n", statistics_filename, strerror(errno));
+        return;
+    }
+    if (json) {
+        fprintf(file, "{\"timestamp\": %lu, \"checkpoint\": \"%s\", \"operation\": \"%s\", "
+                "\"nprocs\": %d", (unsigned long)checkpoint->timestamp,
+                checkpoint->directory, operation, nranks);
+        for (int i=0; i<n; ++i) {
+            fprintf(file, ", \"%s\": {\"min\": %.9g, \"avg\": %.9g, \"max\": %.9g}",
+                    checkpoint_counter_names[i], statistics[i],
+                    statistics[2*n+i]/nranks, statistics[n+i]);
+        }
+        fprintf(file, "}\n");
+    } else {
+        if (ftell(file) == 0) {
+            fprintf(file, "timestamp,checkpoint,operation,nprocs");
+            for (int i=0; i<n; ++i) {
+                const char* name = checkpoint_counter_names[i];
+                fprintf(file, ",%s_min,%s_avg,%s_max", name, name, name);
+            }
+            fprintf(file, "\n");
+        }
+        fprintf(file, "%lu,%s,%s,%d", (unsigned long)checkpoint->timestamp,
+                checkpoint->directory, operation, nranks);
+        for (int i=0; i<n; ++i) {
+            fprintf(file, ",%.9g,%.9g,%.9g", statistics[i],
+                    statistics[2*n+i]/nranks, statistics[n+i]);
+        }
+        fprintf(file, "\n");
+    }
+    if (fclose(file) == -1) { perror("fclose"); }
+}
+
+/* Aggregate the counters over all ranks using one reduction. */
+static void checkpoint_statistics(struct mpi_checkpoint* checkpoint) {
+    const int n = CHECKPOINT_NUM_COUNTERS;
+    MPI_Comm comm = checkpoint->communicator;
+    int rank = 0, nranks = 1;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nranks);
+    if (statistics_op == MPI_OP_NULL) {
+        MPI_Op_create(checkpoint_statistics_combine, 1, &statistics_op);
+    }
+    double local[3*CHECKPOINT_NUM_COUNTERS], global[3*CHECKPOINT_NUM_COUNTERS];
+    for (int i=0; i<n; ++i) {
+        local[i] = local[n+i] = local[2*n+i] = checkpoint->counters[i];
+    }
+    MPI_Reduce(local, global, 3*n, MPI_DOUBLE, statistics_op, 0, comm);
+    if (rank == 0) { checkpoint_write_statistics(checkpoint, global, nranks); }
+}
+
+static void checkpoint_update_pvars(const struct mpi_checkpoint* checkpoint) {
+    const double* counters = checkpoint->counters;
+    const unsigned long long bytes = counters[CHECKPOINT_BYTES];
+    const double total = counters[CHECKPOINT_TOTAL];
+    pthread_mutex_lock(&pvar_mutex);
+    pvar_counts[CHECKPOINT_PVAR_MINOR_FAULTS] += counters[CHECKPOINT_MINOR_FAULTS];
+    pvar_counts[CHECKPOINT_PVAR_MAJOR_FAULTS] += counters[CHECKPOINT_MAJOR_FAULTS];
+    if (checkpoint->flags & CHECKPOINT_WRITE_ONLY) {
+        pvar_counts[CHECKPOINT_PVAR_BYTES_WRITTEN] += bytes;
+        pvar_counts[CHECKPOINT_PVAR_BYTES_STORED] += bytes - checkpoint->bytes_saved;
+        pvar_counts[CHECKPOINT_PVAR_NUM_CREATED] += 1;
+        pvar_times[CHECKPOINT_PVAR_CREATE_TIME] += total;
+        pvar_times[CHECKPOINT_PVAR_LAST_CREATE_TIME] = total;
+        pvar_times[CHECKPOINT_PVAR_FLUSH_TIME] += counters[CHECKPOINT_SYNC];
+    } else {
+        pvar_counts[CHECKPOINT_PVAR_BYTES_READ] += bytes;
+        pvar_counts[CHECKPOINT_PVAR_NUM_RESTORED] += 1;
+        pvar_times[CHECKPOINT_PVAR_RESTORE_TIME] += total;
+        pvar_times[CHECKPOINT_PVAR_LAST_RESTORE_TIME] = total;
+    }
+    pthread_mutex_unlock(&pvar_mutex);
+}
+
 int MPI_Checkpoint_close(MPI_Checkpoint* checkpoint) {
+    checkpoint_trace_begin("checkpoint_close");
     MPI_Comm comm = (*checkpoint)->communicator;
+    checkpoint_release(*checkpoint);
+    if (((*checkpoint)->flags & CHECKPOINT_WRITE_ONLY) && durability != -1) {
+        checkpoint_commit(*checkpoint);
+    }
+    if (((*checkpoint)->flags & CHECKPOINT_WRITE_ONLY) && background_validation) {
+        checkpoint_validation_put(*checkpoint);
+    }
+    double* counters = (*checkpoint)->counters;
+    counters[CHECKPOINT_TOTAL] = checkpoint_clock() - counters[CHECKPOINT_TOTAL];
+    double faults[CHECKPOINT_NUM_COUNTERS] = {0};
+    checkpoint_faults(faults);
+    counters[CHECKPOINT_MINOR_FAULTS] = faults[CHECKPOINT_MINOR_FAULTS] -
+                                        counters[CHECKPOINT_MINOR_FAULTS];
+    counters[CHECKPOINT_MAJOR_FAULTS] = faults[CHECKPOINT_MAJOR_FAULTS] -
+                                        counters[CHECKPOINT_MAJOR_FAULTS];
+    checkpoint_update_pvars(*checkpoint);
+    /* the bandwidth is measured only if the files are flushed by close */
+    if (((*checkpoint)->flags & CHECKPOINT_WRITE_ONLY) && counters[CHECKPOINT_SYNC] > 1e-3) {
+        measured_storage_bandwidth = (counters[CHECKPOINT_BYTES] - (*checkpoint)->bytes_saved) /
+                                     counters[CHECKPOINT_SYNC];
+    }
+    if (statistics_filename[0] != 0) {
+        checkpoint_trace_begin("checkpoint_statistics");
+        checkpoint_statistics(*checkpoint);
+        checkpoint_trace_end("checkpoint_statistics");
+    }
     checkpoint_free(*checkpoint);
     *checkpoint = MPI_CHECKPOINT_NULL;
     checkpoint_t1 = MPI_Wtime();
@@ -348,90 +4650,468 @@ int MPI_Checkpoint_close(MPI_Checkpoint* checkpoint) {
                 rank, checkpoint_t1-checkpoint_t0);
         fflush(stderr);
     }
+    checkpoint_trace_end("checkpoint_close");
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_write(MPI_Checkpoint checkpoint, const void *buf, int count, MPI_Datatype datatype) {
+    return MPI_Checkpoint_write_c(checkpoint, buf, count, datatype);
+}
+
+int MPI_Checkpoint_write_c(MPI_Checkpoint checkpoint, const void *buf, MPI_Count count,
+                           MPI_Datatype datatype) {
+    int element_size = 0;
+    MPI_Type_size(datatype, &element_size);
+    size_t size_in_bytes = ((size_t)count)*element_size;
+    if (count < 0) { return MPI_ERR_ARG; }
+    const size_t index = checkpoint->num_records;
+    struct checkpoint_record* r = checkpoint_add_record(checkpoint, CHECKPOINT_RECORD_PLAIN,
+                                                        size_in_bytes, element_size);
+    checkpoint_trace_begin("checkpoint_write");
+    uint32_t codec = checkpoint_choose_codec(index, buf, count, datatype, element_size,
+                                             size_in_bytes);
+    if (codec == CHECKPOINT_CODEC_NONE ||
+        !checkpoint_write_compressed(checkpoint, r, buf, count, datatype, element_size, codec)) {
+        checkpoint_write_elements(checkpoint, buf, count, datatype, size_in_bytes);
+    }
+    checkpoint_trace_end("checkpoint_write");
+    checkpoint->counters[CHECKPOINT_BYTES] += size_in_bytes;
+    return MPI_SUCCESS;
+}
+
+/*
+Convert subarray dimensions to C order. Returns the number of elements
+in the subarray or -1 if the dimensions are invalid.
+*/
+static int64_t checkpoint_subarray_dims(int ndims, const int sizes[], const int subsizes[],
+                                        const int starts[], int order,
+                                        uint64_t* c_sizes, uint64_t* c_subsizes,
+                                        uint64_t* c_starts) {
+    if (ndims <= 0 || ndims > CHECKPOINT_MAX_DIMS) { return -1; }
+    if (order != MPI_ORDER_C && order != MPI_ORDER_FORTRAN) { return -1; }
+    int64_t count = 1;
+    for (int i=0; i<ndims; ++i) {
+        int j = (order == MPI_ORDER_C) ? i : ndims-1-i;
+        if (sizes[i] <= 0 || subsizes[i] < 0 || starts[i] < 0 ||
+            starts[i] + subsizes[i] > sizes[i]) {
+            return -1;
+        }
+        c_sizes[j] = sizes[i];
+        c_subsizes[j] = subsizes[i];
+        c_starts[j] = starts[i];
+        count *= subsizes[i];
+    }
+    return count;
+}
+
+/* Add the record of the subarray. Returns the size of the subarray in bytes or -1. */
+static int64_t checkpoint_add_subarray(MPI_Checkpoint checkpoint, int ndims, const int sizes[],
+                                       const int subsizes[], const int starts[], int order,
+                                       MPI_Datatype datatype) {
+    uint64_t c_sizes[CHECKPOINT_MAX_DIMS], c_subsizes[CHECKPOINT_MAX_DIMS],
+             c_starts[CHECKPOINT_MAX_DIMS];
+    int64_t count = checkpoint_subarray_dims(ndims, sizes, subsizes, starts, order,
+                                             c_sizes, c_subsizes, c_starts);
+    if (count < 0) { return -1; }
+    int element_size = 0;
+    MPI_Type_size(datatype, &element_size);
+    size_t size_in_bytes = count*element_size;
+    struct checkpoint_record* r =
+        checkpoint_add_record(checkpoint, CHECKPOINT_RECORD_SUBARRAY, size_in_bytes, element_size);
+    r->ndims = ndims;
+    for (int i=0; i<ndims; ++i) {
+        r->sizes[i] = c_sizes[i];
+        r->subsizes[i] = c_subsizes[i];
+        r->starts[i] = c_starts[i];
+    }
+    return size_in_bytes;
+}
+
+int MPI_Checkpoint_write_subarray(MPI_Checkpoint checkpoint, const void* buf, int ndims,
+                                  const int sizes[], const int subsizes[], const int starts[],
+                                  int order, MPI_Datatype datatype) {
+    int64_t size_in_bytes = checkpoint_add_subarray(checkpoint, ndims, sizes, subsizes, starts,
+                                                    order, datatype);
+    if (size_in_bytes < 0) { return MPI_ERR_ARG; }
+    int element_size = 0;
+    MPI_Type_size(datatype, &element_size);
+    MPI_Count count = element_size == 0 ? 0 : size_in_bytes/element_size;
+    checkpoint_trace_begin("checkpoint_write");
+    checkpoint_write_elements(checkpoint, buf, count, datatype, size_in_bytes);
+    checkpoint_trace_end("checkpoint_write");
+    checkpoint->counters[CHECKPOINT_BYTES] += size_in_bytes;
+    return MPI_SUCCESS;
+}
+
+/*
+int MPI_Checkpoint_write_ordered(MPI_Checkpoint fh, const void *buf, int count,
+                                 MPI_Datatype datatype) {
+    if (compression_level != 0) {
+        int element_size = 0;
+        MPI_Type_size(datatype, &element_size);
+        int size_in_bytes = count*element_size;
+        compression_buffer = realloc(compression_buffer, size_in_bytes);
+        if (compression_buffer == 0) { return MPI_ERR_OTHER; }
+        compressor.next_in = buf;
+        compressor.avail_in = size_in_bytes;
+        compressor.next_out = compression_buffer;
+        compressor.avail_out = size_in_bytes;
+        //mz_deflateReset(&compressor);
+        if (mz_deflateInit(&compressor, compression_level) != MZ_OK) {
+            return MPI_ERR_OTHER;
+        }
+        if (mz_deflate(&compressor, MZ_FINISH) != MZ_STREAM_END) {
+            return MPI_ERR_OTHER;
+        }
+        int n = compressor.total_out;
+        int ret = MPI_File_write_ordered(fh,&n,1,MPI_INT,MPI_STATUS_IGNORE);
+        return MPI_File_write_ordered(fh,compression_buffer,n,MPI_BYTE,MPI_STATUS_IGNORE);
+    }
+    return MPI_File_write_ordered(fh,buf,count,datatype,MPI_STATUS_IGNORE);
+}
+*/
+
+/* Advance read position and free the pages that were read. */
+static void checkpoint_read_advance(struct mpi_checkpoint* checkpoint, size_t size_in_bytes) {
+    checkpoint->offset += size_in_bytes;
+    size_t num_pages = (checkpoint->offset-checkpoint->start) / mapping_step;
+    if (num_pages != 0) {
+        if (madvise(((char*)checkpoint->data) + checkpoint->start,
+                    num_pages*mapping_step, MADV_DONTNEED) == -1) {
+            perror("madvise");
+            exit(EXIT_FAILURE);
+        }
+        checkpoint->start += num_pages*mapping_step;
+    }
+}
+
+static int checkpoint_read_compressed(struct mpi_checkpoint* checkpoint,
+                                      const struct checkpoint_record* r, void* buf,
+                                      MPI_Count count, MPI_Datatype datatype,
+                                      size_t size_in_bytes, int element_size) {
+    uint64_t stored = 0;
+    if (r->size != size_in_bytes || r->element_size != element_size ||
+        checkpoint->offset + sizeof(uint64_t) > checkpoint->data_size) {
+        return MPI_ERR_OTHER;
+    }
+    const char* data = ((char*)checkpoint->data) + checkpoint->offset;
+    memcpy(&stored, data, sizeof(uint64_t));
+    if (stored > checkpoint->data_size - checkpoint->offset - sizeof(uint64_t)) {
+        return MPI_ERR_OTHER;
+    }
+    checkpoint_trace_begin("checkpoint_read");
+    double t0 = checkpoint_clock();
+    const size_t index = r - checkpoint->records;
+    int ret = 0;
+    if (index < checkpoint->num_staged && checkpoint->staged[index]) {
+        /* the record was decompressed by the prefetch thread */
+        char* staged = checkpoint->staged[index];
+        checkpoint->staged[index] = 0;
+        if (checkpoint_type_get(datatype) != 0 ||
+            checkpoint_lazy_read(checkpoint, buf, r->size, staged, staged) == -1) {
+            checkpoint_type_copy(buf, count, datatype, staged, r->size, 1);
+            free(staged);
+        }
+        checkpoint->counters[CHECKPOINT_COPY] += checkpoint_clock() - t0;
+    } else {
+        ret = checkpoint_decompress(data + sizeof(uint64_t), stored, buf, count, datatype,
+                                    element_size, r->codec);
+        checkpoint->counters[CHECKPOINT_COMPRESS] += checkpoint_clock() - t0;
+    }
+    checkpoint_trace_end("checkpoint_read");
+    if (ret == -1) { return MPI_ERR_OTHER; }
+    checkpoint->counters[CHECKPOINT_BYTES] += r->size;
+    checkpoint_read_advance(checkpoint, sizeof(uint64_t) + stored);
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_read(MPI_Checkpoint checkpoint, void *buf, int count, MPI_Datatype datatype) {
+    return MPI_Checkpoint_read_c(checkpoint, buf, count, datatype);
+}
+
+int MPI_Checkpoint_read_c(MPI_Checkpoint checkpoint, void *buf, MPI_Count count,
+                          MPI_Datatype datatype) {
+    int element_size = 0;
+    MPI_Type_size(datatype, &element_size);
+    size_t size_in_bytes = ((size_t)count)*element_size;
+    if (count < 0) { return MPI_ERR_ARG; }
+    const struct checkpoint_record* r = checkpoint_current_record(checkpoint, size_in_bytes);
+    if (r && r->codec != CHECKPOINT_CODEC_NONE) {
+        return checkpoint_read_compressed(checkpoint, r, buf, count, datatype, size_in_bytes,
+                                          element_size);
+    }
+    if (checkpoint->offset + size_in_bytes > checkpoint->data_size) {
+        return MPI_ERR_OTHER;
+    }
+    checkpoint_trace_begin("checkpoint_read");
+    double t0 = checkpoint_clock();
+    char* data = ((char*)checkpoint->data) + checkpoint->offset;
+    if (checkpoint_type_get(datatype) != 0 ||
+        checkpoint_lazy_read(checkpoint, buf, size_in_bytes, data, 0) == -1) {
+        checkpoint_type_copy(buf, count, datatype, data, size_in_bytes, 1);
+    }
+    checkpoint->counters[CHECKPOINT_COPY] += checkpoint_clock() - t0;
+    checkpoint_trace_end("checkpoint_read");
+    checkpoint->counters[CHECKPOINT_BYTES] += size_in_bytes;
+    checkpoint_read_advance(checkpoint, size_in_bytes);
+    return MPI_SUCCESS;
+}
+
+/* Vectored write and read
+
+The arrays of MPI_Checkpoint_writev are contiguous, and their element sizes are supplied
+by the caller, so the datatypes are not queried. The file is grown once for all arrays.
+Each array is a separate record that is compressed in the elements of "element_size"
+bytes and can be read by MPI_Checkpoint_read with the datatype of this size. */
+
+int MPI_Checkpoint_writev(MPI_Checkpoint checkpoint, const MPI_Checkpoint_iovec* iov, int n) {
+    if (n < 0) { return MPI_ERR_ARG; }
+    size_t total = 0;
+    for (int i=0; i<n; ++i) {
+        if (iov[i].size < 0 || iov[i].element_size <= 0) { return MPI_ERR_ARG; }
+        total += iov[i].size;
+    }
+    checkpoint_reserve(checkpoint, total, n);
+    checkpoint_trace_begin("checkpoint_write");
+    for (int i=0; i<n; ++i) {
+        const size_t size_in_bytes = iov[i].size;
+        const int element_size = iov[i].element_size;
+        const size_t index = checkpoint->num_records;
+        struct checkpoint_record* r = checkpoint_add_record(checkpoint, CHECKPOINT_RECORD_PLAIN,
+                                                            size_in_bytes, element_size);
+        uint32_t codec = checkpoint_choose_codec(index, iov[i].buffer, size_in_bytes, MPI_BYTE,
+                                                 element_size, size_in_bytes);
+        if (codec == CHECKPOINT_CODEC_NONE ||
+            !checkpoint_write_compressed(checkpoint, r, iov[i].buffer, size_in_bytes,
+                                         MPI_BYTE, element_size, codec)) {
+            checkpoint_write_bytes(checkpoint, iov[i].buffer, size_in_bytes);
+        }
+        checkpoint->counters[CHECKPOINT_BYTES] += size_in_bytes;
+    }
+    checkpoint_trace_end("checkpoint_write");
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_readv(MPI_Checkpoint checkpoint, const MPI_Checkpoint_iovec* iov, int n) {
+    if (n < 0) { return MPI_ERR_ARG; }
+    for (int i=0; i<n; ++i) {
+        if (iov[i].size < 0 || iov[i].element_size <= 0) { return MPI_ERR_ARG; }
+        const size_t size_in_bytes = iov[i].size;
+        const struct checkpoint_record* r = checkpoint_current_record(checkpoint, size_in_bytes);
+        if (r && r->codec != CHECKPOINT_CODEC_NONE) {
+            int ret = checkpoint_read_compressed(checkpoint, r, iov[i].buffer, size_in_bytes,
+                                                 MPI_BYTE, size_in_bytes, iov[i].element_size);
+            if (ret != MPI_SUCCESS) { return ret; }
+            continue;
+        }
+        if (checkpoint->offset + size_in_bytes > checkpoint->data_size) { return MPI_ERR_OTHER; }
+        checkpoint_trace_begin("checkpoint_read");
+        double t0 = checkpoint_clock();
+        char* data = ((char*)checkpoint->data) + checkpoint->offset;
+        if (checkpoint_lazy_read(checkpoint, iov[i].buffer, size_in_bytes, data, 0) == -1) {
+            memcpy(iov[i].buffer, data, size_in_bytes);
+        }
+        checkpoint->counters[CHECKPOINT_COPY] += checkpoint_clock() - t0;
+        checkpoint_trace_end("checkpoint_read");
+        checkpoint->counters[CHECKPOINT_BYTES] += size_in_bytes;
+        checkpoint_read_advance(checkpoint, size_in_bytes);
+    }
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_reserve_range(MPI_Checkpoint checkpoint, int count, MPI_Datatype datatype,
+                                 MPI_Offset* offset) {
+    return MPI_Checkpoint_reserve_range_c(checkpoint, count, datatype, offset);
+}
+
+int MPI_Checkpoint_reserve_range_c(MPI_Checkpoint checkpoint, MPI_Count count,
+                                   MPI_Datatype datatype, MPI_Offset* offset) {
+    int element_size = 0;
+    MPI_Type_size(datatype, &element_size);
+    size_t size_in_bytes = ((size_t)count)*element_size;
+    if (count < 0) { return MPI_ERR_ARG; }
+    if (checkpoint->flags & CHECKPOINT_WRITE_ONLY) {
+        checkpoint_add_record(checkpoint, CHECKPOINT_RECORD_PLAIN, size_in_bytes, element_size);
+        checkpoint_grow(checkpoint, size_in_bytes);
+        if (checkpoint_completed(checkpoint) == checkpoint->offset) {
+            checkpoint->unfilled = checkpoint->offset;
+        }
+        checkpoint->reserved_bytes += size_in_bytes;
+    } else if (checkpoint->offset + size_in_bytes > checkpoint->data_size) {
+        return MPI_ERR_OTHER;
+    }
+    *offset = checkpoint->offset;
+    /* the pages are not freed until all threads copied the data */
+    checkpoint->offset += size_in_bytes;
+    checkpoint->counters[CHECKPOINT_BYTES] += size_in_bytes;
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_write_at(MPI_Checkpoint checkpoint, MPI_Offset offset, const void* buf,
+                            int count, MPI_Datatype datatype) {
+    return MPI_Checkpoint_write_at_c(checkpoint, offset, buf, count, datatype);
+}
+
+int MPI_Checkpoint_write_at_c(MPI_Checkpoint checkpoint, MPI_Offset offset, const void* buf,
+                              MPI_Count count, MPI_Datatype datatype) {
+    int element_size = 0;
+    MPI_Type_size(datatype, &element_size);
+    size_t size_in_bytes = ((size_t)count)*element_size;
+    if (!(checkpoint->flags & CHECKPOINT_WRITE_ONLY)) { return MPI_ERR_OTHER; }
+    if (count < 0 || offset < 0 || offset + size_in_bytes > checkpoint->offset) {
+        return MPI_ERR_ARG;
+    }
+    checkpoint_trace_begin("checkpoint_write_at");
+    pthread_rwlock_rdlock(&checkpoint->mapping_lock);
+    checkpoint_type_copy((void*)buf, count, datatype, ((char*)checkpoint->data) + offset,
+                         size_in_bytes, 0);
+    pthread_rwlock_unlock(&checkpoint->mapping_lock);
+    __atomic_add_fetch(&checkpoint->filled_bytes, size_in_bytes, __ATOMIC_RELEASE);
+    checkpoint_trace_end("checkpoint_write_at");
     return MPI_SUCCESS;
 }
 
-int MPI_Checkpoint_write(MPI_Checkpoint checkpoint, const void *buf, int count, MPI_Datatype datatype) {
+int MPI_Checkpoint_read_at(MPI_Checkpoint checkpoint, MPI_Offset offset, void* buf,
+                           int count, MPI_Datatype datatype) {
+    return MPI_Checkpoint_read_at_c(checkpoint, offset, buf, count, datatype);
+}
+
+int MPI_Checkpoint_read_at_c(MPI_Checkpoint checkpoint, MPI_Offset offset, void* buf,
+                             MPI_Count count, MPI_Datatype datatype) {
     int element_size = 0;
     MPI_Type_size(datatype, &element_size);
-    int size_in_bytes = count*element_size;
-    size_t old_size = 0;
-    while (checkpoint->size - checkpoint->offset < size_in_bytes) {
-        size_t new_size = checkpoint->offset + size_in_bytes;
-        size_t remainder = new_size%page_size;
-        if (remainder != 0) { new_size += page_size-remainder; }
-        if (ftruncate(checkpoint->fd, new_size) == -1) {
-            perror("ftruncate");
-            exit(EXIT_FAILURE);
-        }
-        void* new_data = mremap(checkpoint->data, checkpoint->size, new_size, MREMAP_MAYMOVE);
-        if (!new_data) {
-            perror("mremap");
-            exit(EXIT_FAILURE);
-        }
-        old_size = checkpoint->size;
-        checkpoint->data = new_data;
-        checkpoint->size = new_size;
-    }
-    memcpy(((char*)checkpoint->data) + checkpoint->offset, buf, size_in_bytes);
-    if (old_size != 0) {
-        if (madvise(((char*)checkpoint->data) + checkpoint->start,
-                    old_size-checkpoint->start, MADV_DONTNEED) == -1) {
-            perror("madvise");
-            exit(EXIT_FAILURE);
-        }
-        checkpoint->start = old_size;
+    size_t size_in_bytes = ((size_t)count)*element_size;
+    if (!(checkpoint->flags & CHECKPOINT_READ_ONLY)) { return MPI_ERR_OTHER; }
+    if (count < 0 || offset < 0 || offset + size_in_bytes > checkpoint->offset) {
+        return MPI_ERR_ARG;
     }
-    checkpoint->offset += size_in_bytes;
+    checkpoint_trace_begin("checkpoint_read_at");
+    checkpoint_type_copy(buf, count, datatype, ((char*)checkpoint->data) + offset,
+                         size_in_bytes, 1);
+    checkpoint_trace_end("checkpoint_read_at");
     return MPI_SUCCESS;
 }
 
 /*
-int MPI_Checkpoint_write_ordered(MPI_Checkpoint fh, const void *buf, int count,
-                                 MPI_Datatype datatype) {
-    if (compression_level != 0) {
-        int element_size = 0;
-        MPI_Type_size(datatype, &element_size);
-        int size_in_bytes = count*element_size;
-        compression_buffer = realloc(compression_buffer, size_in_bytes);
-        if (compression_buffer == 0) { return MPI_ERR_OTHER; }
-        compressor.next_in = buf;
-        compressor.avail_in = size_in_bytes;
-        compressor.next_out = compression_buffer;
-        compressor.avail_out = size_in_bytes;
-        //mz_deflateReset(&compressor);
-        if (mz_deflateInit(&compressor, compression_level) != MZ_OK) {
-            return MPI_ERR_OTHER;
-        }
-        if (mz_deflate(&compressor, MZ_FINISH) != MZ_STREAM_END) {
-            return MPI_ERR_OTHER;
+Copy the intersection of the source and the destination subarrays of the same array.
+All dimensions are in C order.
+*/
+static void checkpoint_copy_intersection(char* dst, const uint64_t* dst_starts,
+                                         const uint64_t* dst_subsizes,
+                                         const char* src, const uint64_t* src_starts,
+                                         const uint64_t* src_subsizes,
+                                         int ndims, size_t element_size) {
+    uint64_t first[CHECKPOINT_MAX_DIMS], last[CHECKPOINT_MAX_DIMS], index[CHECKPOINT_MAX_DIMS];
+    for (int i=0; i<ndims; ++i) {
+        first[i] = dst_starts[i] > src_starts[i] ? dst_starts[i] : src_starts[i];
+        uint64_t dst_end = dst_starts[i] + dst_subsizes[i];
+        uint64_t src_end = src_starts[i] + src_subsizes[i];
+        last[i] = dst_end < src_end ? dst_end : src_end;
+        if (first[i] >= last[i]) { return; }
+        index[i] = first[i];
+    }
+    const size_t n = (last[ndims-1]-first[ndims-1])*element_size;
+    while (1) {
+        size_t dst_offset = 0, src_offset = 0;
+        for (int i=0; i<ndims; ++i) {
+            dst_offset = dst_offset*dst_subsizes[i] + (index[i]-dst_starts[i]);
+            src_offset = src_offset*src_subsizes[i] + (index[i]-src_starts[i]);
         }
-        int n = compressor.total_out;
-        int ret = MPI_File_write_ordered(fh,&n,1,MPI_INT,MPI_STATUS_IGNORE);
-        return MPI_File_write_ordered(fh,compression_buffer,n,MPI_BYTE,MPI_STATUS_IGNORE);
+        memcpy(dst + dst_offset*element_size, src + src_offset*element_size, n);
+        int i = ndims-2;
+        while (i >= 0 && ++index[i] == last[i]) { index[i] = first[i]; --i; }
+        if (i < 0) { break; }
     }
-    return MPI_File_write_ordered(fh,buf,count,datatype,MPI_STATUS_IGNORE);
 }
-*/
 
-int MPI_Checkpoint_read(MPI_Checkpoint checkpoint, void *buf, int count, MPI_Datatype datatype) {
+int MPI_Checkpoint_read_subarray(MPI_Checkpoint checkpoint, void* buf, int ndims,
+                                 const int sizes[], const int subsizes[], const int starts[],
+                                 int order, MPI_Datatype datatype) {
+    uint64_t c_sizes[CHECKPOINT_MAX_DIMS], c_subsizes[CHECKPOINT_MAX_DIMS],
+             c_starts[CHECKPOINT_MAX_DIMS];
+    int64_t count = checkpoint_subarray_dims(ndims, sizes, subsizes, starts, order,
+                                             c_sizes, c_subsizes, c_starts);
+    if (count < 0) { return MPI_ERR_ARG; }
     int element_size = 0;
     MPI_Type_size(datatype, &element_size);
-    int size_in_bytes = count*element_size;
-    if (checkpoint->offset + size_in_bytes > checkpoint->size) {
+    size_t size_in_bytes = count*element_size;
+    /* the files without the table of contents are read as is */
+    if (checkpoint->records == 0) {
+        return MPI_Checkpoint_read_c(checkpoint, buf, count, datatype);
+    }
+    const struct checkpoint_record* r = checkpoint_current_record(checkpoint, size_in_bytes);
+    if (!r) { return MPI_ERR_OTHER; }
+    const size_t index = r - checkpoint->records;
+    if (r->kind != CHECKPOINT_RECORD_SUBARRAY || r->ndims != ndims ||
+        r->element_size != element_size) {
         return MPI_ERR_OTHER;
     }
-    memcpy(buf, ((char*)checkpoint->data) + checkpoint->offset, size_in_bytes);
-    checkpoint->offset += size_in_bytes;
-    size_t num_pages = (checkpoint->offset-checkpoint->start) / page_size;
-    if (num_pages != 0) {
-        if (madvise(((char*)checkpoint->data) + checkpoint->start,
-                    checkpoint->offset-checkpoint->start, MADV_DONTNEED) == -1) {
-            perror("madvise");
-            exit(EXIT_FAILURE);
+    for (int i=0; i<ndims; ++i) {
+        if (r->sizes[i] != c_sizes[i]) { return MPI_ERR_OTHER; }
+    }
+    if (!checkpoint->all_records) {
+        /* the checkpoint was created by the same number of ranks */
+        for (int i=0; i<ndims; ++i) {
+            if (r->subsizes[i] != c_subsizes[i] || r->starts[i] != c_starts[i]) {
+                return MPI_ERR_OTHER;
+            }
+        }
+    }
+    checkpoint_trace_begin("checkpoint_read");
+    double t0 = checkpoint_clock();
+    int ret = MPI_SUCCESS;
+    if (!checkpoint->all_records) {
+        checkpoint_type_copy(buf, count, datatype, ((char*)checkpoint->data) + r->offset,
+                             size_in_bytes, 1);
+    } else {
+        /* the elements of non-contiguous datatypes are assembled in the temporary buffer */
+        char* packed = buf;
+        if (checkpoint_type_get(datatype)) {
+            packed = malloc(size_in_bytes);
+            if (!packed) {
+                fprintf(stderr, "not enough memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        /* copy the parts of the subarrays of all ranks that created the checkpoint */
+        char filename[4096];
+        for (int j=0; j<checkpoint->nprocs && ret == MPI_SUCCESS; ++j) {
+            const struct checkpoint_record* s = checkpoint->all_records +
+                j*checkpoint->num_records + index;
+            int empty = 0;
+            for (int i=0; i<ndims; ++i) {
+                if (s->subsizes[i] == 0 ||
+                    s->starts[i] >= c_starts[i] + c_subsizes[i] ||
+                    c_starts[i] >= s->starts[i] + s->subsizes[i]) {
+                    empty = 1;
+                }
+            }
+            if (empty) { continue; }
+            struct checkpoint_file* f = checkpoint->files + j;
+            if (f->fd == -1) {
+                if (checkpoint_file_map_rank(filename, sizeof(filename), checkpoint->directory,
+                                             checkpoint->stripes, j, f) == -1) {
+                    ret = MPI_ERR_OTHER;
+                    break;
+                }
+            }
+            if (s->offset + s->size > f->size) { ret = MPI_ERR_OTHER; break; }
+            checkpoint_copy_intersection(packed, c_starts, c_subsizes,
+                                         ((char*)f->data) + s->offset, s->starts, s->subsizes,
+                                         ndims, element_size);
+        }
+        if (packed != buf) {
+            if (ret == MPI_SUCCESS) {
+                checkpoint_type_copy(buf, count, datatype, packed, size_in_bytes, 1);
+            }
+            free(packed);
         }
-        checkpoint->start += num_pages*page_size;
     }
+    checkpoint->counters[CHECKPOINT_COPY] += checkpoint_clock() - t0;
+    checkpoint_trace_end("checkpoint_read");
+    if (ret != MPI_SUCCESS) { return ret; }
+    checkpoint->counters[CHECKPOINT_BYTES] += size_in_bytes;
+    checkpoint_read_advance(checkpoint, r->size);
     return MPI_SUCCESS;
 }
 
@@ -461,22 +5141,275 @@ int MPI_Checkpoint_read_ordered(MPI_Checkpoint fh, void *buf, int count, MPI_Dat
 }
 */
 
+/* Grow the file and the table of contents for all regions at once. */
+static void checkpoint_reserve_regions(struct mpi_checkpoint* checkpoint) {
+    size_t size = 0;
+    for (size_t i=0; i<num_regions; ++i) {
+        int element_size = 0;
+        MPI_Type_size(regions[i].datatype, &element_size);
+        size += ((size_t)regions[i].count)*element_size;
+    }
+    checkpoint_reserve(checkpoint, size, num_regions);
+}
+
+int MPI_Checkpoint_register(void* buf, int count, MPI_Datatype datatype, const char* name) {
+    return MPI_Checkpoint_register_c(buf, count, datatype, name);
+}
+
+int MPI_Checkpoint_register_c(void* buf, MPI_Count count, MPI_Datatype datatype,
+                              const char* name) {
+    if (count < 0 || name == 0) { return MPI_ERR_ARG; }
+    char short_name[CHECKPOINT_REGION_NAME_LENGTH];
+    snprintf(short_name, sizeof(short_name), "%s", name);
+    struct checkpoint_region* r = 0;
+    for (size_t i=0; i<num_regions && !r; ++i) {
+        if (strcmp(regions[i].name, short_name) == 0) { r = regions + i; }
+    }
+    if (!r) {
+        if (num_regions == max_regions) {
+            size_t n = max_regions == 0 ? 16 : max_regions*2;
+            struct checkpoint_region* new_regions =
+                realloc(regions, n*sizeof(struct checkpoint_region));
+            if (!new_regions) { return MPI_ERR_NO_MEM; }
+            regions = new_regions;
+            max_regions = n;
+        }
+        r = regions + num_regions++;
+        memcpy(r->name, short_name, sizeof(short_name));
+    }
+    r->buf = buf;
+    r->count = count;
+    r->datatype = datatype;
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_commit(MPI_Comm comm) {
+    MPI_Checkpoint checkpoint = MPI_CHECKPOINT_NULL;
+    int ret = MPI_Checkpoint_create(comm, &checkpoint);
+    if (ret != MPI_SUCCESS) { return ret; }
+    checkpoint_reserve_regions(checkpoint);
+    for (size_t i=0; i<num_regions && ret == MPI_SUCCESS; ++i) {
+        const struct checkpoint_region* r = regions + i;
+        ret = MPI_Checkpoint_write_c(checkpoint, r->buf, r->count, r->datatype);
+    }
+    MPI_Checkpoint_close(&checkpoint);
+    return ret;
+}
+
+int MPI_Checkpoint_recover(MPI_Comm comm) {
+    MPI_Checkpoint checkpoint = MPI_CHECKPOINT_NULL;
+    int ret = MPI_Checkpoint_restore(comm, &checkpoint);
+    if (ret != MPI_SUCCESS) { return ret; }
+    if (checkpoint->num_records != num_regions) {
+        fprintf(stderr, "The checkpoint contains %zu records, but %zu regions are registered\n",
+                checkpoint->num_records, num_regions);
+        ret = MPI_ERR_OTHER;
+    }
+    for (size_t i=0; i<num_regions && ret == MPI_SUCCESS; ++i) {
+        const struct checkpoint_region* r = regions + i;
+        ret = MPI_Checkpoint_read_c(checkpoint, r->buf, r->count, r->datatype);
+        if (ret != MPI_SUCCESS) {
+            fprintf(stderr, "Unable to read the region \"%s\" from the checkpoint\n", r->name);
+        }
+    }
+    MPI_Checkpoint_close(&checkpoint);
+    return ret;
+}
+
+/* Arena
+
+MPI_Checkpoint_arena_alloc allocates the arrays from one anonymous mapping that is
+reserved at the fixed address (arena-address) and is aligned to the huge page size.
+The program that restarts from the checkpoint and allocates the same arrays in the same
+order gets the same addresses, so the pointers to the arena that are stored in the arena
+stay valid. The used part of the arena is registered as one region "arena" that
+MPI_Checkpoint_commit writes with one call. The arena is a stack: each block starts with
+the header that links it to the previous block, and the blocks that are freed out of order
+are released when all blocks after them are freed. */
+
+#define CHECKPOINT_ARENA_ALIGNMENT 64
+
+struct checkpoint_arena_header {
+    /* the offset of the header of the previous block or SIZE_MAX */
+    size_t previous;
+    int freed;
+};
+
+static char* arena = 0;
+/* the offset of the first unused byte */
+static size_t arena_top = 0;
+/* the offset of the header of the last block or SIZE_MAX */
+static size_t arena_last = SIZE_MAX;
+
+static int checkpoint_arena_map() {
+    const int flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE;
+    void* data = MAP_FAILED;
+    if (arena_address != 0) {
+        data = mmap((void*)arena_address, arena_size, PROT_READ|PROT_WRITE,
+                    flags|MAP_FIXED_NOREPLACE, -1, 0);
+        /* the kernels without MAP_FIXED_NOREPLACE use the address as a hint */
+        if (data != MAP_FAILED && data != (void*)arena_address) {
+            munmap(data, arena_size);
+            data = MAP_FAILED;
+        }
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Unable to map the arena at %p, the addresses of the arrays "
+                    "will change after restart\n", (void*)arena_address);
+        }
+    }
+    if (data == MAP_FAILED) {
+        /* over-allocate to align the arena and unmap the rest */
+        const size_t n = arena_size + huge_page_size;
+        char* first = mmap(0, n, PROT_READ|PROT_WRITE, flags, -1, 0);
+        if (first == MAP_FAILED) { return -1; }
+        char* aligned = (char*)((((uintptr_t)first) + huge_page_size - 1) /
+                                huge_page_size*huge_page_size);
+        if (aligned != first) { munmap(first, aligned - first); }
+        munmap(aligned + arena_size, first + n - aligned - arena_size);
+        data = aligned;
+    }
+    checkpoint_advise_huge_pages(data, arena_size);
+    arena = data;
+    return 0;
+}
+
+void* MPI_Checkpoint_arena_alloc(size_t size) {
+    if (!initialized) { MPI_Checkpoint_init(); }
+    if (!arena && checkpoint_arena_map() == -1) { return 0; }
+    const size_t header_size = CHECKPOINT_ARENA_ALIGNMENT;
+    const size_t n = (size + CHECKPOINT_ARENA_ALIGNMENT - 1) /
+                     CHECKPOINT_ARENA_ALIGNMENT*CHECKPOINT_ARENA_ALIGNMENT;
+    if (n < size || arena_size - arena_top < header_size + n) { return 0; }
+    struct checkpoint_arena_header* header = (struct checkpoint_arena_header*)(arena + arena_top);
+    header->previous = arena_last;
+    header->freed = 0;
+    arena_last = arena_top;
+    arena_top += header_size + n;
+    MPI_Checkpoint_register_c(arena, arena_top, MPI_BYTE, "arena");
+    return arena + arena_last + header_size;
+}
+
+void MPI_Checkpoint_arena_free(void* ptr) {
+    if (!ptr) { return; }
+    struct checkpoint_arena_header* header =
+        (struct checkpoint_arena_header*)(((char*)ptr) - CHECKPOINT_ARENA_ALIGNMENT);
+    header->freed = 1;
+    const size_t old_top = arena_top;
+    while (arena_last != SIZE_MAX) {
+        header = (struct checkpoint_arena_header*)(arena + arena_last);
+        if (!header->freed) { break; }
+        arena_top = arena_last;
+        arena_last = header->previous;
+    }
+    if (arena_top == old_top) { return; }
+    /* return the pages above the top to the system */
+    const size_t first = (arena_top + page_size - 1)/page_size*page_size;
+    if (first < old_top) { madvise(arena + first, old_top - first, MADV_DONTNEED); }
+    MPI_Checkpoint_register_c(arena, arena_top, MPI_BYTE, "arena");
+}
+
+int MPI_Checkpoint_trace_begin(const char* name) {
+    checkpoint_trace_begin(name);
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_trace_end(const char* name) {
+    checkpoint_trace_end(name);
+    return MPI_SUCCESS;
+}
+
+/* The names of the events that correspond to NPB timers. */
+static const char* checkpoint_timer_name(int n) {
+    static char names[64][CHECKPOINT_TRACE_NAME_LENGTH];
+    if (n < 0 || n >= 64) { return "timer"; }
+    if (names[n][0] == 0) { snprintf(names[n], sizeof(names[n]), "timer %d", n); }
+    return names[n];
+}
+
+int MPI_Checkpoint_trace_timer_start(int n) {
+    if (trace_enabled) { checkpoint_trace('B', checkpoint_timer_name(n)); }
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_trace_timer_stop(int n) {
+    if (trace_enabled) { checkpoint_trace('E', checkpoint_timer_name(n)); }
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_iteration() {
+    const double now = checkpoint_clock();
+    if (last_iteration != 0) { checkpoint_drain_adapt(now - last_iteration); }
+    last_iteration = now;
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_pvar_get_num(int* num) {
+    *num = CHECKPOINT_NUM_PVARS;
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_pvar_get_info(int index, const char** name, MPI_Datatype* datatype,
+                                 const char** description) {
+    if (index < 0 || index >= CHECKPOINT_NUM_PVARS) { return MPI_ERR_ARG; }
+    const struct checkpoint_pvar* pvar = checkpoint_pvars + index;
+    if (name) { *name = pvar->name; }
+    if (datatype) { *datatype = pvar->is_double ? MPI_DOUBLE : MPI_UNSIGNED_LONG_LONG; }
+    if (description) { *description = pvar->description; }
+    return MPI_SUCCESS;
+}
+
+int MPI_Checkpoint_pvar_get_index(const char* name, int* index) {
+    for (int i=0; i<CHECKPOINT_NUM_PVARS; ++i) {
+        if (strcmp(checkpoint_pvars[i].name, name) == 0) {
+            *index = i;
+            return MPI_SUCCESS;
+        }
+    }
+    return MPI_ERR_ARG;
+}
+
+int MPI_Checkpoint_pvar_read(int index, void* buf) {
+    if (index < 0 || index >= CHECKPOINT_NUM_PVARS) { return MPI_ERR_ARG; }
+    if (index == CHECKPOINT_PVAR_COMPRESSION_RATIO) {
+        pthread_mutex_lock(&pvar_mutex);
+        const unsigned long long stored = pvar_counts[CHECKPOINT_PVAR_BYTES_STORED];
+        *((double*)buf) = (stored == 0) ? 1.0 :
+            ((double)pvar_counts[CHECKPOINT_PVAR_BYTES_WRITTEN]) / stored;
+        pthread_mutex_unlock(&pvar_mutex);
+    } else if (index == CHECKPOINT_PVAR_ASYNC_WRITES) {
+        pthread_mutex_lock(&drain_mutex);
+        *((unsigned long long*)buf) = num_drains;
+        pthread_mutex_unlock(&drain_mutex);
+    } else if (index == CHECKPOINT_PVAR_DRAIN_RATE) {
+        pthread_mutex_lock(&drain_mutex);
+        *((double*)buf) = drain_rate*1e-6;
+        pthread_mutex_unlock(&drain_mutex);
+    } else if (checkpoint_pvars[index].is_double) {
+        pthread_mutex_lock(&pvar_mutex);
+        *((double*)buf) = pvar_times[index];
+        pthread_mutex_unlock(&pvar_mutex);
+    } else {
+        pthread_mutex_lock(&pvar_mutex);
+        *((unsigned long long*)buf) = pvar_counts[index];
+        pthread_mutex_unlock(&pvar_mutex);
+    }
+    return MPI_SUCCESS;
+}
+
 /* Fortran bindings */
 
 MPI_Checkpoint MPI_Checkpoint_f2c(MPI_Fint f_checkpoint) {
-    if (f_checkpoint < 0 || f_checkpoint >= checkpoints_count) {
-        return MPI_CHECKPOINT_NULL;
+    MPI_Checkpoint c_checkpoint = MPI_CHECKPOINT_NULL;
+    pthread_mutex_lock(&checkpoints_mutex);
+    if (f_checkpoint >= 0 && f_checkpoint < checkpoints_count) {
+        c_checkpoint = checkpoints[f_checkpoint].checkpoint;
     }
-    return checkpoints[f_checkpoint];
+    pthread_mutex_unlock(&checkpoints_mutex);
+    return c_checkpoint;
 }
 
 MPI_Fint MPI_Checkpoint_c2f(MPI_Checkpoint c_checkpoint) {
-    for (int i=0; i<sizeof(checkpoints)/sizeof(MPI_Checkpoint); ++i) {
-        if (checkpoints[i] == c_checkpoint) {
-            return i;
-        }
-    }
-    return -1;
+    return c_checkpoint == MPI_CHECKPOINT_NULL ? -1 : c_checkpoint->f_handle;
 }
 
 void mpi_checkpoint_create_(MPI_Fint* comm, MPI_Fint* f_checkpoint, MPI_Fint* error) {
@@ -489,6 +5422,7 @@ void mpi_checkpoint_create_(MPI_Fint* comm, MPI_Fint* f_checkpoint, MPI_Fint* er
 void mpi_checkpoint_restore_(MPI_Fint* comm, MPI_Fint* f_checkpoint, MPI_Fint* error) {
     MPI_Checkpoint c_checkpoint = MPI_CHECKPOINT_NULL;
     *error = MPI_Checkpoint_restore(MPI_Comm_f2c(*comm), &c_checkpoint);
+    if (*error != MPI_SUCCESS) { *f_checkpoint = -1; return; }
     *f_checkpoint = add_fortran_checkpoint(c_checkpoint, error);
 }
 
@@ -496,6 +5430,7 @@ void mpi_checkpoint_close_(MPI_Fint* f_checkpoint, MPI_Fint* error) {
     MPI_Checkpoint c_checkpoint = MPI_Checkpoint_f2c(*f_checkpoint);
     if (c_checkpoint == MPI_CHECKPOINT_NULL) { *error = MPI_ERR_OTHER; return; }
     *error = MPI_Checkpoint_close(&c_checkpoint);
+    remove_fortran_checkpoint(*f_checkpoint);
     *f_checkpoint = -1;
 }
 
@@ -519,6 +5454,401 @@ void mpi_checkpoint_read_(MPI_Fint* f_checkpoint, char* buf, MPI_Fint* count,
                                  MPI_Type_f2c(*datatype));
 }
 
+void mpi_checkpoint_reserve_range_(MPI_Fint* f_checkpoint, MPI_Fint* count, MPI_Fint* datatype,
+                                   MPI_Offset* offset, MPI_Fint* error) {
+    *error = MPI_Checkpoint_reserve_range(MPI_Checkpoint_f2c(*f_checkpoint), *count,
+                                          MPI_Type_f2c(*datatype), offset);
+}
+
+void mpi_checkpoint_write_at_(MPI_Fint* f_checkpoint, MPI_Offset* offset, char* buf,
+                              MPI_Fint* count, MPI_Fint* datatype, MPI_Fint* error) {
+    *error = MPI_Checkpoint_write_at(MPI_Checkpoint_f2c(*f_checkpoint), *offset, buf, *count,
+                                     MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_read_at_(MPI_Fint* f_checkpoint, MPI_Offset* offset, char* buf,
+                             MPI_Fint* count, MPI_Fint* datatype, MPI_Fint* error) {
+    *error = MPI_Checkpoint_read_at(MPI_Checkpoint_f2c(*f_checkpoint), *offset, buf, *count,
+                                    MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_write_c_(MPI_Fint* f_checkpoint, char* buf, MPI_Count* count,
+                             MPI_Fint* datatype, MPI_Fint* error) {
+    *error = MPI_Checkpoint_write_c(MPI_Checkpoint_f2c(*f_checkpoint), buf, *count,
+                                    MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_read_c_(MPI_Fint* f_checkpoint, char* buf, MPI_Count* count,
+                            MPI_Fint* datatype, MPI_Fint* error) {
+    *error = MPI_Checkpoint_read_c(MPI_Checkpoint_f2c(*f_checkpoint), buf, *count,
+                                   MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_reserve_range_c_(MPI_Fint* f_checkpoint, MPI_Count* count,
+                                     MPI_Fint* datatype, MPI_Offset* offset, MPI_Fint* error) {
+    *error = MPI_Checkpoint_reserve_range_c(MPI_Checkpoint_f2c(*f_checkpoint), *count,
+                                            MPI_Type_f2c(*datatype), offset);
+}
+
+void mpi_checkpoint_write_at_c_(MPI_Fint* f_checkpoint, MPI_Offset* offset, char* buf,
+                                MPI_Count* count, MPI_Fint* datatype, MPI_Fint* error) {
+    *error = MPI_Checkpoint_write_at_c(MPI_Checkpoint_f2c(*f_checkpoint), *offset, buf, *count,
+                                       MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_read_at_c_(MPI_Fint* f_checkpoint, MPI_Offset* offset, char* buf,
+                               MPI_Count* count, MPI_Fint* datatype, MPI_Fint* error) {
+    *error = MPI_Checkpoint_read_at_c(MPI_Checkpoint_f2c(*f_checkpoint), *offset, buf, *count,
+                                      MPI_Type_f2c(*datatype));
+}
+
+static void copy_fortran_dims(MPI_Fint ndims, const MPI_Fint* f_dims, int* dims) {
+    for (int i=0; i<ndims && i<CHECKPOINT_MAX_DIMS; ++i) { dims[i] = f_dims[i]; }
+}
+
+void mpi_checkpoint_write_subarray_(MPI_Fint* f_checkpoint, char* buf, MPI_Fint* ndims,
+                                    MPI_Fint* sizes, MPI_Fint* subsizes, MPI_Fint* starts,
+                                    MPI_Fint* order, MPI_Fint* datatype, MPI_Fint* error) {
+    int c_sizes[CHECKPOINT_MAX_DIMS], c_subsizes[CHECKPOINT_MAX_DIMS],
+        c_starts[CHECKPOINT_MAX_DIMS];
+    copy_fortran_dims(*ndims, sizes, c_sizes);
+    copy_fortran_dims(*ndims, subsizes, c_subsizes);
+    copy_fortran_dims(*ndims, starts, c_starts);
+    *error = MPI_Checkpoint_write_subarray(MPI_Checkpoint_f2c(*f_checkpoint), buf, *ndims,
+                                           c_sizes, c_subsizes, c_starts, *order,
+                                           MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_read_subarray_(MPI_Fint* f_checkpoint, char* buf, MPI_Fint* ndims,
+                                   MPI_Fint* sizes, MPI_Fint* subsizes, MPI_Fint* starts,
+                                   MPI_Fint* order, MPI_Fint* datatype, MPI_Fint* error) {
+    int c_sizes[CHECKPOINT_MAX_DIMS], c_subsizes[CHECKPOINT_MAX_DIMS],
+        c_starts[CHECKPOINT_MAX_DIMS];
+    copy_fortran_dims(*ndims, sizes, c_sizes);
+    copy_fortran_dims(*ndims, subsizes, c_subsizes);
+    copy_fortran_dims(*ndims, starts, c_starts);
+    *error = MPI_Checkpoint_read_subarray(MPI_Checkpoint_f2c(*f_checkpoint), buf, *ndims,
+                                          c_sizes, c_subsizes, c_starts, *order,
+                                          MPI_Type_f2c(*datatype));
+}
+
+/* Fortran strings are not null-terminated, their length is passed as a hidden argument. */
+static void copy_fortran_string(const char* f_string, size_t length, char* string, size_t n) {
+    while (length != 0 && f_string[length-1] == ' ') { --length; }
+    if (length > n-1) { length = n-1; }
+    memcpy(string, f_string, length);
+    string[length] = 0;
+}
+
+void mpi_checkpoint_trace_begin_(const char* name, MPI_Fint* error, size_t name_length) {
+    char c_name[CHECKPOINT_TRACE_NAME_LENGTH];
+    copy_fortran_string(name, name_length, c_name, sizeof(c_name));
+    *error = MPI_Checkpoint_trace_begin(c_name);
+}
+
+void mpi_checkpoint_trace_end_(const char* name, MPI_Fint* error, size_t name_length) {
+    char c_name[CHECKPOINT_TRACE_NAME_LENGTH];
+    copy_fortran_string(name, name_length, c_name, sizeof(c_name));
+    *error = MPI_Checkpoint_trace_end(c_name);
+}
+
+void mpi_checkpoint_register_(char* buf, MPI_Fint* count, MPI_Fint* datatype, const char* name,
+                              MPI_Fint* error, size_t name_length) {
+    char c_name[CHECKPOINT_REGION_NAME_LENGTH];
+    copy_fortran_string(name, name_length, c_name, sizeof(c_name));
+    *error = MPI_Checkpoint_register_c(buf, *count, MPI_Type_f2c(*datatype), c_name);
+}
+
+void mpi_checkpoint_register_c_(char* buf, MPI_Count* count, MPI_Fint* datatype,
+                                const char* name, MPI_Fint* error, size_t name_length) {
+    char c_name[CHECKPOINT_REGION_NAME_LENGTH];
+    copy_fortran_string(name, name_length, c_name, sizeof(c_name));
+    *error = MPI_Checkpoint_register_c(buf, *count, MPI_Type_f2c(*datatype), c_name);
+}
+
+void mpi_checkpoint_commit_(MPI_Fint* comm, MPI_Fint* error) {
+    *error = MPI_Checkpoint_commit(MPI_Comm_f2c(*comm));
+}
+
+void mpi_checkpoint_recover_(MPI_Fint* comm, MPI_Fint* error) {
+    *error = MPI_Checkpoint_recover(MPI_Comm_f2c(*comm));
+}
+
+void mpi_checkpoint_trace_timer_start_(MPI_Fint* n) {
+    MPI_Checkpoint_trace_timer_start(*n);
+}
+
+void mpi_checkpoint_trace_timer_stop_(MPI_Fint* n) {
+    MPI_Checkpoint_trace_timer_stop(*n);
+}
+
+void mpi_checkpoint_iteration_() {
+    MPI_Checkpoint_iteration();
+}
+
+/* Fortran 2008 bindings (mpi_checkpoint_f08 module)
+
+The buffers are passed by descriptor, so array sections are copied directly
+between the checkpoint and the array without the temporary copies made by
+the compiler for implicit interfaces. */
+
+#if defined(__has_include)
+#if __has_include(<ISO_Fortran_binding.h>)
+#define CHECKPOINT_HAVE_CDESC
+#endif
+#endif
+
+#ifdef CHECKPOINT_HAVE_CDESC
+#include <ISO_Fortran_binding.h>
+
+/* CFI_is_contiguous is not used, C programs are not linked with the Fortran runtime. */
+static int checkpoint_cdesc_contiguous(const CFI_cdesc_t* desc) {
+    CFI_index_t sm = desc->elem_len;
+    for (int i=0; i<desc->rank; ++i) {
+        /* the last extent of the assumed-size array is -1 */
+        if (desc->dim[i].extent == -1) { return i == desc->rank-1 && desc->dim[i].sm == sm; }
+        if (desc->dim[i].extent > 1 && desc->dim[i].sm != sm) { return 0; }
+        sm *= desc->dim[i].extent;
+    }
+    return 1;
+}
+
+/* Check that the array contains "count" elements of the datatype and return their size. */
+static int checkpoint_cdesc_size(const CFI_cdesc_t* desc, int64_t count, MPI_Datatype datatype,
+                                 size_t* size_in_bytes) {
+    int element_size = 0;
+    MPI_Type_size(datatype, &element_size);
+    size_t array_size = desc->elem_len;
+    for (int i=0; i<desc->rank; ++i) { array_size *= desc->dim[i].extent; }
+    *size_in_bytes = ((size_t)count)*element_size;
+    if (count < 0 || *size_in_bytes > array_size) { return MPI_ERR_ARG; }
+    /* the elements of array sections are copied in array element order */
+    if (checkpoint_type_get(datatype)) { return MPI_ERR_TYPE; }
+    return MPI_SUCCESS;
+}
+
+/* Copy the first bytes of the non-contiguous array in array element order
+   from the buffer (to_array=1) or to the buffer (to_array=0). */
+static void checkpoint_cdesc_copy(const CFI_cdesc_t* desc, char* buf, size_t size_in_bytes,
+                                  int to_array) {
+    CFI_index_t index[CFI_MAX_RANK] = {0};
+    const size_t elem_len = desc->elem_len;
+    while (size_in_bytes != 0) {
+        char* element = desc->base_addr;
+        for (int i=1; i<desc->rank; ++i) { element += index[i]*desc->dim[i].sm; }
+        for (CFI_index_t j=0; j<desc->dim[0].extent && size_in_bytes != 0; ++j) {
+            size_t n = size_in_bytes < elem_len ? size_in_bytes : elem_len;
+            if (to_array) {
+                memcpy(element, buf, n);
+            } else {
+                memcpy(buf, element, n);
+            }
+            element += desc->dim[0].sm;
+            buf += n;
+            size_in_bytes -= n;
+        }
+        int i = 1;
+        while (i < desc->rank && ++index[i] == desc->dim[i].extent) { index[i++] = 0; }
+        if (i == desc->rank) { break; }
+    }
+}
+
+/* Gather the array at the current position of the checkpoint. */
+static void checkpoint_write_cdesc_bytes(struct mpi_checkpoint* checkpoint,
+                                         const CFI_cdesc_t* desc, size_t size_in_bytes) {
+    checkpoint_grow(checkpoint, size_in_bytes);
+    checkpoint_trace_begin("checkpoint_write");
+    double t0 = checkpoint_clock();
+    checkpoint_cdesc_copy(desc, ((char*)checkpoint->data) + checkpoint->offset,
+                          size_in_bytes, 0);
+    checkpoint->counters[CHECKPOINT_COPY] += checkpoint_clock() - t0;
+    checkpoint_trace_end("checkpoint_write");
+    checkpoint->offset += size_in_bytes;
+    checkpoint->counters[CHECKPOINT_BYTES] += size_in_bytes;
+}
+
+static int checkpoint_write_cdesc(MPI_Checkpoint checkpoint, const CFI_cdesc_t* buf,
+                                  MPI_Count count, MPI_Datatype datatype) {
+    if (checkpoint_cdesc_contiguous(buf)) {
+        return MPI_Checkpoint_write_c(checkpoint, buf->base_addr, count, datatype);
+    }
+    size_t size_in_bytes = 0;
+    int ret = checkpoint_cdesc_size(buf, count, datatype, &size_in_bytes);
+    if (ret != MPI_SUCCESS) { return ret; }
+    int element_size = 0;
+    MPI_Type_size(datatype, &element_size);
+    checkpoint_add_record(checkpoint, CHECKPOINT_RECORD_PLAIN, size_in_bytes, element_size);
+    checkpoint_write_cdesc_bytes(checkpoint, buf, size_in_bytes);
+    return MPI_SUCCESS;
+}
+
+void mpi_checkpoint_write_cdesc(MPI_Fint* f_checkpoint, const CFI_cdesc_t* buf,
+                                MPI_Fint* count, MPI_Fint* datatype, MPI_Fint* error) {
+    *error = checkpoint_write_cdesc(MPI_Checkpoint_f2c(*f_checkpoint), buf, *count,
+                                    MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_write_c_cdesc(MPI_Fint* f_checkpoint, const CFI_cdesc_t* buf,
+                                  MPI_Count* count, MPI_Fint* datatype, MPI_Fint* error) {
+    *error = checkpoint_write_cdesc(MPI_Checkpoint_f2c(*f_checkpoint), buf, *count,
+                                    MPI_Type_f2c(*datatype));
+}
+
+static int checkpoint_read_cdesc(MPI_Checkpoint checkpoint, const CFI_cdesc_t* buf,
+                                 MPI_Count count, MPI_Datatype datatype) {
+    if (checkpoint_cdesc_contiguous(buf)) {
+        return MPI_Checkpoint_read_c(checkpoint, buf->base_addr, count, datatype);
+    }
+    size_t size_in_bytes = 0;
+    int ret = checkpoint_cdesc_size(buf, count, datatype, &size_in_bytes);
+    if (ret != MPI_SUCCESS) { return ret; }
+    if (checkpoint->offset + size_in_bytes > checkpoint->data_size) { return MPI_ERR_OTHER; }
+    checkpoint_trace_begin("checkpoint_read");
+    double t0 = checkpoint_clock();
+    checkpoint_cdesc_copy(buf, ((char*)checkpoint->data) + checkpoint->offset, size_in_bytes, 1);
+    checkpoint->counters[CHECKPOINT_COPY] += checkpoint_clock() - t0;
+    checkpoint_trace_end("checkpoint_read");
+    checkpoint->counters[CHECKPOINT_BYTES] += size_in_bytes;
+    checkpoint_read_advance(checkpoint, size_in_bytes);
+    return MPI_SUCCESS;
+}
+
+void mpi_checkpoint_read_cdesc(MPI_Fint* f_checkpoint, const CFI_cdesc_t* buf,
+                               MPI_Fint* count, MPI_Fint* datatype, MPI_Fint* error) {
+    *error = checkpoint_read_cdesc(MPI_Checkpoint_f2c(*f_checkpoint), buf, *count,
+                                   MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_read_c_cdesc(MPI_Fint* f_checkpoint, const CFI_cdesc_t* buf,
+                                 MPI_Count* count, MPI_Fint* datatype, MPI_Fint* error) {
+    *error = checkpoint_read_cdesc(MPI_Checkpoint_f2c(*f_checkpoint), buf, *count,
+                                   MPI_Type_f2c(*datatype));
+}
+
+static int checkpoint_write_at_cdesc(MPI_Checkpoint checkpoint, MPI_Offset offset,
+                                     const CFI_cdesc_t* buf, MPI_Count count,
+                                     MPI_Datatype datatype) {
+    if (checkpoint_cdesc_contiguous(buf)) {
+        return MPI_Checkpoint_write_at_c(checkpoint, offset, buf->base_addr, count, datatype);
+    }
+    size_t size_in_bytes = 0;
+    int ret = checkpoint_cdesc_size(buf, count, datatype, &size_in_bytes);
+    if (ret != MPI_SUCCESS) { return ret; }
+    if (!(checkpoint->flags & CHECKPOINT_WRITE_ONLY)) { return MPI_ERR_OTHER; }
+    if (offset < 0 || offset + size_in_bytes > checkpoint->offset) { return MPI_ERR_ARG; }
+    checkpoint_trace_begin("checkpoint_write_at");
+    pthread_rwlock_rdlock(&checkpoint->mapping_lock);
+    checkpoint_cdesc_copy(buf, ((char*)checkpoint->data) + offset, size_in_bytes, 0);
+    pthread_rwlock_unlock(&checkpoint->mapping_lock);
+    __atomic_add_fetch(&checkpoint->filled_bytes, size_in_bytes, __ATOMIC_RELEASE);
+    checkpoint_trace_end("checkpoint_write_at");
+    return MPI_SUCCESS;
+}
+
+void mpi_checkpoint_write_at_cdesc(MPI_Fint* f_checkpoint, MPI_Offset* offset,
+                                   const CFI_cdesc_t* buf, MPI_Fint* count, MPI_Fint* datatype,
+                                   MPI_Fint* error) {
+    *error = checkpoint_write_at_cdesc(MPI_Checkpoint_f2c(*f_checkpoint), *offset, buf, *count,
+                                       MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_write_at_c_cdesc(MPI_Fint* f_checkpoint, MPI_Offset* offset,
+                                     const CFI_cdesc_t* buf, MPI_Count* count, MPI_Fint* datatype,
+                                     MPI_Fint* error) {
+    *error = checkpoint_write_at_cdesc(MPI_Checkpoint_f2c(*f_checkpoint), *offset, buf, *count,
+                                       MPI_Type_f2c(*datatype));
+}
+
+static int checkpoint_read_at_cdesc(MPI_Checkpoint checkpoint, MPI_Offset offset,
+                                    const CFI_cdesc_t* buf, MPI_Count count,
+                                    MPI_Datatype datatype) {
+    if (checkpoint_cdesc_contiguous(buf)) {
+        return MPI_Checkpoint_read_at_c(checkpoint, offset, buf->base_addr, count, datatype);
+    }
+    size_t size_in_bytes = 0;
+    int ret = checkpoint_cdesc_size(buf, count, datatype, &size_in_bytes);
+    if (ret != MPI_SUCCESS) { return ret; }
+    if (!(checkpoint->flags & CHECKPOINT_READ_ONLY)) { return MPI_ERR_OTHER; }
+    if (offset < 0 || offset + size_in_bytes > checkpoint->offset) { return MPI_ERR_ARG; }
+    checkpoint_trace_begin("checkpoint_read_at");
+    checkpoint_cdesc_copy(buf, ((char*)checkpoint->data) + offset, size_in_bytes, 1);
+    checkpoint_trace_end("checkpoint_read_at");
+    return MPI_SUCCESS;
+}
+
+void mpi_checkpoint_read_at_cdesc(MPI_Fint* f_checkpoint, MPI_Offset* offset,
+                                  const CFI_cdesc_t* buf, MPI_Fint* count, MPI_Fint* datatype,
+                                  MPI_Fint* error) {
+    *error = checkpoint_read_at_cdesc(MPI_Checkpoint_f2c(*f_checkpoint), *offset, buf, *count,
+                                      MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_read_at_c_cdesc(MPI_Fint* f_checkpoint, MPI_Offset* offset,
+                                    const CFI_cdesc_t* buf, MPI_Count* count, MPI_Fint* datatype,
+                                    MPI_Fint* error) {
+    *error = checkpoint_read_at_cdesc(MPI_Checkpoint_f2c(*f_checkpoint), *offset, buf, *count,
+                                      MPI_Type_f2c(*datatype));
+}
+
+void mpi_checkpoint_write_subarray_cdesc(MPI_Fint* f_checkpoint, const CFI_cdesc_t* buf,
+                                         MPI_Fint* ndims, MPI_Fint* sizes, MPI_Fint* subsizes,
+                                         MPI_Fint* starts, MPI_Fint* order, MPI_Fint* datatype,
+                                         MPI_Fint* error) {
+    if (checkpoint_cdesc_contiguous(buf)) {
+        mpi_checkpoint_write_subarray_(f_checkpoint, buf->base_addr, ndims, sizes, subsizes,
+                                       starts, order, datatype, error);
+        return;
+    }
+    MPI_Checkpoint checkpoint = MPI_Checkpoint_f2c(*f_checkpoint);
+    int c_sizes[CHECKPOINT_MAX_DIMS], c_subsizes[CHECKPOINT_MAX_DIMS],
+        c_starts[CHECKPOINT_MAX_DIMS];
+    copy_fortran_dims(*ndims, sizes, c_sizes);
+    copy_fortran_dims(*ndims, subsizes, c_subsizes);
+    copy_fortran_dims(*ndims, starts, c_starts);
+    /* the descriptor describes the elements of the subarray */
+    MPI_Datatype c_datatype = MPI_Type_f2c(*datatype);
+    uint64_t dims[3][CHECKPOINT_MAX_DIMS];
+    int64_t count = checkpoint_subarray_dims(*ndims, c_sizes, c_subsizes, c_starts, *order,
+                                             dims[0], dims[1], dims[2]);
+    if (count < 0) { *error = MPI_ERR_ARG; return; }
+    size_t size_in_bytes = 0;
+    *error = checkpoint_cdesc_size(buf, count, c_datatype, &size_in_bytes);
+    if (*error != MPI_SUCCESS) { return; }
+    checkpoint_add_subarray(checkpoint, *ndims, c_sizes, c_subsizes, c_starts, *order, c_datatype);
+    checkpoint_write_cdesc_bytes(checkpoint, buf, size_in_bytes);
+}
+
+void mpi_checkpoint_read_subarray_cdesc(MPI_Fint* f_checkpoint, const CFI_cdesc_t* buf,
+                                        MPI_Fint* ndims, MPI_Fint* sizes, MPI_Fint* subsizes,
+                                        MPI_Fint* starts, MPI_Fint* order, MPI_Fint* datatype,
+                                        MPI_Fint* error) {
+    if (checkpoint_cdesc_contiguous(buf)) {
+        mpi_checkpoint_read_subarray_(f_checkpoint, buf->base_addr, ndims, sizes, subsizes,
+                                      starts, order, datatype, error);
+        return;
+    }
+    /* the parts of the subarrays of other ranks are copied to the temporary buffer */
+    int64_t count = 1;
+    for (int i=0; i<*ndims; ++i) { count *= subsizes[i]; }
+    size_t size_in_bytes = 0;
+    *error = checkpoint_cdesc_size(buf, count, MPI_Type_f2c(*datatype), &size_in_bytes);
+    if (*error != MPI_SUCCESS) { return; }
+    char* tmp = malloc(size_in_bytes);
+    if (!tmp && size_in_bytes != 0) { *error = MPI_ERR_NO_MEM; return; }
+    mpi_checkpoint_read_subarray_(f_checkpoint, tmp, ndims, sizes, subsizes, starts, order,
+                                  datatype, error);
+    if (*error == MPI_SUCCESS) { checkpoint_cdesc_copy(buf, tmp, size_in_bytes, 1); }
+    free(tmp);
+}
+
+/* The regions are copied by address, so array sections must be contiguous. */
+void mpi_checkpoint_register_cdesc(const CFI_cdesc_t* buf, MPI_Count* count, MPI_Fint* datatype,
+                                   const char* name, MPI_Fint* error) {
+    if (!checkpoint_cdesc_contiguous(buf)) { *error = MPI_ERR_ARG; return; }
+    *error = MPI_Checkpoint_register_c(buf->base_addr, *count, MPI_Type_f2c(*datatype), name);
+}
+#endif
+
 /*
 #pragma weak MPI_CHECKPOINT_READ = mpi_checkpoint_read_
 #pragma weak mpi_checkpoint_read = mpi_checkpoint_read_
@@ -49,6 +49,16 @@ enum {
 
 typedef struct mpi_checkpoint* MPI_Checkpoint;
 
+/** \brief The contiguous array of \link MPI_Checkpoint_writev\endlink. */
+typedef struct {
+    /** a pointer to the array */
+    void* buffer;
+    /** the size of the array in bytes */
+    MPI_Count size;
+    /** the size of the basic element of the array (e.g. 8 for \c double) */
+    int element_size;
+} MPI_Checkpoint_iovec;
+
 /**
   \brief Initialize MPI checkpoint library.
   \details
@@ -59,7 +69,11 @@ typedef struct mpi_checkpoint* MPI_Checkpoint;
   \arg \c MPI_CHECKPOINT_CONFIG --- a path to the configuration file.
   \arg \c MPI_NO_CHECKPOINT --- if this variable is set, checkpoints and restarts are disabled.
   \arg \c MPI_CHECKPOINT --- a path to the directory that contains checkpoint files that
-  are used to restore the program.
+  are used to restore the program. If the value is \c auto,
+  \link MPI_Checkpoint_restore\endlink restores the newest checkpoint
+  of \c checkpoint-prefix that is validated by \c background-validation (or that has
+  the metadata of \c durability if the validation is disabled), and the program starts
+  from the beginning if there is no such checkpoint.
   \section config Configuartion file
   This file contains options in a form of "key=value". Possible keys are listed below.
   \arg \c checkpoint-prefix --- a path that is prepended to the checkpoint directory name
@@ -69,11 +83,167 @@ typedef struct mpi_checkpoint* MPI_Checkpoint;
   (i.e. consecutive calls to \link MPI_Checkpoint_create\endlink). The following suffixes
   are supported: "s", "m", "h", "d" --- denoting seconds, minutes, hours, days respectively.
   Useful when you do not know how much time each iteration of the program takes.
+  The interval is measured by rank 0 and the decision is broadcast to the other ranks
+  one call in advance.
   Default value is 0.
   \arg \c verbose --- print a message each time a checkpoint is created or restored.
   Default value is 0.
   \arg \c compression-level --- set compression level of the checkpoints.
+  The payloads of \link MPI_Checkpoint_write\endlink (at least 4 KiB) are compressed
+  with \c compression-codec (deflate by default) in independent chunks of 1 MiB, and the chunks
+  are stored as is if they do not compress. Subarrays and the ranges
+  written with \link MPI_Checkpoint_write_at\endlink are not compressed.
   Maximum value is 9. Default value is 0 (compression is not used).
+  \arg \c compression-codec --- the codec of the compressed payloads: \c none, \c deflate
+  (the level is set by \c compression-level, 6 if it is 0) or \c lz (the built-in LZ77 codec
+  that is several times faster than deflate at a lower compression ratio).
+  The codec is recorded in the checkpoint file for each payload.
+  Default value is \c deflate if \c compression-level is non-zero and \c none otherwise.
+  \arg \c compression-autotune --- if non-zero, the codec of each payload of
+  \link MPI_Checkpoint_write\endlink is chosen on the first checkpoint and is reused for the
+  payloads with the same index in the next checkpoints (\c compression-level and
+  \c compression-codec are ignored). The codecs are chosen again when the storage bandwidth
+  is measured for the first time and when it changes by more than a factor of 2.
+  The sample of the payload (256 KiB in four pieces) is compressed with \c lz and with
+  deflate levels 1 and 6 with and without byte shuffling (the bytes of the elements up to
+  16 bytes are grouped by their position), and the codec with the minimum expected time of
+  compressing and storing the payload is chosen. The payload is stored as is if no codec is
+  faster than the storage. Default value is 0.
+  \arg \c storage-bandwidth --- the bandwidth of the storage in MB/s that is used by
+  \c compression-autotune. Default value is 0 (the bandwidth is measured when the files are
+  flushed by \link MPI_Checkpoint_close\endlink, the initial value is 500 MB/s).
+  \arg \c statistics-file --- rank 0 appends one record per created or restored checkpoint
+  to this file. The record contains the minimum, average and maximum over all ranks
+  of the time spent in each phase (mkdir, open, grow, copy, compress, sync, close, total)
+  in seconds, of the number of payload bytes and of the number of minor and major
+  page faults of the calling thread between create/restore and close. The file is written
+  in JSON lines format if its name ends with ".json", otherwise in CSV format. The values
+  are aggregated using one reduction in \link MPI_Checkpoint_close\endlink.
+  Default value is empty (statistics are not collected).
+  \arg \c checkpoint-slots --- the number of the last checkpoints that are kept when
+  the checkpoint files are reused (from 2 to 16). When the number of checkpoints
+  created by the program reaches this value, each new checkpoint takes the files
+  of the oldest one: the files are moved to the new directory, and are written
+  through the existing mappings without growing the files. The old directory is removed.
+  The files are not truncated: the table of contents is followed by the unused space,
+  and the footer is written at the end of the file. Default value is 0 (the files are
+  not reused and all checkpoints are kept).
+  \arg \c checkpoint-stripe-dirs --- the list of up to 16 directories separated by spaces or
+  commas, preferably on different devices. If the list is not empty, the file of each rank
+  is split into stripes that are stored in these directories in round-robin order.
+  The stripes are mapped to one contiguous range of addresses and are flushed to all
+  devices in parallel by \link MPI_Checkpoint_close\endlink. The checkpoint directory
+  contains only the "stripes" file that lists the directories, and
+  \link MPI_Checkpoint_restore\endlink reads all stripes in parallel.
+  The directories may be on the local devices of the nodes (each rank creates its
+  directories that are missing on the node), but \c checkpoint-prefix must be on the
+  storage shared by all nodes.
+  The files are not reused (\c checkpoint-slots is ignored).
+  Default value is empty (the files are not striped).
+  \arg \c checkpoint-stripe-size --- the size of one stripe in bytes, rounded up
+  to the page size. Default value is 16 MiB.
+  \arg \c background-drain --- if non-zero, \link MPI_Checkpoint_close\endlink passes the
+  file to the background thread that writes, truncates and closes it, and returns
+  without waiting for the storage. The checkpoint is staged in a memory file (outside the
+  page cache of the checkpoint file), and the thread writes it in 1 MiB chunks that are
+  limited by a token bucket, waiting for each chunk to reach the storage, so that
+  \c drain-rate limits the actual traffic to the device. Reused (\c checkpoint-slots)
+  and striped files are flushed by \link MPI_Checkpoint_close\endlink. All files are
+  written when \link MPI_Checkpoint_finalize\endlink or \c MPI_Finalize is called.
+  Default value is 0.
+  \arg \c drain-rate --- the maximum rate of the background drain in MB/s.
+  Default value is 0 (unlimited).
+  \arg \c drain-share --- the maximum slowdown of the solver iterations caused by
+  the background drain, as a fraction (0.05) or in percent (5%). The iterations are marked
+  with \link MPI_Checkpoint_iteration\endlink. The drain rate starts at \c drain-rate
+  (or 64 MB/s if the rate is unlimited), it is halved when the average time of the last three
+  iterations exceeds the time of the iterations without the drain by more than the share,
+  and is increased by 8 MB/s otherwise. Default value is 0 (the rate is fixed).
+  \arg \c restore-prefetch --- if non-zero and \c MPI_CHECKPOINT is set,
+  \link MPI_Checkpoint_init\endlink starts the thread that maps the file of the rank
+  (the rank in \c MPI_COMM_WORLD) and reads it into memory while the program initializes
+  itself, and \link MPI_Checkpoint_restore\endlink waits for the thread and uses the mapped
+  file. If the value is 2, the thread also decompresses the compressed payloads, and
+  \link MPI_Checkpoint_read\endlink copies them from the staging buffers.
+  Default value is 1.
+  \arg \c write-behind-window --- the size of the write-behind window in MiB. When the data
+  written to the checkpoint passes the end of the window, the window is passed to the storage
+  with \c sync_file_range while the next data is copied, and the window before it is waited
+  for and dropped from memory and from the page cache, so that at most two windows are dirty.
+  The reused (\c checkpoint-slots), striped, drained (\c background-drain) and
+  \c shm-tier files are flushed by \link MPI_Checkpoint_close\endlink as usual.
+  Default value is 64 (0 disables the write-behind).
+  \arg \c durability --- what \link MPI_Checkpoint_close\endlink waits for: \c none
+  (the files are left in the page cache), \c pagecache (the writeback of the files is
+  started, but close does not wait for it), \c fsync (each rank flushes its files) or
+  \c fsync+dirsync (the directories that contain the files are flushed as well).
+  The files of \c none and \c pagecache survive the crash of the program but not the crash
+  of the node, and they are not written behind (\c write-behind-window). If the level is set,
+  close waits for all ranks, and rank 0 writes the file "metadata" to the checkpoint
+  directory under a temporary name and atomically renames it. The file contains
+  the number of ranks, the time stamp and the durability level of the checkpoint, i.e.
+  a checkpoint without this file is incomplete, and the restart tooling uses the level
+  to decide whether the checkpoint survives a node reboot. \c background-drain is ignored
+  if the level is set. Default value is empty (the files are flushed as with \c fsync,
+  and the metadata is not written).
+  \arg \c background-validation --- if non-zero, the checksum of the data and the table
+  of contents is written to each file (the files can be read by the previous versions of
+  the library), and \link MPI_Checkpoint_close\endlink passes the file of the rank to
+  the thread with the lowest CPU and I/O priority that reads the file back with \c O_DIRECT
+  bypassing the page cache, checks the footer, the table of contents and the checksum,
+  and writes "validated <number of ranks>" or "bad <problem>" to the file
+  "<rank>.status" next to the file of the rank (next to its first stripe).
+  The checkpoint is validated when the files of all ranks are validated. The checksum
+  is computed from the mapping when the checkpoint is closed, i.e. the files are not
+  written behind (\c write-behind-window). The reused files (\c checkpoint-slots) are
+  not overwritten until they are validated, and \link MPI_Checkpoint_finalize\endlink
+  waits for the validation of the last checkpoint. Default value is 0.
+  \arg \c shm-tier --- if non-zero, \link MPI_Checkpoint_close\endlink copies the newest
+  checkpoint file of each rank to the POSIX shared memory segment
+  \c /mpi-checkpoint.<hash>.<rank> (the hash of the absolute path of the checkpoint
+  directory) that outlives the process, and
+  \link MPI_Checkpoint_restore\endlink maps the segment instead of reading the file if it
+  contains the requested checkpoint. The program that crashed or was killed restarts on the
+  same nodes from memory. The segments take the memory of \c /dev/shm, and they are
+  removed when the program finishes successfully. Default value is 0.
+  \arg \c shm-tier-keep --- if non-zero, the segments of \c shm-tier are not removed when
+  the program finishes. Default value is 0.
+  \arg \c lazy-restore --- if non-zero, \link MPI_Checkpoint_read\endlink registers the whole
+  pages of the contiguous arrays (at least 1 MiB) with \c userfaultfd and returns without
+  copying them. The pages are filled from the checkpoint file (or from the staging buffers
+  of \c restore-prefetch) by the background thread when the program touches them, and
+  the remaining pages are filled ahead of the demand. The arrays in the memory other than
+  private anonymous memory are copied as usual. The checkpoint may be closed before
+  all pages are filled. The system calls that access the pages wait for the thread, but
+  registering the pages with the network (RDMA) or accessing them from other processes
+  (CMA, XPMEM) before they are filled may fail, so the lazy restore must not be used if
+  the program passes the restored arrays to such transfers before touching all pages.
+  The lazy restore is disabled if \c userfaultfd cannot handle the faults of the kernel
+  (\c vm.unprivileged_userfaultfd is 0 and the process lacks \c CAP_SYS_PTRACE).
+  Default value is 0.
+  \arg \c arena-address --- the address of the mapping of
+  \link MPI_Checkpoint_arena_alloc\endlink (a multiple of 2 MiB). If the range is not
+  free, the arena is mapped at another address, and the addresses of the arrays change
+  after restart. Default value is 0x200000000000 (0 maps the arena at any address).
+  \arg \c arena-size --- the size of the address range that is reserved for the arena
+  in GiB. The memory is allocated when it is used. Default value is 64.
+  \arg \c huge-pages --- if non-zero, checkpoint files are mapped with \c MADV_HUGEPAGE
+  and the mappings grow and are freed in 2 MiB steps, which reduces the number of
+  page faults and TLB misses when large arrays are copied. Huge pages are used only if
+  transparent huge pages are enabled and the file system supports them (e.g. \c tmpfs).
+  Use \c statistics-file or performance variables to compare the number of page faults.
+  Default value is 0.
+  \arg \c trace-file --- enable the tracing of checkpoint phases, NPB timers and the regions
+  marked with \link MPI_Checkpoint_trace_begin\endlink. Each rank writes its events
+  to "<trace-file>.<rank>.json" in Chrome trace format at \c MPI_Finalize.
+  The timestamps are \c MPI_Wtime of the rank in microseconds. The offset of \c MPI_Wtime
+  of each rank relative to rank 0 is measured in \link MPI_Checkpoint_init\endlink
+  (which is collective if the tracing is enabled) and is applied by
+  \c common/mpi_checkpoint_trace_merge script that merges per-rank files into one
+  trace that can be opened in Perfetto or chrome://tracing.
+  Default value is empty (tracing is disabled).
+  \arg \c trace-buffer-size --- the maximum number of events that are kept for each thread.
+  When the buffer is full the oldest events are overwritten. Default value is 65536.
   */
 int MPI_Checkpoint_init();
 
@@ -84,6 +254,18 @@ int MPI_Checkpoint_init();
   in the supplied communicator. Checkpoint is a file that contains opaque
   data that is only meaningful to the program that wrote this data
   to the file.
+
+  This function is collective: all ranks of the communicator must call it.
+  Whether the checkpoint is created is decided by rank 0 in the previous call
+  and is delivered to the other ranks by non-blocking broadcast, so that all
+  ranks return the same value and no blocking communication is done
+  when the checkpoint is not created.
+
+  The checkpoint directory and its subdirectories are created by rank 0 only.
+  If \c checkpoint-prefix is on the local storage of the nodes, the other ranks create
+  their subdirectories on the nodes where rank 0 did not create them.
+  The file of each rank is stored as "<prefix>.<time>.checkpoint/<group>/<rank>"
+  where \c group is the hexadecimal number of the group of 256 consecutive ranks.
   \param[in] comm MPI communicator
   \param[out] checkpoint checkpoint handle that can be used to write the data to the file
   \return On success \c MPI_SUCCESS is returned. If the checkpoint was not
@@ -100,6 +282,11 @@ int MPI_Checkpoint_create(MPI_Comm comm, MPI_Checkpoint* checkpoint);
   \details
   This function copies the data from the \p buffer to the internal buffer associated with the
   checkpoint file. The implementation tries to free old unused internal buffer memory.
+
+  The \p type may be a non-contiguous derived datatype (e.g. a vector or a subarray
+  that excludes ghost cells), then only the elements of the type map are written
+  one after another. The type map is flattened when the datatype is first used
+  and is cached as the datatype attribute.
   \param[in] checkpoint checkpoint handle that can be used to write the data to the file
   \param[in] buffer a pointer to the array of \p type
   \param[in] count the number of elements in the \p buffer
@@ -108,11 +295,45 @@ int MPI_Checkpoint_create(MPI_Comm comm, MPI_Checkpoint* checkpoint);
   */
 int MPI_Checkpoint_write(MPI_Checkpoint checkpoint, const void* buffer, int count, MPI_Datatype type);
 
+/**
+  \brief Large-count version of \link MPI_Checkpoint_write\endlink.
+  \details
+  The number of elements is \c MPI_Count, so that more than 2 GiB
+  can be copied in one call. The Fortran binding takes \c INTEGER(KIND=MPI_COUNT_KIND) count.
+  */
+int MPI_Checkpoint_write_c(MPI_Checkpoint checkpoint, const void* buffer, MPI_Count count,
+                           MPI_Datatype type);
+
+/**
+  \brief Write a block of the distributed array to the checkpoint file.
+  \details
+  This function writes the block of the array that is distributed between
+  the ranks of the communicator. The position of the block within the array
+  is recorded in the checkpoint, so that the array can be restored using
+  any number of ranks (see \link MPI_Checkpoint_read_subarray\endlink).
+  The arguments have the same meaning as the arguments of \c MPI_Type_create_subarray,
+  however, \p buffer contains only the block of the array.
+  \param[in] checkpoint checkpoint handle that can be used to write the data to the file
+  \param[in] buffer a pointer to the block of the array
+  \param[in] ndims the number of array dimensions (at most 4)
+  \param[in] sizes the number of elements of the whole array in each dimension
+  \param[in] subsizes the number of elements of the block in each dimension
+  \param[in] starts the starting coordinates of the block in each dimension
+  \param[in] order array storage order flag (\c MPI_ORDER_C or \c MPI_ORDER_FORTRAN)
+  \param[in] type the type of the array element
+  \return On success \c MPI_SUCCESS is returned. If the arguments are invalid
+  \c MPI_ERR_ARG is returned.
+  */
+int MPI_Checkpoint_write_subarray(MPI_Checkpoint checkpoint, const void* buffer, int ndims,
+                                  const int sizes[], const int subsizes[], const int starts[],
+                                  int order, MPI_Datatype type);
+
 /**
   \brief Flush the data to the checkpoint file.
   \details
   This function writes remaining data to the checkpoint file, closes the
-  corresponding file descriptor and frees the memory.
+  corresponding file descriptor and frees the memory. This is a collective
+  operation if \c statistics-file or \c durability is set.
   \param[in,out] checkpoint checkpoint handle
   \return On success \c MPI_SUCCESS is returned. On error the program is terminated.
   */
@@ -125,6 +346,14 @@ int MPI_Checkpoint_close(MPI_Checkpoint* checkpoint);
   in the supplied communicator. Checkpoint is a file that contains opaque
   data that is only meaningful to the program that wrote this data
   to the file.
+
+  This function is collective. The checkpoint may have been created by
+  a different number of ranks. In this case the data written by
+  \link MPI_Checkpoint_write\endlink is read from the file of rank
+  <tt>rank % nprocs</tt> (where \c nprocs is the number of ranks that created
+  the checkpoint), i.e. it should be the same on all ranks,
+  and the distributed arrays written by \link MPI_Checkpoint_write_subarray\endlink
+  are redistributed between the new ranks.
   \param[in] comm MPI communicator
   \param[out] checkpoint checkpoint handle that can be used to read the data from the file
   \return On success \c MPI_SUCCESS is returned. If the checkpoint was not
@@ -140,7 +369,8 @@ int MPI_Checkpoint_restore(MPI_Comm comm, MPI_Checkpoint* checkpoint);
   \details
   This function copies the data from the internal buffer associated with the
   checkpoint file to \p buffer. The implementation tries to free old unused
-  internal buffer memory.
+  internal buffer memory. Non-contiguous derived datatypes are scattered
+  to the \p buffer (see \link MPI_Checkpoint_write\endlink).
   \param[in] checkpoint checkpoint handle that can be used to read the data from the file
   \param[in] buffer a pointer to the array of \p type
   \param[in] count the number of elements in the \p buffer
@@ -149,6 +379,345 @@ int MPI_Checkpoint_restore(MPI_Comm comm, MPI_Checkpoint* checkpoint);
   */
 int MPI_Checkpoint_read(MPI_Checkpoint checkpoint, void* buffer, int count, MPI_Datatype type);
 
+/**
+  \brief Large-count version of \link MPI_Checkpoint_read\endlink.
+  \details
+  The number of elements is \c MPI_Count, so that more than 2 GiB
+  can be copied in one call.
+  */
+int MPI_Checkpoint_read_c(MPI_Checkpoint checkpoint, void* buffer, MPI_Count count,
+                          MPI_Datatype type);
+
+/**
+  \brief Write multiple contiguous arrays to the checkpoint file.
+  \details
+  This function is equivalent to calling \link MPI_Checkpoint_write\endlink for each
+  array, but the datatypes are not queried, and the file is grown once for all arrays.
+  Each array is a separate record, the element size is used to compress the array,
+  and the array can be read either by \link MPI_Checkpoint_readv\endlink or by
+  \link MPI_Checkpoint_read\endlink with the datatype of the same size.
+  \param[in] checkpoint checkpoint handle that can be used to write the data to the file
+  \param[in] iov the arrays
+  \param[in] n the number of arrays
+  \return On success \c MPI_SUCCESS is returned. If the arguments are invalid
+  \c MPI_ERR_ARG is returned.
+  */
+int MPI_Checkpoint_writev(MPI_Checkpoint checkpoint, const MPI_Checkpoint_iovec* iov, int n);
+
+/**
+  \brief Read multiple contiguous arrays from the checkpoint file.
+  \details
+  This function is equivalent to calling \link MPI_Checkpoint_read\endlink for each
+  array without querying the datatypes.
+  \param[in] checkpoint checkpoint handle that can be used to read the data from the file
+  \param[in] iov the arrays
+  \param[in] n the number of arrays
+  \return On success \c MPI_SUCCESS is returned. If the arguments are invalid
+  \c MPI_ERR_ARG is returned. If the next records in the checkpoint file do not match
+  the arrays \c MPI_ERR_OTHER is returned.
+  */
+int MPI_Checkpoint_readv(MPI_Checkpoint checkpoint, const MPI_Checkpoint_iovec* iov, int n);
+
+/**
+  \brief Reserve the range of the checkpoint file for the array copied by many threads.
+  \details
+  This function appends the record of \p count elements of \p type to the checkpoint
+  (or skips the record when the checkpoint is restored) and returns the offset of
+  the reserved range in bytes. Then the threads copy the slices of the array using
+  \link MPI_Checkpoint_write_at\endlink (or \link MPI_Checkpoint_read_at\endlink)
+  concurrently, e.g. from OpenMP parallel loop. The data written this way is read
+  by \link MPI_Checkpoint_read\endlink as usual, and vice versa.
+
+  This function and all other functions except \c *_at are not thread-safe:
+  they must be called by one thread at a time for the same checkpoint.
+  They may be called while the other threads copy the data: the mapping of the file
+  is not moved while \c *_at functions copy, but the copies must finish before
+  \link MPI_Checkpoint_close\endlink.
+  The pages of the reserved ranges are not freed until the next
+  \link MPI_Checkpoint_read\endlink call, i.e. the threads must finish reading before that.
+  \param[in] checkpoint checkpoint handle
+  \param[in] count the number of elements
+  \param[in] type the type of the element
+  \param[out] offset the offset of the range in bytes
+  \return On success \c MPI_SUCCESS is returned. If the checkpoint does not
+  have enough data \c MPI_ERR_OTHER is returned.
+  */
+int MPI_Checkpoint_reserve_range(MPI_Checkpoint checkpoint, int count, MPI_Datatype type,
+                                 MPI_Offset* offset);
+
+/**
+  \brief Large-count version of \link MPI_Checkpoint_reserve_range\endlink.
+  \details
+  The number of elements is \c MPI_Count, so that more than 2 GiB
+  can be copied in one call.
+  */
+int MPI_Checkpoint_reserve_range_c(MPI_Checkpoint checkpoint, MPI_Count count,
+                                   MPI_Datatype type, MPI_Offset* offset);
+
+/**
+  \brief Write the data to the reserved range of the checkpoint file.
+  \details
+  This function is thread-safe. Multiple threads may write
+  to the non-overlapping parts of the ranges concurrently.
+  \param[in] checkpoint checkpoint handle
+  \param[in] offset the offset in bytes within the ranges returned by
+  \link MPI_Checkpoint_reserve_range\endlink
+  \param[in] buffer a pointer to the array of \p type
+  \param[in] count the number of elements in the \p buffer
+  \param[in] type the type of the buffer element
+  \return On success \c MPI_SUCCESS is returned. If the data is outside
+  of the reserved ranges \c MPI_ERR_ARG is returned.
+  */
+int MPI_Checkpoint_write_at(MPI_Checkpoint checkpoint, MPI_Offset offset, const void* buffer,
+                            int count, MPI_Datatype type);
+
+/**
+  \brief Large-count version of \link MPI_Checkpoint_write_at\endlink.
+  \details
+  The number of elements is \c MPI_Count, so that more than 2 GiB
+  can be copied in one call.
+  */
+int MPI_Checkpoint_write_at_c(MPI_Checkpoint checkpoint, MPI_Offset offset, const void* buffer,
+                              MPI_Count count, MPI_Datatype type);
+
+/**
+  \brief Read the data from the reserved range of the checkpoint file.
+  \details
+  This function is thread-safe.
+  \param[in] checkpoint checkpoint handle
+  \param[in] offset the offset in bytes within the ranges returned by
+  \link MPI_Checkpoint_reserve_range\endlink
+  \param[out] buffer a pointer to the array of \p type
+  \param[in] count the number of elements in the \p buffer
+  \param[in] type the type of the buffer element
+  \return On success \c MPI_SUCCESS is returned. If the data is outside
+  of the reserved ranges \c MPI_ERR_ARG is returned.
+  */
+int MPI_Checkpoint_read_at(MPI_Checkpoint checkpoint, MPI_Offset offset, void* buffer,
+                           int count, MPI_Datatype type);
+
+/**
+  \brief Large-count version of \link MPI_Checkpoint_read_at\endlink.
+  \details
+  The number of elements is \c MPI_Count, so that more than 2 GiB
+  can be copied in one call.
+  */
+int MPI_Checkpoint_read_at_c(MPI_Checkpoint checkpoint, MPI_Offset offset, void* buffer,
+                             MPI_Count count, MPI_Datatype type);
+
+/**
+  \brief Read a block of the distributed array from the checkpoint file.
+  \details
+  This function reads the block of the array that was written by
+  \link MPI_Checkpoint_write_subarray\endlink. The block may have different
+  size and position than the blocks that were written (e.g. if the checkpoint
+  was created by a different number of ranks), in which case the block is assembled
+  from the parts of the blocks written by all the ranks that intersect with it.
+  The dimensions and the type of the whole array must be the same.
+  \param[in] checkpoint checkpoint handle that can be used to read the data from the file
+  \param[in] buffer a pointer to the block of the array
+  \param[in] ndims the number of array dimensions (at most 4)
+  \param[in] sizes the number of elements of the whole array in each dimension
+  \param[in] subsizes the number of elements of the block in each dimension
+  \param[in] starts the starting coordinates of the block in each dimension
+  \param[in] order array storage order flag (\c MPI_ORDER_C or \c MPI_ORDER_FORTRAN)
+  \param[in] type the type of the array element
+  \return On success \c MPI_SUCCESS is returned. If the arguments are invalid
+  \c MPI_ERR_ARG is returned. If the next data in the checkpoint file
+  is not the same array \c MPI_ERR_OTHER is returned.
+  */
+int MPI_Checkpoint_read_subarray(MPI_Checkpoint checkpoint, void* buffer, int ndims,
+                                 const int sizes[], const int subsizes[], const int starts[],
+                                 int order, MPI_Datatype type);
+
+/**
+  \brief Register the array that is written to each checkpoint.
+  \details
+  This function adds the array to the list of regions that are written to the checkpoint
+  by \link MPI_Checkpoint_commit\endlink and read from the checkpoint by
+  \link MPI_Checkpoint_recover\endlink in the order of registration. It is called once
+  after the array is allocated, and the array must not be moved or freed while it is
+  registered. If the region with the same name is already registered, its array is
+  replaced, and its position in the list is not changed. Names longer than 63 characters
+  are truncated. In Fortran the array must be contiguous, and its actual argument
+  should have \c TARGET attribute.
+  \param[in] buffer a pointer to the array of \p type
+  \param[in] count the number of elements in the \p buffer
+  \param[in] type the type of the buffer element
+  \param[in] name the name of the region
+  \return On success \c MPI_SUCCESS is returned. If the arguments are invalid
+  \c MPI_ERR_ARG is returned.
+  */
+int MPI_Checkpoint_register(void* buffer, int count, MPI_Datatype type, const char* name);
+
+/**
+  \brief Large-count version of \link MPI_Checkpoint_register\endlink.
+  */
+int MPI_Checkpoint_register_c(void* buffer, MPI_Count count, MPI_Datatype type,
+                              const char* name);
+
+/**
+  \brief Write all registered regions to the new checkpoint.
+  \details
+  This function creates the checkpoint (see \link MPI_Checkpoint_create\endlink),
+  writes the registered regions and closes the checkpoint. The file and the table of
+  contents are allocated for all regions at once before the data is copied.
+  This function is collective.
+  \param[in] comm MPI communicator
+  \return On success \c MPI_SUCCESS is returned. If the checkpoint was not
+  created \c MPI_ERR_NO_CHECKPOINT is returned.
+  */
+int MPI_Checkpoint_commit(MPI_Comm comm);
+
+/**
+  \brief Read all registered regions from the checkpoint.
+  \details
+  This function restores the checkpoint (see \link MPI_Checkpoint_restore\endlink),
+  reads the registered regions and closes the checkpoint.
+  This function is collective.
+  \param[in] comm MPI communicator
+  \return On success \c MPI_SUCCESS is returned. If there is no checkpoint
+  \c MPI_ERR_NO_CHECKPOINT is returned. If the number of records in the checkpoint
+  is not the number of the registered regions, or the region can not be read,
+  \c MPI_ERR_OTHER is returned.
+  */
+int MPI_Checkpoint_recover(MPI_Comm comm);
+
+/**
+  \brief Allocate the array from the checkpoint arena.
+  \details
+  The arena is one anonymous mapping at the fixed address (\c arena-address) that is
+  aligned to the huge page size, and the arrays are allocated one after another with
+  64-byte alignment. The used part of the arena is registered as one region \c "arena"
+  (see \link MPI_Checkpoint_register\endlink), i.e. all arrays in the arena are written
+  by \link MPI_Checkpoint_commit\endlink and read by
+  \link MPI_Checkpoint_recover\endlink with one call. The program that restarts from
+  the checkpoint must allocate the same arrays in the same order, then the arrays have
+  the same addresses, and the pointers to the arena that are stored in the arena
+  stay valid. The contents of the new array are undefined.
+  \param[in] size the size of the array in bytes
+  \return The pointer to the array or \c NULL if the arena is full or can not be mapped.
+  */
+void* MPI_Checkpoint_arena_alloc(size_t size);
+
+/**
+  \brief Free the array allocated by \link MPI_Checkpoint_arena_alloc\endlink.
+  \details
+  The memory is released when the array and all arrays that were allocated after it
+  are freed.
+  \param[in] ptr the pointer to the array or \c NULL
+  */
+void MPI_Checkpoint_arena_free(void* ptr);
+
+/**
+  \brief Record the beginning of the named region in the trace.
+  \details
+  The event is recorded in the ring buffer of the calling thread
+  if the tracing is enabled by \c trace-file configuration parameter,
+  otherwise the function does nothing. Names longer than 31 characters are truncated.
+  \param[in] name the name of the region
+  \return \c MPI_SUCCESS
+  \see \link MPI_Checkpoint_init\endlink for the description of the trace file format.
+  */
+int MPI_Checkpoint_trace_begin(const char* name);
+
+/**
+  \brief Record the end of the named region in the trace.
+  \param[in] name the name of the region
+  \return \c MPI_SUCCESS
+  */
+int MPI_Checkpoint_trace_end(const char* name);
+
+/**
+  \brief Record the start of NPB timer \p n in the trace.
+  \details
+  Called by \c timer_start. The region is named "timer n".
+  \param[in] n timer number
+  \return \c MPI_SUCCESS
+  */
+int MPI_Checkpoint_trace_timer_start(int n);
+
+/**
+  \brief Record the stop of NPB timer \p n in the trace.
+  \param[in] n timer number
+  \return \c MPI_SUCCESS
+  */
+int MPI_Checkpoint_trace_timer_stop(int n);
+
+/**
+  \brief Mark the end of one iteration of the solver.
+  \details
+  The time between the calls is used to adapt the rate of the background drain
+  (\c drain-share configuration parameter). The call is cheap and does not communicate.
+  \return \c MPI_SUCCESS
+  */
+int MPI_Checkpoint_iteration();
+
+/**
+  \brief Get the number of performance variables.
+  \details
+  Performance variables are the counters that are accumulated over all checkpoints
+  created or restored by the calling process since the program was started.
+  The interface is similar to \c MPI_T_pvar_* functions (MPI libraries do not allow
+  to register performance variables from the outside), but there are no sessions and handles:
+  the variables can be read at any time from any thread, e.g. by the profiler
+  or the monitoring agent. The variables are updated in \link MPI_Checkpoint_close\endlink.
+  The following variables are defined.
+  \arg \c bytes_written, \c bytes_read --- the number of bytes passed to write/read functions
+  (\c MPI_UNSIGNED_LONG_LONG).
+  \arg \c bytes_stored --- the number of bytes stored in the files after compression
+  (\c MPI_UNSIGNED_LONG_LONG).
+  \arg \c num_created, \c num_restored --- the number of checkpoints
+  (\c MPI_UNSIGNED_LONG_LONG).
+  \arg \c create_time, \c restore_time --- total latency from create/restore
+  to close in seconds (\c MPI_DOUBLE).
+  \arg \c flush_time --- total time of synchronizing the files with the storage
+  in seconds (\c MPI_DOUBLE).
+  \arg \c last_create_time, \c last_restore_time --- the latency of the last
+  checkpoint in seconds (\c MPI_DOUBLE).
+  \arg \c compression_ratio --- \c bytes_written divided by \c bytes_stored (\c MPI_DOUBLE).
+  \arg \c async_writes --- the number of outstanding asynchronous writes, i.e. the files
+  that are queued or written by the background drain (\c MPI_UNSIGNED_LONG_LONG).
+  \arg \c minor_faults, \c major_faults --- the number of page faults of the calling thread
+  between create/restore and close (\c MPI_UNSIGNED_LONG_LONG).
+  \arg \c drain_rate --- the current rate of the background drain in MB/s,
+  0 if the rate is unlimited (\c MPI_DOUBLE).
+  \param[out] num the number of variables
+  \return \c MPI_SUCCESS
+  */
+int MPI_Checkpoint_pvar_get_num(int* num);
+
+/**
+  \brief Get the name, the type and the description of the performance variable.
+  \param[in] index the index of the variable from 0 to <tt>num-1</tt>
+  \param[out] name the name of the variable (may be \c NULL)
+  \param[out] datatype the type of the variable value (may be \c NULL)
+  \param[out] description the description of the variable (may be \c NULL)
+  \return On success \c MPI_SUCCESS is returned. If the index is invalid
+  \c MPI_ERR_ARG is returned.
+  */
+int MPI_Checkpoint_pvar_get_info(int index, const char** name, MPI_Datatype* datatype,
+                                 const char** description);
+
+/**
+  \brief Find the performance variable by its name.
+  \param[in] name the name of the variable
+  \param[out] index the index of the variable
+  \return On success \c MPI_SUCCESS is returned. If the variable is not
+  found \c MPI_ERR_ARG is returned.
+  */
+int MPI_Checkpoint_pvar_get_index(const char* name, int* index);
+
+/**
+  \brief Read the value of the performance variable.
+  \param[in] index the index of the variable
+  \param[out] buf a pointer to the value of the type returned by
+  \link MPI_Checkpoint_pvar_get_info\endlink
+  \return On success \c MPI_SUCCESS is returned. If the index is invalid
+  \c MPI_ERR_ARG is returned.
+  */
+int MPI_Checkpoint_pvar_read(int index, void* buf);
+
 /**
   \brief Finalize the library.
   \details
@@ -159,6 +728,15 @@ int MPI_Checkpoint_finalize();
 
 /**
   \brief Convert Fortran checkpoint handle to C checkpoint handle.
+  \details
+  Fortran handles are indices in the table of checkpoints. The entry is
+  freed when the checkpoint is closed and reused by the next checkpoint.
+
+  Fortran programs either include \c mpi_checkpointf.h and use implicit interfaces
+  or use the \c mpi_checkpoint_f08 module. The module declares the buffers as
+  assumed-type, assumed-rank arrays (\c TYPE(*), \c DIMENSION(..)), so that
+  array sections are copied directly to/from the checkpoint instead of
+  the temporary copies made by the compiler, and makes the error argument optional.
   \param[in] f_checkpoint Fortran checkpoint handle
   \return C checkpoint handle or \c MPI_CHECKPOINT_NULL if not found.
   */
@@ -168,7 +746,8 @@ MPI_Checkpoint MPI_Checkpoint_f2c(MPI_Fint f_checkpoint);
   \brief Convert C checkpoint handle to Fortran checkpoint handle.
   \param[in] c_checkpoint C checkpoint handle
   \return Fortran checkpoint handle or \c MPI_CHECKPOINT_NULL
-  (Fortran constant defined in \c mpi_checkpointf.h) if not found.
+  (Fortran constant defined in \c mpi_checkpointf.h and \c mpi_checkpoint_f08)
+  if the checkpoint was not created by Fortran bindings.
   */
 MPI_Fint MPI_Checkpoint_c2f(MPI_Checkpoint c_checkpoint);
 
@@ -0,0 +1,194 @@
+/*
+MPI-CHECKPOINT — C library that implements user-level MPI checkpoints.
+© 2021 Ivan Gankevich
+
+This file is part of MPI-CHECKPOINT.
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/
+
+#ifndef MPI_CHECKPOINT_HPP
+#define MPI_CHECKPOINT_HPP
+
+#include <mpi_checkpoint.h>
+
+#include <array>
+#include <complex>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+namespace mpi {
+
+/**
+  \brief The size of the basic element of the type in bytes.
+  \details
+  The size is used to compress the arrays (e.g. the real and the imaginary parts
+  of complex numbers are shuffled as separate doubles). Specialize this trait
+  for the structures that consist of the elements of the same type.
+  */
+template <class T>
+struct checkpoint_element_size: std::integral_constant<int,sizeof(T)> {};
+
+template <class T>
+struct checkpoint_element_size<std::complex<T>>: checkpoint_element_size<T> {};
+
+template <class T, std::size_t N>
+struct checkpoint_element_size<T[N]>: checkpoint_element_size<T> {};
+
+template <class T, std::size_t N>
+struct checkpoint_element_size<std::array<T,N>>: checkpoint_element_size<T> {};
+
+namespace bits {
+
+template <class T, class = void>
+struct is_contiguous_range: std::false_type {};
+
+template <class T>
+struct is_contiguous_range<T,std::void_t<decltype(std::data(std::declval<T&>())),
+                                         decltype(std::size(std::declval<T&>()))>>:
+    std::true_type {};
+
+/* Describe the contiguous range (std::span, std::vector, std::array, C array)
+   or the trivially copyable object. */
+template <class T>
+inline MPI_Checkpoint_iovec make_iovec(T& x) noexcept {
+    using value_type = std::remove_const_t<T>;
+    if constexpr (is_contiguous_range<T>::value) {
+        using element_type = std::remove_cv_t<std::remove_pointer_t<decltype(std::data(x))>>;
+        static_assert(std::is_trivially_copyable<element_type>::value,
+                      "checkpoint elements must be trivially copyable");
+        return {const_cast<element_type*>(std::data(x)),
+                static_cast<MPI_Count>(std::size(x)*sizeof(element_type)),
+                checkpoint_element_size<element_type>::value};
+    } else {
+        static_assert(std::is_trivially_copyable<value_type>::value,
+                      "checkpoint objects must be trivially copyable");
+        return {const_cast<value_type*>(&x), static_cast<MPI_Count>(sizeof(value_type)),
+                checkpoint_element_size<value_type>::value};
+    }
+}
+
+}
+
+/**
+  \brief The handle of the checkpoint that is closed when it goes out of scope.
+  \details
+  The handle is move-only. \link MPI_Checkpoint_close\endlink is collective if
+  \c statistics-file or \c durability is set, in which case all ranks must
+  destroy or close their handles in the same order.
+  */
+class checkpoint {
+
+private:
+    MPI_Checkpoint _handle = MPI_CHECKPOINT_NULL;
+
+public:
+
+    /**
+      Create the checkpoint (see \link MPI_Checkpoint_create\endlink).
+      The handle is empty if the checkpoint is not created.
+      */
+    static checkpoint create(MPI_Comm comm) noexcept {
+        MPI_Checkpoint handle = MPI_CHECKPOINT_NULL;
+        if (MPI_Checkpoint_create(comm, &handle) != MPI_SUCCESS) {
+            handle = MPI_CHECKPOINT_NULL;
+        }
+        return checkpoint(handle);
+    }
+
+    /**
+      Restore the checkpoint (see \link MPI_Checkpoint_restore\endlink).
+      The handle is empty if there is no checkpoint to restore from.
+      */
+    static checkpoint restore(MPI_Comm comm) noexcept {
+        MPI_Checkpoint handle = MPI_CHECKPOINT_NULL;
+        if (MPI_Checkpoint_restore(comm, &handle) != MPI_SUCCESS) {
+            handle = MPI_CHECKPOINT_NULL;
+        }
+        return checkpoint(handle);
+    }
+
+    checkpoint() noexcept = default;
+    /// Take the ownership of the C handle.
+    explicit checkpoint(MPI_Checkpoint handle) noexcept: _handle(handle) {}
+    ~checkpoint() noexcept { close(); }
+    checkpoint(const checkpoint&) = delete;
+    checkpoint& operator=(const checkpoint&) = delete;
+
+    checkpoint(checkpoint&& rhs) noexcept:
+    _handle(std::exchange(rhs._handle, MPI_CHECKPOINT_NULL)) {}
+
+    checkpoint& operator=(checkpoint&& rhs) noexcept {
+        if (this != &rhs) {
+            close();
+            this->_handle = std::exchange(rhs._handle, MPI_CHECKPOINT_NULL);
+        }
+        return *this;
+    }
+
+    /**
+      Write the arguments with one call to \link MPI_Checkpoint_writev\endlink.
+      Each argument is either a contiguous range of trivially copyable elements
+      (\c std::span, \c std::vector, \c std::array, C array) or a trivially
+      copyable object, and is stored as a separate record.
+      */
+    template <class ... Args>
+    int write(const Args& ... args) noexcept {
+        const std::array<MPI_Checkpoint_iovec,sizeof...(Args)> iov{bits::make_iovec(args)...};
+        return MPI_Checkpoint_writev(this->_handle, iov.data(), static_cast<int>(iov.size()));
+    }
+
+    /**
+      Read the arguments written by \link write\endlink with one call to
+      \link MPI_Checkpoint_readv\endlink. The ranges must have the same sizes.
+      */
+    template <class ... Args>
+    int read(Args&& ... args) noexcept {
+        const std::array<MPI_Checkpoint_iovec,sizeof...(Args)> iov{bits::make_iovec(args)...};
+        return MPI_Checkpoint_readv(this->_handle, iov.data(), static_cast<int>(iov.size()));
+    }
+
+    /// Close the checkpoint before the handle goes out of scope.
+    int close() noexcept {
+        if (this->_handle == MPI_CHECKPOINT_NULL) { return MPI_SUCCESS; }
+        return MPI_Checkpoint_close(&this->_handle);
+    }
+
+    /// Give up the ownership of the C handle.
+    MPI_Checkpoint release() noexcept {
+        return std::exchange(this->_handle, MPI_CHECKPOINT_NULL);
+    }
+
+    MPI_Checkpoint get() const noexcept { return this->_handle; }
+    explicit operator bool() const noexcept { return this->_handle != MPI_CHECKPOINT_NULL; }
+
+};
+
+}
+
+#endif // vim:filetype=cpp
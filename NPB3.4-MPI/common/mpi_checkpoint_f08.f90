@@ -0,0 +1,540 @@
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+!
+!  mpi_checkpoint_f08 module
+!
+!  Explicit interfaces of the checkpoint library. The buffers are
+!  assumed-type, assumed-rank arrays that are passed by descriptor,
+!  so array sections are copied directly between the array and the
+!  checkpoint without compiler-generated temporaries. The last
+!  argument (ierror) is optional.
+!
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      module mpi_checkpoint_f08
+
+      use, intrinsic :: iso_c_binding, only : c_int, c_char, c_null_char,  &
+     &     c_ptr, c_size_t
+      implicit none
+
+      include 'mpif.h'
+
+      private
+
+      integer, parameter, public :: MPI_CHECKPOINT_NULL = -1
+      integer, parameter, public :: MPI_ERR_NO_CHECKPOINT = 999
+
+      public :: mpi_checkpoint_init, mpi_checkpoint_finalize,  &
+     &          mpi_checkpoint_create, mpi_checkpoint_restore,  &
+     &          mpi_checkpoint_close,  &
+     &          mpi_checkpoint_write, mpi_checkpoint_read,  &
+     &          mpi_checkpoint_reserve_range,  &
+     &          mpi_checkpoint_write_at, mpi_checkpoint_read_at,  &
+     &          mpi_checkpoint_write_subarray,  &
+     &          mpi_checkpoint_read_subarray,  &
+     &          mpi_checkpoint_write_c, mpi_checkpoint_read_c,  &
+     &          mpi_checkpoint_reserve_range_c,  &
+     &          mpi_checkpoint_write_at_c, mpi_checkpoint_read_at_c,  &
+     &          mpi_checkpoint_register, mpi_checkpoint_register_c,  &
+     &          mpi_checkpoint_commit, mpi_checkpoint_recover,  &
+     &          mpi_checkpoint_arena_alloc, mpi_checkpoint_arena_free,  &
+     &          mpi_checkpoint_iteration
+
+      interface
+
+      subroutine c_init(ierror) bind(C, name='mpi_checkpoint_init_')
+      import c_int
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_init
+
+      subroutine c_finalize(ierror)  &
+     &     bind(C, name='mpi_checkpoint_finalize_')
+      import c_int
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_finalize
+
+      subroutine c_create(comm, checkpoint, ierror)  &
+     &     bind(C, name='mpi_checkpoint_create_')
+      import c_int
+      integer(c_int), intent(in) :: comm
+      integer(c_int), intent(out) :: checkpoint, ierror
+      end subroutine c_create
+
+      subroutine c_restore(comm, checkpoint, ierror)  &
+     &     bind(C, name='mpi_checkpoint_restore_')
+      import c_int
+      integer(c_int), intent(in) :: comm
+      integer(c_int), intent(out) :: checkpoint, ierror
+      end subroutine c_restore
+
+      subroutine c_close(checkpoint, ierror)  &
+     &     bind(C, name='mpi_checkpoint_close_')
+      import c_int
+      integer(c_int), intent(inout) :: checkpoint
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_close
+
+      subroutine c_write(checkpoint, buf, count, datatype, ierror)  &
+     &     bind(C, name='mpi_checkpoint_write_cdesc')
+      import c_int
+      integer(c_int), intent(in) :: checkpoint, count, datatype
+      type(*), dimension(..), intent(in) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_write
+
+      subroutine c_read(checkpoint, buf, count, datatype, ierror)  &
+     &     bind(C, name='mpi_checkpoint_read_cdesc')
+      import c_int
+      integer(c_int), intent(in) :: checkpoint, count, datatype
+      type(*), dimension(..), intent(inout) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_read
+
+      subroutine c_reserve_range(checkpoint, count, datatype, offset,  &
+     &     ierror) bind(C, name='mpi_checkpoint_reserve_range_')
+      import c_int, MPI_OFFSET_KIND
+      integer(c_int), intent(in) :: checkpoint, count, datatype
+      integer(kind=MPI_OFFSET_KIND), intent(out) :: offset
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_reserve_range
+
+      subroutine c_write_at(checkpoint, offset, buf, count, datatype,  &
+     &     ierror) bind(C, name='mpi_checkpoint_write_at_cdesc')
+      import c_int, MPI_OFFSET_KIND
+      integer(c_int), intent(in) :: checkpoint, count, datatype
+      integer(kind=MPI_OFFSET_KIND), intent(in) :: offset
+      type(*), dimension(..), intent(in) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_write_at
+
+      subroutine c_read_at(checkpoint, offset, buf, count, datatype,  &
+     &     ierror) bind(C, name='mpi_checkpoint_read_at_cdesc')
+      import c_int, MPI_OFFSET_KIND
+      integer(c_int), intent(in) :: checkpoint, count, datatype
+      integer(kind=MPI_OFFSET_KIND), intent(in) :: offset
+      type(*), dimension(..), intent(inout) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_read_at
+
+      subroutine c_write_subarray(checkpoint, buf, ndims, sizes,  &
+     &     subsizes, starts, order, datatype, ierror)  &
+     &     bind(C, name='mpi_checkpoint_write_subarray_cdesc')
+      import c_int
+      integer(c_int), intent(in) :: checkpoint, ndims, order, datatype
+      integer(c_int), intent(in) :: sizes(ndims), subsizes(ndims),  &
+     &     starts(ndims)
+      type(*), dimension(..), intent(in) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_write_subarray
+
+      subroutine c_read_subarray(checkpoint, buf, ndims, sizes,  &
+     &     subsizes, starts, order, datatype, ierror)  &
+     &     bind(C, name='mpi_checkpoint_read_subarray_cdesc')
+      import c_int
+      integer(c_int), intent(in) :: checkpoint, ndims, order, datatype
+      integer(c_int), intent(in) :: sizes(ndims), subsizes(ndims),  &
+     &     starts(ndims)
+      type(*), dimension(..), intent(inout) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_read_subarray
+
+      subroutine c_write_c(checkpoint, buf, count, datatype, ierror)  &
+     &     bind(C, name='mpi_checkpoint_write_c_cdesc')
+      import c_int, MPI_COUNT_KIND
+      integer(c_int), intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      type(*), dimension(..), intent(in) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_write_c
+
+      subroutine c_read_c(checkpoint, buf, count, datatype, ierror)  &
+     &     bind(C, name='mpi_checkpoint_read_c_cdesc')
+      import c_int, MPI_COUNT_KIND
+      integer(c_int), intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      type(*), dimension(..), intent(inout) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_read_c
+
+      subroutine c_reserve_range_c(checkpoint, count, datatype, offset,  &
+     &     ierror) bind(C, name='mpi_checkpoint_reserve_range_c_')
+      import c_int, MPI_COUNT_KIND, MPI_OFFSET_KIND
+      integer(c_int), intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      integer(kind=MPI_OFFSET_KIND), intent(out) :: offset
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_reserve_range_c
+
+      subroutine c_write_at_c(checkpoint, offset, buf, count, datatype,  &
+     &     ierror) bind(C, name='mpi_checkpoint_write_at_c_cdesc')
+      import c_int, MPI_COUNT_KIND, MPI_OFFSET_KIND
+      integer(c_int), intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      integer(kind=MPI_OFFSET_KIND), intent(in) :: offset
+      type(*), dimension(..), intent(in) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_write_at_c
+
+      subroutine c_read_at_c(checkpoint, offset, buf, count, datatype,  &
+     &     ierror) bind(C, name='mpi_checkpoint_read_at_c_cdesc')
+      import c_int, MPI_COUNT_KIND, MPI_OFFSET_KIND
+      integer(c_int), intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      integer(kind=MPI_OFFSET_KIND), intent(in) :: offset
+      type(*), dimension(..), intent(inout) :: buf
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_read_at_c
+
+      subroutine c_register(buf, count, datatype, name, ierror)  &
+     &     bind(C, name='mpi_checkpoint_register_cdesc')
+      import c_int, c_char, MPI_COUNT_KIND
+      type(*), dimension(..), intent(in) :: buf
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      integer(c_int), intent(in) :: datatype
+      character(kind=c_char), intent(in) :: name(*)
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_register
+
+      subroutine c_commit(comm, ierror)  &
+     &     bind(C, name='mpi_checkpoint_commit_')
+      import c_int
+      integer(c_int), intent(in) :: comm
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_commit
+
+      subroutine c_recover(comm, ierror)  &
+     &     bind(C, name='mpi_checkpoint_recover_')
+      import c_int
+      integer(c_int), intent(in) :: comm
+      integer(c_int), intent(out) :: ierror
+      end subroutine c_recover
+
+      function mpi_checkpoint_arena_alloc(size) result(ptr)  &
+     &     bind(C, name='MPI_Checkpoint_arena_alloc')
+      import c_ptr, c_size_t
+      integer(c_size_t), value, intent(in) :: size
+      type(c_ptr) :: ptr
+      end function mpi_checkpoint_arena_alloc
+
+      subroutine mpi_checkpoint_arena_free(ptr)  &
+     &     bind(C, name='MPI_Checkpoint_arena_free')
+      import c_ptr
+      type(c_ptr), value, intent(in) :: ptr
+      end subroutine mpi_checkpoint_arena_free
+
+      subroutine mpi_checkpoint_iteration()  &
+     &     bind(C, name='mpi_checkpoint_iteration_')
+      end subroutine mpi_checkpoint_iteration
+
+      end interface
+
+      contains
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_init(ierror)
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_init(c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_init
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_finalize(ierror)
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_finalize(c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_finalize
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_create(comm, checkpoint, ierror)
+      integer, intent(in) :: comm
+      integer, intent(out) :: checkpoint
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_create(comm, checkpoint, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_create
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_restore(comm, checkpoint, ierror)
+      integer, intent(in) :: comm
+      integer, intent(out) :: checkpoint
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_restore(comm, checkpoint, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_restore
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_close(checkpoint, ierror)
+      integer, intent(inout) :: checkpoint
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_close(checkpoint, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_close
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_write(checkpoint, buf, count, datatype,  &
+     &     ierror)
+      integer, intent(in) :: checkpoint, count, datatype
+      type(*), dimension(..), intent(in) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_write(checkpoint, buf, count, datatype, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_write
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_read(checkpoint, buf, count, datatype,  &
+     &     ierror)
+      integer, intent(in) :: checkpoint, count, datatype
+      type(*), dimension(..), intent(inout) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_read(checkpoint, buf, count, datatype, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_read
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_reserve_range(checkpoint, count,  &
+     &     datatype, offset, ierror)
+      integer, intent(in) :: checkpoint, count, datatype
+      integer(kind=MPI_OFFSET_KIND), intent(out) :: offset
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_reserve_range(checkpoint, count, datatype, offset,  &
+     &     c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_reserve_range
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_write_at(checkpoint, offset, buf, count,  &
+     &     datatype, ierror)
+      integer, intent(in) :: checkpoint, count, datatype
+      integer(kind=MPI_OFFSET_KIND), intent(in) :: offset
+      type(*), dimension(..), intent(in) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_write_at(checkpoint, offset, buf, count, datatype,  &
+     &     c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_write_at
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_read_at(checkpoint, offset, buf, count,  &
+     &     datatype, ierror)
+      integer, intent(in) :: checkpoint, count, datatype
+      integer(kind=MPI_OFFSET_KIND), intent(in) :: offset
+      type(*), dimension(..), intent(inout) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_read_at(checkpoint, offset, buf, count, datatype,  &
+     &     c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_read_at
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_write_subarray(checkpoint, buf, ndims,  &
+     &     sizes, subsizes, starts, order, datatype, ierror)
+      integer, intent(in) :: checkpoint, ndims, order, datatype
+      integer, intent(in) :: sizes(ndims), subsizes(ndims),  &
+     &     starts(ndims)
+      type(*), dimension(..), intent(in) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_write_subarray(checkpoint, buf, ndims, sizes, subsizes,  &
+     &     starts, order, datatype, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_write_subarray
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_read_subarray(checkpoint, buf, ndims,  &
+     &     sizes, subsizes, starts, order, datatype, ierror)
+      integer, intent(in) :: checkpoint, ndims, order, datatype
+      integer, intent(in) :: sizes(ndims), subsizes(ndims),  &
+     &     starts(ndims)
+      type(*), dimension(..), intent(inout) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_read_subarray(checkpoint, buf, ndims, sizes, subsizes,  &
+     &     starts, order, datatype, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_read_subarray
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_write_c(checkpoint, buf, count,  &
+     &     datatype, ierror)
+      integer, intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      type(*), dimension(..), intent(in) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_write_c(checkpoint, buf, count, datatype, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_write_c
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_read_c(checkpoint, buf, count,  &
+     &     datatype, ierror)
+      integer, intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      type(*), dimension(..), intent(inout) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_read_c(checkpoint, buf, count, datatype, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_read_c
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_reserve_range_c(checkpoint, count,  &
+     &     datatype, offset, ierror)
+      integer, intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      integer(kind=MPI_OFFSET_KIND), intent(out) :: offset
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_reserve_range_c(checkpoint, count, datatype, offset,  &
+     &     c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_reserve_range_c
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_write_at_c(checkpoint, offset, buf,  &
+     &     count, datatype, ierror)
+      integer, intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      integer(kind=MPI_OFFSET_KIND), intent(in) :: offset
+      type(*), dimension(..), intent(in) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_write_at_c(checkpoint, offset, buf, count, datatype,  &
+     &     c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_write_at_c
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_read_at_c(checkpoint, offset, buf,  &
+     &     count, datatype, ierror)
+      integer, intent(in) :: checkpoint, datatype
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      integer(kind=MPI_OFFSET_KIND), intent(in) :: offset
+      type(*), dimension(..), intent(inout) :: buf
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_read_at_c(checkpoint, offset, buf, count, datatype,  &
+     &     c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_read_at_c
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_register(buf, count, datatype, name,  &
+     &     ierror)
+      type(*), dimension(..), intent(in) :: buf
+      integer, intent(in) :: count, datatype
+      character(len=*), intent(in) :: name
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_register(buf, int(count, kind=MPI_COUNT_KIND), datatype,  &
+     &     trim(name)//c_null_char, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_register
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_register_c(buf, count, datatype, name,  &
+     &     ierror)
+      type(*), dimension(..), intent(in) :: buf
+      integer(kind=MPI_COUNT_KIND), intent(in) :: count
+      integer, intent(in) :: datatype
+      character(len=*), intent(in) :: name
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_register(buf, count, datatype, trim(name)//c_null_char,  &
+     &     c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_register_c
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_commit(comm, ierror)
+      integer, intent(in) :: comm
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_commit(comm, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_commit
+
+!---------------------------------------------------------------------
+!---------------------------------------------------------------------
+
+      subroutine mpi_checkpoint_recover(comm, ierror)
+      integer, intent(in) :: comm
+      integer, optional, intent(out) :: ierror
+      integer(c_int) c_ierror
+
+      call c_recover(comm, c_ierror)
+      if (present(ierror)) ierror = c_ierror
+      end subroutine mpi_checkpoint_recover
+
+      end module mpi_checkpoint_f08
@@ -10,6 +10,25 @@ const char* symbols[] = {
     "mpi_checkpoint_finalize",
     "mpi_checkpoint_write",
     "mpi_checkpoint_read",
+    "mpi_checkpoint_write_subarray",
+    "mpi_checkpoint_read_subarray",
+    "mpi_checkpoint_reserve_range",
+    "mpi_checkpoint_write_at",
+    "mpi_checkpoint_read_at",
+    "mpi_checkpoint_write_c",
+    "mpi_checkpoint_read_c",
+    "mpi_checkpoint_reserve_range_c",
+    "mpi_checkpoint_write_at_c",
+    "mpi_checkpoint_read_at_c",
+    "mpi_checkpoint_trace_begin",
+    "mpi_checkpoint_trace_end",
+    "mpi_checkpoint_trace_timer_start",
+    "mpi_checkpoint_trace_timer_stop",
+    "mpi_checkpoint_iteration",
+    "mpi_checkpoint_register",
+    "mpi_checkpoint_register_c",
+    "mpi_checkpoint_commit",
+    "mpi_checkpoint_recover",
 };
 
 void generate_weak_symbols() {
@@ -42,6 +42,7 @@
       include 'mpif.h'
 
       start(n) = MPI_Wtime()
+      call mpi_checkpoint_trace_timer_start(n)
 
       return
       end
@@ -67,6 +68,7 @@
       now = MPI_Wtime()
       t = now - start(n)
       elapsed(n) = elapsed(n) + t
+      call mpi_checkpoint_trace_timer_stop(n)
 
       return
       end
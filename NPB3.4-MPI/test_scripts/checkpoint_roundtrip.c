@@ -0,0 +1,47 @@
+/*
+Write the repetitive array to the checkpoint in the first run and check
+the array that is read from the checkpoint in the second run (MPI_CHECKPOINT is set).
+*/
+
+#include <mpi_checkpoint.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char* argv[]) {
+    const MPI_Count n = 3*1024*1024;
+    MPI_Init(&argc, &argv);
+    MPI_Checkpoint_init();
+    double* a = malloc(n*sizeof(double));
+    if (!a) {
+        fprintf(stderr, "not enough memory\n");
+        return 1;
+    }
+    int status = 0;
+    MPI_Checkpoint checkpoint;
+    if (MPI_Checkpoint_restore(MPI_COMM_WORLD, &checkpoint) == MPI_SUCCESS) {
+        if (MPI_Checkpoint_read_c(checkpoint, a, n, MPI_DOUBLE) != MPI_SUCCESS) { status = 1; }
+        MPI_Checkpoint_close(&checkpoint);
+        MPI_Count num_errors = 0;
+        for (MPI_Count i=0; i<n; ++i) {
+            if (a[i] != i*0.5) {
+                if (num_errors++ == 0) { fprintf(stderr, "a[%lld] = %g\n", (long long)i, a[i]); }
+            }
+        }
+        if (num_errors != 0) {
+            fprintf(stderr, "%lld elements differ\n", (long long)num_errors);
+            status = 1;
+        }
+    } else {
+        for (MPI_Count i=0; i<n; ++i) { a[i] = i*0.5; }
+        if (MPI_Checkpoint_create(MPI_COMM_WORLD, &checkpoint) != MPI_SUCCESS ||
+            MPI_Checkpoint_write_c(checkpoint, a, n, MPI_DOUBLE) != MPI_SUCCESS ||
+            MPI_Checkpoint_close(&checkpoint) != MPI_SUCCESS) {
+            status = 1;
+        }
+    }
+    free(a);
+    MPI_Checkpoint_finalize();
+    MPI_Finalize();
+    return status;
+}